@@ -52,6 +52,20 @@
 --
 prefix = os.getenv( "HOME" ) .. "/Maildir"
 
+--
+-- The search for maildirs may be limited, which helps with large or
+-- network-mounted hierarchies.  These must be set before maildir_prefix().
+--
+-- Maildirs whose path matches a regular expression in ignored_folders are
+-- skipped, directories matching pruned_folders aren't descended into, and
+-- maildir_max_depth limits how deep the search goes.
+--
+-- NOTE:  These are commented out by default.
+--
+-- ignored_folders   = { "spam$" }
+-- pruned_folders    = { "/\\.git$" }
+-- maildir_max_depth = 4
+
 --
 -- Ensure the directory exists, and abort with an error if it doesn't.
 --
@@ -163,6 +177,16 @@ maildir_format( "$CHECK - $UNREAD/$TOTAL - $PATH" )
 --        new  -> Show all unread messages.
 --       "pat" -> Show all messages which match the regular expression "pat".
 --
+--       "HEADER:name:pat" -> Show messages whose header matches "pat".
+--
+--       "QUERY:..." -> Show messages matching a query, for example:
+--
+--           QUERY:flag:S and from:steve and not subject:"cron job"
+--           QUERY:(size:>1M or date:..2014-01-31) and not flag:F
+--
+--         Terms may be combined with "and", "or", "not" and brackets.
+--         "flag:" and "size:" don't need the headers, so are quickest.
+--
 index_limit( "all" )
 
 
@@ -181,6 +205,8 @@ index_limit( "all" )
 --   $SUBJECT
 --   $TO
 --
+-- In both formats a field may be given a width, in characters, which
+-- it is padded to and truncated at, for example "$FROM{min:20 max:20}".
 --
 index_format( "[$FLAGS] $DAY/$MONTH/$YEAR $FROM - $SUBJECT" )
 
@@ -225,6 +251,20 @@ maildir_highlight_mode('bold standout')
 --
 -- Note: There is no filter by default.
 --
+-- The display is updated while a filter runs, and the output of each
+-- filter is cached.  A filter which takes more than "filter_timeout"
+-- seconds is killed, and the unfiltered message shown instead.  The
+-- default is thirty seconds:
+--
+-- filter_timeout = 30
+--
+-- The mail_filter, if set, is applied to each message before it is
+-- parsed.  Its output is kept in the cache_directory, so that each
+-- message is filtered once.  If the filter leaves the headers alone
+-- it can be skipped when reading them, which is much faster:
+--
+-- filter_headers = false
+--
 
 
 --
@@ -1069,6 +1109,9 @@ end
 --   For example this works in all modes:
 --      kemymap['global']['Q'] = 'exit()'
 --
+--   Bindings may also be functions:
+--      keymap['global']['Q'] = function() exit() end
+--
 keymap = {}
 keymap['global']  = {}
 keymap['index']   = {}
@@ -1232,6 +1275,13 @@ end
 --
 history_file( os.getenv( "HOME" ) .. "/.lumail.history" )
 
+
+--
+-- Cache the headers of messages, to speed up sorting & limiting, and
+-- the full-text index used by search("words") and "QUERY:body:words".
+--
+cache_directory( os.getenv( "HOME" ) .. "/.lumail/cache" )
+
 ---
 --
 --   Further primitives which are not included here are documented
@@ -18,16 +18,20 @@
 
 #pragma once
 
-#include <string.h>
+#include <glib.h>
+#include <string>
 
 #include "utfstring.h"
-#include <unordered_map>
 
 
 /**
  * A small class for holding and retrieving the attachments associated
  * with a particular message.
  *
+ * Only the description of the attachment is gathered when a message is
+ * parsed, the content is decoded when it is first needed, so listing
+ * the attachments of a message is cheap however large they are.
+ *
  * All the code here is inline, because the class is nothing more
  * than a simple wrapper object with no particular logic.
  *
@@ -39,21 +43,13 @@ public:
     /**
      * Constructor.
      */
-    CAttachment(UTFString name, void * body, size_t sz )
+    CAttachment(UTFString name, std::string type, int part, size_t encoded_size )
     {
-        /**
-         * Save the name away.
-         */
-        m_name = name;
-
-        /**
-         * Save the data away
-         */
-        m_data = (void *)malloc( sz );
-        assert(m_data);
-
-        memcpy( m_data, body, sz );
-        m_size = sz;
+        m_name         = name;
+        m_type         = type;
+        m_part         = part;
+        m_encoded_size = encoded_size;
+        m_data         = NULL;
     };
 
 
@@ -64,7 +60,7 @@ public:
     {
         if ( m_data != NULL )
         {
-            free( m_data );
+            g_byte_array_free( m_data, TRUE );
             m_data = NULL;
         }
     }
@@ -77,21 +73,61 @@ public:
 
 
     /**
-     * Return the body of the attachment.
+     * Return the MIME-type of the attachment.
+     */
+    std::string type() { return m_type; }
+
+
+    /**
+     * Return the offset of the MIME-part holding the attachment, amongst
+     * all the parts of the message which aren't multipart containers.
+     */
+    int part() { return m_part; }
+
+
+    /**
+     * Return the size of the attachment as stored in the message, before
+     * any transfer-encoding is removed.
+     */
+    size_t encoded_size() { return m_encoded_size; }
+
+
+    /**
+     * Has the content been decoded?
+     */
+    bool loaded() { return( m_data != NULL ); }
+
+
+    /**
+     * Set the decoded content, taking ownership of the array.
+     */
+    void set_content( GByteArray *data )
+    {
+        if ( m_data != NULL )
+            g_byte_array_free( m_data, TRUE );
+
+        m_data = data;
+    }
+
+
+    /**
+     * Return the body of the attachment, if it has been decoded.
      */
-    void *body() { return m_data; }
+    void *body() { return m_data ? m_data->data : NULL; }
 
 
     /**
-     * Return the size of the attachment.
+     * Return the size of the attachment, if it has been decoded.
      */
-    size_t size() { return m_size; }
+    size_t size() { return m_data ? m_data->len : 0; }
 
 private:
     /**
      * Stored objects.
      */
-    UTFString m_name;
-    void    * m_data;
-    size_t    m_size;
+    UTFString     m_name;
+    std::string   m_type;
+    int           m_part;
+    size_t        m_encoded_size;
+    GByteArray  * m_data;
 };
@@ -35,12 +35,16 @@
 #include "debug.h"
 #include "file.h"
 #include "global.h"
+#include "header_cache.h"
 #include "input.h"
 #include "lang.h"
 #include "lua.h"
 #include "maildir.h"
 #include "message.h"
+#include "prefetch.h"
 #include "screen.h"
+#include "search_index.h"
+#include "string_pool.h"
 #include "utfstring.h"
 #include "variables.h"
 
@@ -119,6 +123,11 @@ int abort(lua_State * L)
      */
     endwin();
 
+    /**
+     * Stop any background parsing before GMime goes away.
+     */
+    CHeaderPrefetch::Instance()->cancel();
+
     /**
      * Shutdown GMime.
      */
@@ -277,6 +286,11 @@ int clear(lua_State * L)
     CScreen::clear_main();
     refresh();
 
+    /**
+     * The current view must be redrawn.
+     */
+    CGlobal::Instance()->set_dirty();
+
     return 0;
 }
 
@@ -335,6 +349,12 @@ int exit(lua_State * L)
     CLua *lua = CLua::Instance();
     lua->execute("on_exit()");
 
+    /**
+     * Persist any newly-parsed headers.
+     */
+    CHeaderCache::Instance()->save();
+    CSearchIndex::Instance()->save();
+
     exit(0);
     return 0;
 }
@@ -376,6 +396,68 @@ int get_variables(lua_State *L )
 }
 
 
+/**
+ * Return a table of the header-cache statistics.
+ */
+int header_cache_stats(lua_State *L)
+{
+    CHeaderCache *cache = CHeaderCache::Instance();
+
+    lua_newtable(L);
+
+    lua_pushstring(L, "hits" );
+    lua_pushinteger(L, cache->hits() );
+    lua_settable(L,-3);
+
+    lua_pushstring(L, "misses" );
+    lua_pushinteger(L, cache->misses() );
+    lua_settable(L,-3);
+
+    return 1;
+}
+
+
+/**
+ * Return a table of the memory used by the messages in the index.
+ */
+int memory_stats(lua_State *L)
+{
+    CGlobal *global = CGlobal::Instance();
+    CMessageList *messages = global->get_messages();
+    assert(messages!=NULL);
+
+    size_t bytes = messages->capacity() * sizeof( CMessageList::value_type );
+    for (const std::shared_ptr<CMessage> &message : *messages )
+        bytes += message->memory_usage();
+
+    CStringPool *pool = CStringPool::Instance();
+
+    lua_newtable(L);
+
+    lua_pushstring(L, "messages" );
+    lua_pushinteger(L, messages->size() );
+    lua_settable(L,-3);
+
+    lua_pushstring(L, "message_bytes" );
+    lua_pushinteger(L, bytes );
+    lua_settable(L,-3);
+
+    lua_pushstring(L, "per_message" );
+    lua_pushinteger(L, messages->empty() ? 0 : bytes / messages->size() );
+    lua_settable(L,-3);
+
+    lua_pushstring(L, "strings" );
+    lua_pushinteger(L, pool->count() );
+    lua_settable(L,-3);
+
+    lua_pushstring(L, "string_bytes" );
+    lua_pushinteger(L, pool->bytes() );
+    lua_settable(L,-3);
+
+    return 1;
+}
+
+
 /**
  * Return the hostname to Lua.
  */
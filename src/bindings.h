@@ -105,6 +105,8 @@ int scroll_message_down(lua_State *L);
 int jump_message_to(lua_State *L);
 int scroll_message_to(lua_State *L);
 int scroll_message_up(lua_State *L);
+int search(lua_State *L);
+int set_flags(lua_State *L);
 int send_email(lua_State *L);
 int write_message_to_disk(lua_State *L);
 
@@ -180,9 +182,11 @@ int current_message(lua_State * L);
 int exec(lua_State * L);
 int exit(lua_State * L);
 int get_variables(lua_State *L );
+int header_cache_stats(lua_State *L);
 int hostname(lua_State *L );
 int log_message(lua_State *L);
 int lua_dump_stack(lua_State *L);
+int memory_stats(lua_State *L);
 int message_offset(lua_State * L);
 int mime_type(lua_State *L);
 int msg(lua_State * L);
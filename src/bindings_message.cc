@@ -22,7 +22,6 @@
 #include <cursesw.h>
 #include <fstream>
 #include <iostream>
-#include <pcrecpp.h>
 #include <string.h>
 
 
@@ -34,6 +33,8 @@
 #include "lua.h"
 #include "maildir.h"
 #include "message.h"
+#include "regex_cache.h"
+#include "search_index.h"
 #include "utfstring.h"
 #include "variables.h"
 
@@ -741,6 +742,9 @@ int compose(lua_State * L)
 
 /**
  * Count messages in the selected folder(s).
+ *
+ * If given "new" only the new messages are counted, and if given any
+ * other string only those messages with all of those flags.
  */
 int count_messages(lua_State * L)
 {
@@ -748,7 +752,17 @@ int count_messages(lua_State * L)
     CMessageList *messages = global->get_messages();
     assert(messages!=NULL);
 
-    lua_pushinteger(L, messages->size() );
+    const char *flags = NULL;
+    if (lua_isstring(L, 1))
+        flags = lua_tostring(L, 1);
+
+    if ( flags == NULL )
+        lua_pushinteger(L, messages->size() );
+    else if ( strcmp( flags, "new" ) == 0 )
+        lua_pushinteger(L, CMessage::count_new( *messages ) );
+    else
+        lua_pushinteger(L, CMessage::count_flags( *messages, CMessage::flag_mask( flags ) ) );
+
     return 1;
 }
 
@@ -838,10 +852,11 @@ int delete_message( lua_State *L )
     CFile::delete_file( msg->path().c_str() );
 
     /**
-     * Update messages
+     * Drop the message from the list, there is no need to rescan
+     * the folder for a single removal.
      */
     CGlobal *global = CGlobal::Instance();
-    global->update_messages();
+    global->remove_message( msg->path() );
     global->set_message_offset(0);
 
     /**
@@ -1518,10 +1533,11 @@ int save_message( lua_State *L )
     msg->remove();
 
     /**
-     * Update messages
+     * Drop the message from the list, there is no need to rescan
+     * the folder for a single removal.
      */
     CGlobal *global = CGlobal::Instance();
-    global->update_messages();
+    global->remove_message( msg->path() );
     global->set_message_offset(0);
 
     /**
@@ -1611,6 +1627,11 @@ int scroll_message_to( lua_State *L)
     if ( offset >= body.size() )
         offset = 0;
 
+    /**
+     * Compile the pattern once, rather than per-line.
+     */
+    std::shared_ptr<CRegex> re = CRegexCache::Instance()->get( str );
+
     /**
      * Iterate over the text
      */
@@ -1619,7 +1640,7 @@ int scroll_message_to( lua_State *L)
         UTFString line = "";
         line = body.at(offset);
 
-        if (pcrecpp::RE(str, pcrecpp::RE_Options().set_caseless(true)).PartialMatch(line.c_str()) )
+        if ( re->matches( line ) )
         {
             /**
              * We found a match.  Jump to it.
@@ -1658,6 +1679,75 @@ int scroll_message_up(lua_State *L)
 }
 
 
+/**
+ * Find the messages in the selected folder(s) which contain all the
+ * given words, using the full-text index.
+ */
+int search(lua_State *L)
+{
+    const char *str = lua_tostring(L, -1);
+    if (str == NULL)
+        return luaL_error(L, "Missing argument to search(..)");
+
+    CGlobal *global = CGlobal::Instance();
+    std::vector<std::string> folders = global->get_selected_folders();
+
+    CMessageList result;
+    for (std::string folder : folders)
+    {
+        std::vector<std::string> paths = CSearchIndex::Instance()->search( folder, str );
+
+        for (std::string path : paths)
+            result.push_back( std::make_shared<CMessage>( path ) );
+    }
+
+    if (!push_message_list(L, result))
+        return 0;
+
+    return 1;
+}
+
+
+/**
+ * Read the "add" and "remove" fields of the table at the given index.
+ */
+static void get_flag_changes(lua_State *L, int index, std::string &add, std::string &remove)
+{
+    luaL_checktype(L, index, LUA_TTABLE);
+
+    lua_getfield(L, index, "add");
+    if (lua_isstring(L, -1))
+        add = lua_tostring(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "remove");
+    if (lua_isstring(L, -1))
+        remove = lua_tostring(L, -1);
+    lua_pop(L, 1);
+}
+
+
+/**
+ * Add, and remove, flags from each of the given messages, renaming
+ * each only once.
+ *
+ * e.g. set_flags( messages, { add = "S", remove = "N" } )
+ */
+int set_flags(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    std::string add;
+    std::string remove;
+    get_flag_changes(L, 2, add, remove);
+
+    CMessageList messages = check_message_list(L, 1);
+
+    lua_pushinteger(L, CMessage::update_flags( messages, add, remove ) );
+    return 1;
+}
+
+
 /**
  * Send an email via lua-script.
  */
@@ -1899,6 +1989,23 @@ static int message_mt_remove_flag(lua_State *L)
     return 1;
 }
 
+static int message_mt_set_flags(lua_State *L)
+{
+    std::shared_ptr<CMessage> message = check_message(L, 1);
+    if (!message)
+    {
+        return luaL_error(L, "Invalid message.");
+    }
+
+    std::string add;
+    std::string remove;
+    get_flag_changes(L, 2, add, remove);
+
+    bool result = message->update_flags(add, remove);
+    lua_pushboolean(L, result);
+    return 1;
+}
+
 static int message_mt_copy(lua_State *L)
 {
     std::shared_ptr<CMessage> message = check_message(L, 1);
@@ -1989,6 +2096,7 @@ static const luaL_Reg message_mt_fields[] = {
     { "add_flag", message_mt_add_flag },
     { "has_flag", message_mt_has_flag },
     { "remove_flag", message_mt_remove_flag },
+    { "set_flags", message_mt_set_flags },
     { "copy",    message_mt_copy },
     { "remove",  message_mt_remove },
     { "header",  message_mt_header },
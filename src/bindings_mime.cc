@@ -227,16 +227,13 @@ int get_body_part(lua_State *L)
     }
 
     /**
-     * Where we'll store the size/data.
+     * Where we'll store the data.
      */
-    char *result = NULL;
-    size_t len = 0;
+    std::string result;
 
-    if ( msg->get_body_part(offset, &result, &len ) )
+    if ( msg->get_body_part(offset, result ) )
     {
-        lua_pushlstring(L, result, len);
-        free(result);
-
+        lua_pushlstring(L, result.data(), result.size());
         return 1;
     }
     else
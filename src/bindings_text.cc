@@ -21,7 +21,6 @@
 #include <algorithm>
 #include <cursesw.h>
 #include <cstdlib>
-#include <pcrecpp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -37,6 +36,7 @@
 #include "input.h"
 
 #include "maildir.h"
+#include "regex_cache.h"
 #include "screen.h"
 #include "utfstring.h"
 
@@ -111,6 +111,11 @@ int scroll_text_to( lua_State *L)
     if ( offset >= text.size() )
         offset = 0;
 
+    /**
+     * Compile the pattern once, rather than per-line.
+     */
+    std::shared_ptr<CRegex> re = CRegexCache::Instance()->get( str );
+
     /**
      * Iterate over the text
      */
@@ -119,7 +124,7 @@ int scroll_text_to( lua_State *L)
         UTFString line = "";
         line = text.at(offset);
 
-        if (pcrecpp::RE(str, pcrecpp::RE_Options().set_caseless(true)).PartialMatch(line.c_str()) )
+        if ( re->matches( line ) )
         {
             /**
              * We found a match.  Jump to it.
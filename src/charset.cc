@@ -0,0 +1,383 @@
+/**
+ * charset.cc - Conversion of message-text to UTF-8.
+ *
+ * This file is part of lumail: http://lumail.org/
+ *
+ * Copyright (c) 2013-2014 by Steve Kemp.  All rights reserved.
+ *
+ **
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 dated June, 1991, or (at your
+ * option) any later version.
+ *
+ * On Debian GNU/Linux systems, the complete text of version 2 of the GNU
+ * General Public License can be found in `/usr/share/common-licenses/GPL-2'
+ */
+
+#include <algorithm>
+#include <errno.h>
+#include <iconv.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <gmime/gmime.h>
+
+#include "charset.h"
+#include "debug.h"
+
+
+/**
+ * The most converters we'll hold open at once.
+ */
+#define MAX_CONVERTERS 16
+
+
+/**
+ * Is the named, lower-cased, character set UTF-8?
+ */
+static bool is_utf8_charset( const std::string &charset )
+{
+    return( charset.empty() || charset == "utf-8" || charset == "utf8" );
+}
+
+
+/**
+ * Does the named, lower-cased, character set represent ASCII text as
+ * ASCII?  This is true of almost all of them, except for the wide
+ * encodings, and those which use escape-sequences.
+ */
+static bool is_ascii_superset( const std::string &charset )
+{
+    static const char *exceptions[] = { "utf-7", "utf-16", "utf-32", "ucs", "iso-2022", "hz", 0 };
+
+    for( int i = 0; exceptions[i] != 0; i++ )
+    {
+        if ( charset.compare( 0, strlen( exceptions[i] ), exceptions[i] ) == 0 )
+            return false;
+    }
+    return true;
+}
+
+
+/**
+ * Instance-handle.
+ */
+CCharset *CCharset::pinstance = NULL;
+
+
+/**
+ * Get access to our singleton-object.
+ */
+CCharset *CCharset::Instance()
+{
+    if (!pinstance)
+        pinstance = new CCharset;
+
+    return pinstance;
+}
+
+
+/**
+ * Constructor - This is private as this class is a singleton.
+ */
+CCharset::CCharset()
+{
+}
+
+
+/**
+ * Is the given text pure seven-bit ASCII?
+ *
+ * The text is tested a word at a time, without branching, which the
+ * compiler is free to vectorize.
+ */
+bool CCharset::is_ascii( const char *data, size_t len )
+{
+    uint64_t bits = 0;
+    size_t i      = 0;
+
+    for( ; i + sizeof( uint64_t ) <= len; i += sizeof( uint64_t ) )
+    {
+        uint64_t word;
+        memcpy( &word, data + i, sizeof( word ) );
+        bits |= word;
+    }
+
+    for( ; i < len; i++ )
+        bits |= (unsigned char) data[i];
+
+    return( ( bits & 0x8080808080808080ULL ) == 0 );
+}
+
+
+/**
+ * Read the given stream, appending its text to the output as UTF-8.
+ */
+bool CCharset::to_utf8( const char *charset, GMimeStream *stream, std::string &output )
+{
+    std::string cs = charset ? charset : "";
+    std::transform( cs.begin(), cs.end(), cs.begin(), tolower );
+
+    /**
+     * Text which is already UTF-8, or which is ASCII, needs no conversion.
+     */
+    bool utf8   = is_utf8_charset( cs );
+    bool ascii  = !utf8 && is_ascii_superset( cs );
+    bool result = true;
+
+    /**
+     * The lock is only taken once a converter is needed.
+     */
+    std::unique_lock<std::mutex> lock( m_lock, std::defer_lock );
+    iconv_t cd = (iconv_t) -1;
+
+    char buf[4096];
+    size_t held = 0;
+
+    while( !g_mime_stream_eos( stream ) )
+    {
+        ssize_t len = g_mime_stream_read( stream, buf + held, sizeof(buf) - held );
+        if ( len < 0 )
+            break;
+
+        len += held;
+        held = 0;
+
+        /**
+         * Once we've started converting we carry on, as the converter
+         * may be part-way through a character, or shift-sequence.
+         */
+        if ( ascii && !utf8 && ( cd == (iconv_t) -1 ) && is_ascii( buf, len ) )
+        {
+            output.append( buf, len );
+            continue;
+        }
+
+        if ( !utf8 && ( cd == (iconv_t) -1 ) )
+        {
+            lock.lock();
+            cd = converter( cs );
+            if ( cd == (iconv_t) -1 )
+            {
+                utf8   = true;
+                result = false;
+            }
+        }
+
+        if ( utf8 )
+        {
+            held = validate( buf, len, output, false );
+            memmove( buf, buf + len - held, held );
+            continue;
+        }
+
+        held = convert( cd, buf, len, output, false );
+        memmove( buf, buf + len - held, held );
+    }
+
+    if ( utf8 )
+        validate( buf, held, output, true );
+
+    if ( cd != (iconv_t) -1 )
+    {
+        convert( cd, buf, held, output, true );
+
+        /**
+         * Flush any shift-state, and reset the converter for its next use.
+         */
+        char *out = buf;
+        size_t out_left = sizeof(buf);
+        iconv( cd, NULL, NULL, &out, &out_left );
+        output.append( buf, out - buf );
+    }
+
+    return( result );
+}
+
+
+/**
+ * Convert the given buffer, appending the result to the output.
+ */
+size_t CCharset::convert( iconv_t cd, char *data, size_t len, std::string &output, bool final )
+{
+    char buf[4096];
+    char *in = data;
+    size_t in_left = len;
+
+    while( in_left > 0 )
+    {
+        char *out = buf;
+        size_t out_left = sizeof(buf);
+
+        size_t ret = iconv( cd, &in, &in_left, &out, &out_left );
+        output.append( buf, out - buf );
+
+        if ( ret == (size_t) -1 )
+        {
+            if ( errno == E2BIG )
+                continue;
+
+            /**
+             * Replace invalid input, and carry on.
+             */
+            if ( errno == EILSEQ )
+            {
+                output += '?';
+                in++;
+                in_left--;
+                continue;
+            }
+
+            /**
+             * A character continues into the next buffer, unless
+             * there isn't one.
+             */
+            if ( !final )
+                return( in_left );
+
+            output += '?';
+            break;
+        }
+    }
+
+    return( 0 );
+}
+
+
+/**
+ * Get the converter from the given character set to UTF-8.
+ */
+iconv_t CCharset::converter( const std::string &charset )
+{
+    std::unordered_map<std::string, iconv_t>::iterator it = m_converters.find( charset );
+    if ( it != m_converters.end() )
+        return( it->second );
+
+    /**
+     * Very few character sets are used, but don't hold an unbounded
+     * number of converters open.
+     */
+    if ( m_converters.size() >= MAX_CONVERTERS )
+    {
+        for( it = m_converters.begin(); it != m_converters.end(); ++it )
+        {
+            if ( it->second != (iconv_t) -1 )
+                g_mime_iconv_close( it->second );
+        }
+        m_converters.clear();
+    }
+
+    /**
+     * Failures are remembered too, so unsupported character sets are
+     * only looked up once.
+     */
+    iconv_t cd = g_mime_iconv_open( "UTF-8", charset.c_str() );
+    if ( cd == (iconv_t) -1 )
+        DEBUG_LOG( "CCharset::converter - unsupported character set " + charset );
+
+    m_converters[charset] = cd;
+    return( cd );
+}
+
+
+/**
+ * The length of the UTF-8 sequence at the start of the given data: zero
+ * if it is invalid.  If the data ends part-way through an otherwise valid
+ * sequence then incomplete is set.
+ */
+static size_t sequence_length( const unsigned char *data, size_t len, bool &incomplete )
+{
+    unsigned char c = data[0];
+    size_t need;
+    unsigned char low  = 0x80;
+    unsigned char high = 0xBF;
+
+    incomplete = false;
+
+    if ( c < 0x80 )
+        return 1;
+    else if ( c >= 0xC2 && c <= 0xDF )
+        need = 2;
+    else if ( c >= 0xE0 && c <= 0xEF )
+    {
+        need = 3;
+        if ( c == 0xE0 )
+            low = 0xA0;
+        if ( c == 0xED )
+            high = 0x9F;
+    }
+    else if ( c >= 0xF0 && c <= 0xF4 )
+    {
+        need = 4;
+        if ( c == 0xF0 )
+            low = 0x90;
+        if ( c == 0xF4 )
+            high = 0x8F;
+    }
+    else
+        return 0;
+
+    /**
+     * Only the second byte has a restricted range, which excludes
+     * overlong forms, surrogates, and values beyond U+10FFFF.
+     */
+    for( size_t i = 1; i < need; i++ )
+    {
+        if ( i >= len )
+        {
+            incomplete = true;
+            return 0;
+        }
+
+        unsigned char b = data[i];
+        if ( ( i == 1 ) ? ( b < low || b > high ) : ( b < 0x80 || b > 0xBF ) )
+            return 0;
+    }
+    return( need );
+}
+
+
+/**
+ * Append the given buffer of UTF-8 to the output, replacing invalid bytes.
+ */
+size_t CCharset::validate( const char *data, size_t len, std::string &output, bool final )
+{
+    if ( is_ascii( data, len ) )
+    {
+        output.append( data, len );
+        return( 0 );
+    }
+
+    const unsigned char *p = (const unsigned char *) data;
+    size_t start = 0;
+    size_t i     = 0;
+
+    while( i < len )
+    {
+        bool incomplete;
+        size_t n = sequence_length( p + i, len - i, incomplete );
+        if ( n > 0 )
+        {
+            i += n;
+            continue;
+        }
+
+        output.append( data + start, i - start );
+
+        /**
+         * A character continues into the next buffer, unless there
+         * isn't one.
+         */
+        if ( incomplete && !final )
+            return( len - i );
+
+        output += '?';
+        i += 1;
+        start = i;
+    }
+
+    output.append( data + start, len - start );
+    return( 0 );
+}
@@ -0,0 +1,118 @@
+/**
+ * charset.h - Conversion of message-text to UTF-8.
+ *
+ * This file is part of lumail: http://lumail.org/
+ *
+ * Copyright (c) 2013-2014 by Steve Kemp.  All rights reserved.
+ *
+ **
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 dated June, 1991, or (at your
+ * option) any later version.
+ *
+ * On Debian GNU/Linux systems, the complete text of version 2 of the GNU
+ * General Public License can be found in `/usr/share/common-licenses/GPL-2'
+ */
+
+#pragma once
+
+#include <gmime/gmime.h>
+#include <iconv.h>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+
+/**
+ * Singleton class which converts the text of MIME-parts to UTF-8.
+ *
+ * The text is read from a stream a buffer at a time, and appended to
+ * the output, so it is never held in full other than as the result.
+ * Buffers which are already UTF-8, or pure ASCII in a character set
+ * which is a superset of ASCII, are passed through untouched.  Anything
+ * else is converted with an iconv converter which is opened once per
+ * character set, and then reused.
+ *
+ * Converters hold state, so only one thread converts at a time.
+ */
+class CCharset
+{
+
+public:
+
+    /**
+     * Get access to the singleton instance.
+     */
+    static CCharset *Instance();
+
+    /**
+     * Read the given stream to its end, appending its text, in the named
+     * character set, to the output as UTF-8.
+     *
+     * A NULL, or empty, character set is taken to be UTF-8.  Invalid
+     * input is replaced with "?".  Returns false only if the character
+     * set is unsupported, in which case the text is appended unconverted,
+     * other than the replacement of anything which isn't valid UTF-8.
+     */
+    bool to_utf8( const char *charset, GMimeStream *stream, std::string &output );
+
+    /**
+     * Is the given text pure seven-bit ASCII?
+     */
+    static bool is_ascii( const char *data, size_t len );
+
+protected:
+
+    /**
+     * Protected functions to allow our singleton implementation.
+     */
+    CCharset();
+    CCharset(const CCharset &);
+    CCharset & operator=(const CCharset &);
+
+private:
+
+    /**
+     * Get the converter from the given, lower-cased, character set to
+     * UTF-8, opening it if required.
+     *
+     * Returns (iconv_t)-1 if the character set is unsupported.
+     */
+    iconv_t converter( const std::string &charset );
+
+    /**
+     * Convert the given buffer, appending the result to the output.
+     *
+     * Returns the number of bytes at the end of the buffer which form an
+     * incomplete character, and should be converted with the next.  If
+     * this is the final buffer they are replaced with "?" instead.
+     */
+    size_t convert( iconv_t cd, char *data, size_t len, std::string &output, bool final );
+
+    /**
+     * Append the given buffer of UTF-8 to the output, replacing any
+     * invalid bytes with "?".
+     *
+     * Returns the number of bytes at the end of the buffer which form an
+     * incomplete character, as convert() does.
+     */
+    static size_t validate( const char *data, size_t len, std::string &output, bool final );
+
+    /**
+     * The single instance of this class.
+     */
+    static CCharset *pinstance;
+
+    /**
+     * The converters we've opened, keyed by lower-cased character set.
+     */
+    std::unordered_map<std::string, iconv_t> m_converters;
+
+    /**
+     * Protects the converters, which are shared by every thread.
+     */
+    std::mutex m_lock;
+
+};
@@ -34,6 +34,7 @@
 #include "file.h"
 #include "maildir.h"
 #include "variables.h"
+#include "walker.h"
 
 #ifndef FILE_READ_BUFFER
 # define FILE_READ_BUFFER 16384
@@ -150,6 +151,34 @@ std::vector<std::string> CFile::files_in_directory(std::string path)
 }
 
 
+/**
+ * Create a directory, and any missing parents.
+ */
+bool CFile::make_directories( std::string path, mode_t mode )
+{
+    if ( path.empty() || CFile::is_directory( path ) )
+        return true;
+
+    /**
+     * Create the parent first.
+     */
+    size_t slash = path.find_last_not_of( '/' );
+    if ( slash != std::string::npos )
+        slash = path.rfind( '/', slash );
+
+    if ( ( slash != std::string::npos ) && ( slash > 0 ) )
+        make_directories( path.substr( 0, slash ), mode );
+
+    if ( mkdir( path.c_str(), mode ) == 0 )
+        return true;
+
+    /**
+     * We might have raced with another creator.
+     */
+    return( CFile::is_directory( path ) );
+}
+
+
 /**
  * Remove a file.
  */
@@ -344,56 +373,8 @@ bool CFile::file_to_pipe( std::string src, std::string cmd )
  */
 std::vector<std::string> CFile::get_all_maildirs(std::string prefix)
 {
-    std::vector<std::string> result;
-    dirent *de;
-    DIR *dp;
-
-    prefix = prefix.empty()? "." : prefix.c_str();
-    dp = opendir(prefix.c_str());
-    if (dp)
-    {
-        if (CMaildir::is_maildir(prefix))
-            result.push_back(prefix);
-
-        while (true)
-        {
-            de = readdir(dp);
-            if (de == NULL)
-                break;
-
-            if ( ( strcmp( de->d_name, "." ) != 0 ) &&
-                 ( strcmp( de->d_name, ".." ) != 0 ) &&
-                 ( ( de->d_type == DT_UNKNOWN) ||
-                   ( de->d_type == DT_DIR ) ) )
-            {
-                std::string subdir_name = std::string(de->d_name);
-                std::string subdir_path = std::string(prefix + "/" + subdir_name);
-                if (CMaildir::is_maildir(subdir_path))
-                    result.push_back(subdir_path);
-                else
-                {
-                    if (subdir_name != "." && subdir_name != "..")
-                    {
-                        DIR* sdp = opendir(subdir_path.c_str());
-                        if (sdp)
-                        {
-                            closedir(sdp);
-                            std::vector<std::string> sub_maildirs;
-                            sub_maildirs = CFile::get_all_maildirs(subdir_path);
-                            for (std::string sub_maildir: sub_maildirs)
-                            {
-                                result.push_back(sub_maildir);
-                            }
-                        }
-                    }
-                }
-            }
-        }
-        closedir(dp);
-        std::sort(result.begin(), result.end());
-    }
-
-    return result;
+    CMaildirWalker walker;
+    return( walker.walk( prefix ) );
 }
 
 
@@ -20,6 +20,7 @@
 
 #include <vector>
 #include <string>
+#include <sys/types.h>
 
 
 /**
@@ -48,6 +49,12 @@ public:
     static bool is_directory(std::string path);
 
 
+    /**
+     * Create a directory, and any missing parents.
+     */
+    static bool make_directories( std::string path, mode_t mode );
+
+
     /**
      * Get the files in the given directory.
      *
@@ -0,0 +1,990 @@
+/**
+ * filter.cc - Run display_filter and mail_filter, caching their output.
+ *
+ * This file is part of lumail: http://lumail.org/
+ *
+ * Copyright (c) 2013-2014 by Steve Kemp.  All rights reserved.
+ *
+ **
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 dated June, 1991, or (at your
+ * option) any later version.
+ *
+ * On Debian GNU/Linux systems, the complete text of version 2 of the GNU
+ * General Public License can be found in `/usr/share/common-licenses/GPL-2'
+ */
+
+#include <errno.h>
+#include <algorithm>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <functional>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sstream>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <utime.h>
+#include <vector>
+
+#include "debug.h"
+#include "filter.h"
+#include "lua.h"
+
+
+extern char **environ;
+
+
+/**
+ * The most results we'll cache.
+ */
+#define MAX_CACHED_FILTERS 32
+
+/**
+ * The first line of each cached output file.
+ */
+#define FILTER_CACHE_MAGIC "lumail-filter-cache 2"
+
+/**
+ * The most bytes of output we'll keep on disk, and the longest we'll
+ * keep output which isn't used, in seconds.
+ */
+#define MAX_FILTER_CACHE_BYTES ( 64 * 1024 * 1024 )
+#define MAX_FILTER_CACHE_AGE   ( 30 * 24 * 60 * 60 )
+
+
+/**
+ * A file holding cached output, found when pruning.
+ */
+struct CFilterCacheFile
+{
+    std::string path;
+    time_t used;
+    off_t size;
+};
+
+
+/**
+ * Order cached files by when they were last used, oldest first.
+ */
+static bool used_before( const CFilterCacheFile &a, const CFilterCacheFile &b )
+{
+    return( a.used < b.used );
+}
+
+
+/**
+ * Instance-handle.
+ */
+CFilter *CFilter::pinstance = NULL;
+
+
+/**
+ * Get access to our singleton-object.
+ */
+CFilter *CFilter::Instance()
+{
+    if (!pinstance)
+        pinstance = new CFilter;
+
+    return pinstance;
+}
+
+
+/**
+ * Constructor - This is private as this class is a singleton.
+ */
+CFilter::CFilter()
+{
+    m_started   = false;
+    m_completed = false;
+    m_clock     = 0;
+    m_prune     = false;
+    m_written   = 0;
+}
+
+
+/**
+ * Set the directory to store filter output within.
+ */
+void CFilter::set_directory( std::string path )
+{
+    std::string directory;
+
+    if ( !path.empty() )
+    {
+        directory = path + "/filter";
+        mkdir( directory.c_str(), 0700 );
+    }
+
+    std::lock_guard<std::mutex> lock( m_lock );
+    m_directory = directory;
+
+    /**
+     * Remove anything stale from previous runs.
+     */
+    if ( !m_directory.empty() )
+    {
+        m_prune = true;
+        start();
+        m_work.notify_one();
+    }
+}
+
+
+/**
+ * Milliseconds since the epoch.
+ */
+static long long now_ms()
+{
+    struct timeval tv;
+    gettimeofday( &tv, NULL );
+    return( (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000 );
+}
+
+
+/**
+ * Run the command over the given text.
+ */
+bool CFilter::run( const std::string &command, const std::string &input,
+                   std::string &output, int timeout )
+{
+    return( execute( command, -1, input, output, timeout ) );
+}
+
+
+/**
+ * Run the command over the given file.
+ */
+bool CFilter::run_file( const std::string &command, const std::string &path,
+                        std::string &output, int timeout )
+{
+    int fd = open( path.c_str(), O_RDONLY | O_CLOEXEC );
+    if ( fd < 0 )
+        return false;
+
+    bool ret = execute( command, fd, "", output, timeout );
+    close( fd );
+    return( ret );
+}
+
+
+/**
+ * Run the command, reading from the given file-descriptor if it is valid,
+ * otherwise from the given text.
+ */
+bool CFilter::execute( const std::string &command, int input_fd,
+                       const std::string &input, std::string &output,
+                       int timeout )
+{
+    output.clear();
+
+    int in[2]  = { -1, -1 };
+    int out[2] = { -1, -1 };
+
+    if ( pipe2( out, O_CLOEXEC ) < 0 )
+        return false;
+
+    if ( input_fd < 0 )
+    {
+        if ( pipe2( in, O_CLOEXEC ) < 0 )
+        {
+            close( out[0] );
+            close( out[1] );
+            return false;
+        }
+        input_fd = in[0];
+    }
+
+    /**
+     * Connect the child's stdin and stdout, and put it in its own
+     * process-group so that we can kill any pipeline it runs.
+     */
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init( &actions );
+    posix_spawn_file_actions_adddup2( &actions, input_fd, 0 );
+    posix_spawn_file_actions_adddup2( &actions, out[1], 1 );
+    if ( in[1] >= 0 )
+        posix_spawn_file_actions_addclose( &actions, in[1] );
+    posix_spawn_file_actions_addclose( &actions, out[0] );
+
+    posix_spawnattr_t attr;
+    posix_spawnattr_init( &attr );
+    posix_spawnattr_setflags( &attr, POSIX_SPAWN_SETPGROUP );
+    posix_spawnattr_setpgroup( &attr, 0 );
+
+    const char *argv[] = { "/bin/sh", "-c", command.c_str(), NULL };
+
+    pid_t pid;
+    int err = posix_spawn( &pid, "/bin/sh", &actions, &attr,
+                           (char * const *)argv, environ );
+
+    posix_spawn_file_actions_destroy( &actions );
+    posix_spawnattr_destroy( &attr );
+
+    close( out[1] );
+    if ( in[0] >= 0 )
+        close( in[0] );
+
+    if ( err != 0 )
+    {
+        DEBUG_LOG( "CFilter::execute - failed to spawn " + command );
+        close( out[0] );
+        if ( in[1] >= 0 )
+            close( in[1] );
+        return false;
+    }
+
+    /**
+     * Writing to a filter which has exited would raise SIGPIPE, so block
+     * it while we run; any which is raised is discarded below.
+     */
+    sigset_t pipe_set, old_set;
+    sigemptyset( &pipe_set );
+    sigaddset( &pipe_set, SIGPIPE );
+    pthread_sigmask( SIG_BLOCK, &pipe_set, &old_set );
+
+    if ( in[1] >= 0 )
+        fcntl( in[1], F_SETFL, fcntl( in[1], F_GETFL ) | O_NONBLOCK );
+
+    /**
+     * Feed the input, and read the output, as each becomes possible.
+     */
+    size_t written   = 0;
+    long long expiry = now_ms() + (long long)timeout * 1000;
+    bool timed_out   = false;
+    char buffer[65536];
+
+    if ( in[1] >= 0 && input.empty() )
+    {
+        close( in[1] );
+        in[1] = -1;
+    }
+
+    while( out[0] >= 0 )
+    {
+        long long remaining = expiry - now_ms();
+        if ( remaining <= 0 )
+        {
+            timed_out = true;
+            break;
+        }
+
+        struct pollfd fds[2];
+        int nfds = 0;
+
+        fds[nfds].fd     = out[0];
+        fds[nfds].events = POLLIN;
+        nfds += 1;
+
+        if ( in[1] >= 0 )
+        {
+            fds[nfds].fd     = in[1];
+            fds[nfds].events = POLLOUT;
+            nfds += 1;
+        }
+
+        if ( poll( fds, nfds, (int)remaining ) < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+            break;
+        }
+
+        if ( nfds > 1 && ( fds[1].revents & ( POLLOUT | POLLERR | POLLHUP ) ) )
+        {
+            ssize_t n = write( in[1], input.data() + written, input.size() - written );
+            if ( n > 0 )
+                written += n;
+
+            if ( ( n < 0 && errno != EAGAIN && errno != EINTR ) ||
+                 written >= input.size() )
+            {
+                close( in[1] );
+                in[1] = -1;
+            }
+        }
+
+        if ( fds[0].revents & ( POLLIN | POLLERR | POLLHUP ) )
+        {
+            ssize_t n = read( out[0], buffer, sizeof(buffer) );
+            if ( n > 0 )
+                output.append( buffer, n );
+            else if ( n == 0 || ( errno != EAGAIN && errno != EINTR ) )
+            {
+                close( out[0] );
+                out[0] = -1;
+            }
+        }
+    }
+
+    if ( in[1] >= 0 )
+        close( in[1] );
+    if ( out[0] >= 0 )
+        close( out[0] );
+
+    if ( timed_out )
+    {
+        DEBUG_LOG( "CFilter::execute - timed out running " + command );
+        kill( -pid, SIGKILL );
+    }
+
+    /**
+     * A filter may close its output and carry on running, so don't
+     * wait for it to exit for longer than the timeout either.
+     */
+    int status = 0;
+    int delay  = 1;
+    while( true )
+    {
+        pid_t ret = waitpid( pid, &status, timed_out ? 0 : WNOHANG );
+        if ( ret == pid || ( ret < 0 && errno != EINTR ) )
+            break;
+
+        if ( ret == 0 )
+        {
+            if ( now_ms() >= expiry )
+            {
+                DEBUG_LOG( "CFilter::execute - timed out waiting for " + command );
+                kill( -pid, SIGKILL );
+                timed_out = true;
+                continue;
+            }
+
+            /**
+             * There's nothing to poll for the exit of a child, so back
+             * off gradually, from a millisecond.
+             */
+            usleep( delay * 1000 );
+            delay = std::min( delay * 2, 50 );
+        }
+    }
+
+    /**
+     * Discard any SIGPIPE we caused, and restore the signal mask.
+     */
+    struct timespec zero = { 0, 0 };
+    while( sigtimedwait( &pipe_set, NULL, &zero ) > 0 )
+        ;
+    pthread_sigmask( SIG_SETMASK, &old_set, NULL );
+
+    if ( timed_out )
+        return false;
+
+    /**
+     * A filter which failed without output, perhaps because it wasn't
+     * found, shouldn't hide the message.
+     */
+    if ( output.empty() && !( WIFEXITED( status ) && WEXITSTATUS( status ) == 0 ) )
+        return false;
+
+    return true;
+}
+
+
+/**
+ * The cache-key of the given command, for the given key.
+ */
+std::string CFilter::cache_key( const std::string &key, const std::string &command )
+{
+    std::string result = key;
+    result += '\0';
+    result += command;
+    return( result );
+}
+
+
+/**
+ * Find a cached result, with the lock held.
+ */
+bool CFilter::lookup( const std::string &key, std::string &output, bool &success )
+{
+    std::unordered_map<std::string, CFilterResult>::iterator it = m_cache.find( key );
+    if ( it == m_cache.end() )
+        return false;
+
+    it->second.used = ++m_clock;
+    output  = it->second.output;
+    success = it->second.success;
+    return true;
+}
+
+
+/**
+ * Store a result, with the lock held, expiring the least recently used
+ * if the cache is full.
+ */
+void CFilter::store( const std::string &key, const std::string &output, bool success )
+{
+    if ( m_cache.size() >= MAX_CACHED_FILTERS && m_cache.find( key ) == m_cache.end() )
+    {
+        std::unordered_map<std::string, CFilterResult>::iterator oldest = m_cache.begin();
+        for (std::unordered_map<std::string, CFilterResult>::iterator it = m_cache.begin(); it != m_cache.end(); ++it )
+        {
+            if ( it->second.used < oldest->second.used )
+                oldest = it;
+        }
+        m_cache.erase( oldest );
+    }
+
+    CFilterResult &result = m_cache[key];
+    result.output  = output;
+    result.success = success;
+    result.used    = ++m_clock;
+}
+
+
+/**
+ * Find a result in memory, or failing that on disk.
+ */
+bool CFilter::find( const std::string &key, std::string &output, bool &success )
+{
+    std::string directory;
+
+    {
+        std::lock_guard<std::mutex> lock( m_lock );
+        if ( lookup( key, output, success ) )
+            return true;
+
+        directory = m_directory;
+    }
+
+    if ( directory.empty() || !load( cache_file( directory, key ), key, output, success ) )
+        return false;
+
+    std::lock_guard<std::mutex> lock( m_lock );
+    store( key, output, success );
+    return true;
+}
+
+
+/**
+ * Store a result in memory, and on disk.
+ */
+void CFilter::remember( const std::string &key, const std::string &source,
+                        const std::string &output, bool success )
+{
+    std::string directory;
+
+    {
+        std::lock_guard<std::mutex> lock( m_lock );
+        store( key, output, success );
+        directory = m_directory;
+    }
+
+    if ( !directory.empty() )
+        save( cache_file( directory, key ), key, source, output, success );
+}
+
+
+/**
+ * The file which stores the result with the given key.
+ */
+std::string CFilter::cache_file( const std::string &directory, const std::string &key )
+{
+    char buf[32] = { '\0' };
+    snprintf( buf, sizeof(buf)-1, "%016zx", std::hash<std::string>()( key ) );
+
+    return( directory + "/" + buf );
+}
+
+
+/**
+ * Read a result from the given file.
+ */
+bool CFilter::load( const std::string &file, const std::string &key,
+                    std::string &output, bool &success )
+{
+    std::ifstream input( file.c_str(), std::ios::in | std::ios::binary );
+    if ( !input.is_open() )
+        return false;
+
+    std::stringstream ss;
+    ss << input.rdbuf();
+    std::string data = ss.str();
+
+    /**
+     * The file holds the magic, the path of the message, the key, and
+     * the status, followed by the output.  Ignore other versions, and
+     * hash-collisions.
+     */
+    std::string magic = FILTER_CACHE_MAGIC "\n";
+    if ( data.compare( 0, magic.size(), magic ) != 0 )
+        return false;
+
+    size_t offset = data.find( '\0', magic.size() );
+    if ( offset == std::string::npos )
+        return false;
+
+    std::string header = key;
+    header += '\0';
+    offset += 1;
+
+    if ( data.size() < offset + header.size() + 2 ||
+         data.compare( offset, header.size(), header ) != 0 ||
+         data[offset + header.size() + 1] != '\0' )
+        return false;
+
+    success = ( data[offset + header.size()] == '1' );
+    output  = data.substr( offset + header.size() + 2 );
+
+    /**
+     * The modification time records when the output was last used, as
+     * the access time often isn't updated.
+     */
+    utime( file.c_str(), NULL );
+    return true;
+}
+
+
+/**
+ * Write a result to the given file.
+ */
+void CFilter::save( const std::string &file, const std::string &key,
+                    const std::string &source, const std::string &output, bool success )
+{
+    std::string tmp = file + ".tmp";
+
+    std::ofstream out( tmp.c_str(), std::ios::out | std::ios::binary | std::ios::trunc );
+    if ( !out.is_open() )
+    {
+        DEBUG_LOG( "CFilter::save - failed to open " + tmp );
+        return;
+    }
+
+    out << FILTER_CACHE_MAGIC << "\n" << source << '\0' << key << '\0'
+        << ( success ? '1' : '0' ) << '\0';
+    out.write( output.data(), output.size() );
+    out.close();
+
+    if ( out.fail() || rename( tmp.c_str(), file.c_str() ) != 0 )
+    {
+        DEBUG_LOG( "CFilter::save - failed to write " + file );
+        unlink( tmp.c_str() );
+        return;
+    }
+
+    /**
+     * Prune the directory again once a good part of its limit has been
+     * written since it was last pruned.
+     */
+    std::lock_guard<std::mutex> lock( m_lock );
+    m_written += output.size();
+    if ( m_written >= MAX_FILTER_CACHE_BYTES / 4 )
+    {
+        m_written = 0;
+        m_prune   = true;
+        start();
+        m_work.notify_one();
+    }
+}
+
+
+/**
+ * Does the given directory hold the named message, with any flags?
+ *
+ * The listings of the directories we've read are kept, as many files
+ * refer to messages in the same directory.
+ */
+static bool listed( const std::string &directory, const std::string &name,
+                    std::unordered_map<std::string, std::unordered_set<std::string> > &listings )
+{
+    std::unordered_map<std::string, std::unordered_set<std::string> >::iterator it = listings.find( directory );
+    if ( it == listings.end() )
+    {
+        std::unordered_set<std::string> &names = listings[directory];
+
+        DIR *dp = opendir( directory.c_str() );
+        if ( dp != NULL )
+        {
+            struct dirent *de;
+            while( ( de = readdir( dp ) ) != NULL )
+            {
+                std::string entry = de->d_name;
+
+                size_t offset = entry.find( ":2," );
+                if ( offset != std::string::npos )
+                    entry = entry.substr( 0, offset );
+
+                names.insert( entry );
+            }
+            closedir( dp );
+        }
+
+        return( names.find( name ) != names.end() );
+    }
+
+    return( it->second.find( name ) != it->second.end() );
+}
+
+
+/**
+ * Does the message a cached file holds the output for still exist?
+ */
+static bool source_exists( const std::string &file,
+                           std::unordered_map<std::string, std::unordered_set<std::string> > &listings )
+{
+    std::ifstream input( file.c_str(), std::ios::in | std::ios::binary );
+    if ( !input.is_open() )
+        return false;
+
+    std::string magic;
+    std::string source;
+
+    getline( input, magic );
+    getline( input, source, '\0' );
+
+    if ( magic != FILTER_CACHE_MAGIC )
+        return false;
+
+    /**
+     * The source is the path of the message, whose flags may since have
+     * changed.
+     */
+    size_t slash = source.rfind( '/' );
+    if ( slash == std::string::npos )
+        return false;
+
+    std::string directory = source.substr( 0, slash );
+    std::string name      = source.substr( slash + 1 );
+
+    size_t flags = name.find( ":2," );
+    if ( flags != std::string::npos )
+        name = name.substr( 0, flags );
+
+    if ( listed( directory, name, listings ) )
+        return true;
+
+    /**
+     * The result is keyed without new/ or cur/, so is still valid if the
+     * message has moved from one to the other.
+     */
+    size_t length = directory.size();
+    if ( length < 4 )
+        return false;
+
+    std::string maildir = directory.substr( 0, length - 4 );
+    if ( directory.compare( length - 4, 4, "/new" ) == 0 )
+        return( listed( maildir + "/cur", name, listings ) );
+    if ( directory.compare( length - 4, 4, "/cur" ) == 0 )
+        return( listed( maildir + "/new", name, listings ) );
+
+    return false;
+}
+
+
+/**
+ * Remove stale, and least recently used, results from the given directory.
+ */
+void CFilter::prune( const std::string &directory )
+{
+    DIR *dp = opendir( directory.c_str() );
+    if ( dp == NULL )
+        return;
+
+    std::unordered_map<std::string, std::unordered_set<std::string> > listings;
+    std::vector<CFilterCacheFile> files;
+    off_t total  = 0;
+    time_t now   = time( NULL );
+    int removed  = 0;
+
+    struct dirent *de;
+    while( ( de = readdir( dp ) ) != NULL )
+    {
+        if ( de->d_name[0] == '.' )
+            continue;
+
+        CFilterCacheFile file;
+        file.path = directory + "/" + de->d_name;
+
+        struct stat sb;
+        if ( stat( file.path.c_str(), &sb ) != 0 || !S_ISREG( sb.st_mode ) )
+            continue;
+
+        file.used = sb.st_mtime;
+        file.size = sb.st_size;
+
+        /**
+         * Temporary files are only removed once they're clearly
+         * abandoned, as they may be being written right now.
+         */
+        bool temporary = ( strstr( de->d_name, ".tmp" ) != NULL );
+        bool expired   = ( now - file.used > MAX_FILTER_CACHE_AGE );
+
+        if ( expired || ( !temporary && !source_exists( file.path, listings ) ) )
+        {
+            unlink( file.path.c_str() );
+            removed += 1;
+            continue;
+        }
+
+        total += file.size;
+        files.push_back( file );
+    }
+    closedir( dp );
+
+    /**
+     * If we still hold too much then remove the least recently used.
+     */
+    if ( total > MAX_FILTER_CACHE_BYTES )
+    {
+        std::sort( files.begin(), files.end(), used_before );
+
+        for( CFilterCacheFile &file : files )
+        {
+            if ( total <= MAX_FILTER_CACHE_BYTES )
+                break;
+
+            unlink( file.path.c_str() );
+            total   -= file.size;
+            removed += 1;
+        }
+    }
+
+#ifdef LUMAIL_DEBUG
+    char dm[128] = { '\0' };
+    snprintf( dm, sizeof(dm)-1, "CFilter::prune - removed %d files, keeping %lld bytes",
+              removed, (long long) total );
+    DEBUG_LOG( dm );
+#endif
+}
+
+
+/**
+ * Start the background thread, if it isn't already running.
+ */
+void CFilter::start()
+{
+    if ( !m_started )
+    {
+        m_thread  = std::thread( &CFilter::run_jobs, this );
+        m_started = true;
+    }
+}
+
+
+/**
+ * The timeout, in seconds, from the `filter_timeout` setting.
+ */
+int CFilter::timeout_setting()
+{
+    int seconds = CLua::Instance()->get_int( "filter_timeout", 30 );
+    if ( seconds < 1 )
+        seconds = 1;
+    return( seconds );
+}
+
+
+/**
+ * Filter the given text, using the cached result if there is one.
+ */
+bool CFilter::filter( const std::string &key, const std::string &source,
+                      const std::string &command, const std::string &input,
+                      std::string &output, bool wait )
+{
+    std::string id = cache_key( key, command );
+    bool success;
+
+    if ( find( id, output, success ) )
+    {
+        if ( !success )
+            output = input;
+        return true;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock( m_lock );
+
+        if ( !wait )
+        {
+            CFilterJob job;
+            job.key     = id;
+            job.command = command;
+            job.input   = input;
+            job.source  = source;
+            job.timeout = timeout_setting();
+
+            queue( job );
+            return false;
+        }
+    }
+
+    success = run( command, input, output, timeout_setting() );
+    remember( id, source, output, success );
+
+    if ( !success )
+        output = input;
+
+    return true;
+}
+
+
+/**
+ * Filter the given file, using the cached result if there is one.
+ */
+bool CFilter::filter_file( const std::string &key, const std::string &command,
+                           const std::string &path, std::string &output )
+{
+    return( filter_file( key, command, path, output, timeout_setting() ) );
+}
+
+
+/**
+ * Filter the given file, with the given timeout.
+ */
+bool CFilter::filter_file( const std::string &key, const std::string &command,
+                           const std::string &path, std::string &output, int timeout )
+{
+    std::string id = cache_key( key, command );
+    bool success;
+
+    if ( find( id, output, success ) )
+        return( success );
+
+    success = run_file( command, path, output, timeout );
+    remember( id, path, output, success );
+
+    return( success );
+}
+
+
+/**
+ * Is the output of filtering the given file cached?  If not start
+ * filtering it in the background.
+ */
+bool CFilter::prepare_file( const std::string &key, const std::string &command,
+                            const std::string &path )
+{
+    std::string id = cache_key( key, command );
+    std::string output;
+    bool success;
+
+    if ( find( id, output, success ) )
+        return true;
+
+    CFilterJob job;
+    job.key     = id;
+    job.command = command;
+    job.path    = path;
+    job.source  = path;
+    job.timeout = timeout_setting();
+
+    std::lock_guard<std::mutex> lock( m_lock );
+    queue( job );
+    return false;
+}
+
+
+/**
+ * Queue a job, unless it already is.
+ */
+void CFilter::queue( const CFilterJob &job )
+{
+    if ( m_pending.find( job.key ) != m_pending.end() )
+        return;
+
+    m_pending.insert( job.key );
+    m_jobs.push_back( job );
+
+    start();
+    m_work.notify_one();
+}
+
+
+/**
+ * Has any background filter completed since we were last called?
+ */
+bool CFilter::publish()
+{
+    std::lock_guard<std::mutex> lock( m_lock );
+
+    bool completed = m_completed;
+    m_completed = false;
+    return( completed );
+}
+
+
+/**
+ * Are any filters running in the background?
+ */
+bool CFilter::busy()
+{
+    std::lock_guard<std::mutex> lock( m_lock );
+    return( !m_pending.empty() );
+}
+
+
+/**
+ * Discard all cached output.
+ */
+void CFilter::clear()
+{
+    std::lock_guard<std::mutex> lock( m_lock );
+    m_cache.clear();
+}
+
+
+/**
+ * The body of the background thread.
+ */
+void CFilter::run_jobs()
+{
+    while( true )
+    {
+        CFilterJob job;
+        std::string directory;
+
+        {
+            std::unique_lock<std::mutex> lock( m_lock );
+            while( m_jobs.empty() && !m_prune )
+                m_work.wait( lock );
+
+            /**
+             * Filtering is more urgent than pruning.
+             */
+            if ( m_jobs.empty() )
+            {
+                m_prune   = false;
+                directory = m_directory;
+            }
+            else
+            {
+                job = m_jobs.front();
+                m_jobs.pop_front();
+            }
+        }
+
+        if ( job.key.empty() )
+        {
+            if ( !directory.empty() )
+                prune( directory );
+            continue;
+        }
+
+        std::string output;
+        bool success;
+
+        if ( job.path.empty() )
+            success = run( job.command, job.input, output, job.timeout );
+        else
+            success = run_file( job.command, job.path, output, job.timeout );
+
+        remember( job.key, job.source, output, success );
+
+        {
+            std::lock_guard<std::mutex> lock( m_lock );
+            m_pending.erase( job.key );
+            m_completed = true;
+        }
+    }
+}
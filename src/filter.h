@@ -0,0 +1,308 @@
+/**
+ * filter.h - Run display_filter and mail_filter, caching their output.
+ *
+ * This file is part of lumail: http://lumail.org/
+ *
+ * Copyright (c) 2013-2014 by Steve Kemp.  All rights reserved.
+ *
+ **
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 dated June, 1991, or (at your
+ * option) any later version.
+ *
+ * On Debian GNU/Linux systems, the complete text of version 2 of the GNU
+ * General Public License can be found in `/usr/share/common-licenses/GPL-2'
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+
+/**
+ * A request to filter some text in the background.
+ */
+struct CFilterJob
+{
+    /**
+     * The cache-key of the result.
+     */
+    std::string key;
+
+    /**
+     * The command, and its input: the named file, if there is one,
+     * otherwise the text.
+     */
+    std::string command;
+    std::string path;
+    std::string input;
+
+    /**
+     * The path of the message the input came from.
+     */
+    std::string source;
+
+    /**
+     * The number of seconds to wait for the command to complete.
+     */
+    int timeout;
+};
+
+
+/**
+ * The output of a filter, as cached.
+ */
+struct CFilterResult
+{
+    /**
+     * The output.
+     */
+    std::string output;
+
+    /**
+     * Did the filter succeed?
+     */
+    bool success;
+
+    /**
+     * When the result was last used, for expiry.
+     */
+    unsigned long used;
+};
+
+
+/**
+ * Singleton class which runs filters over message text.
+ *
+ * Filters are spawned directly, via "/bin/sh -c", with their input and
+ * output connected by pipes, and are killed if they run for longer than
+ * the `filter_timeout` setting.  Results are cached by the message and
+ * the command, so scrolling or re-opening a message doesn't run the
+ * filter again.  If a cache directory is set the output is also saved
+ * there, so it survives restarts.  Saved output is pruned in the
+ * background: that of messages which no longer exist, or which hasn't
+ * been used for a long time, is removed, as is the least recently used
+ * if the total grows too large.
+ *
+ * Text may also be filtered by a background thread, so that a slow
+ * filter doesn't stop the screen being updated.
+ */
+class CFilter
+{
+
+public:
+
+    /**
+     * Get access to the singleton instance.
+     */
+    static CFilter *Instance();
+
+    /**
+     * Set the directory to store filter output within, beneath which a
+     * "filter" directory is created.  If empty output is only cached in
+     * memory.
+     */
+    void set_directory( std::string path );
+
+    /**
+     * Run the command over the given text, or file, returning its output.
+     *
+     * Returns false if the command couldn't be run, or didn't complete
+     * within the timeout.
+     */
+    static bool run( const std::string &command, const std::string &input,
+                     std::string &output, int timeout );
+    static bool run_file( const std::string &command, const std::string &path,
+                          std::string &output, int timeout );
+
+    /**
+     * Filter the given text, from the message with the given path, using
+     * the cached result for the given key if there is one.
+     *
+     * If the text isn't cached, and wait is false, then it is filtered
+     * in the background and false is returned; publish() will return true
+     * once it is complete.  If the filter fails the output is the input.
+     */
+    bool filter( const std::string &key, const std::string &source,
+                 const std::string &command, const std::string &input,
+                 std::string &output, bool wait );
+
+    /**
+     * Filter the given file, using the cached result for the given key if
+     * there is one.  Returns false if the filter fails.
+     */
+    bool filter_file( const std::string &key, const std::string &command,
+                      const std::string &path, std::string &output );
+
+    /**
+     * As above, with the given timeout in seconds, rather than the
+     * `filter_timeout` setting, so it may be called from any thread.
+     */
+    bool filter_file( const std::string &key, const std::string &command,
+                      const std::string &path, std::string &output, int timeout );
+
+    /**
+     * The timeout, in seconds, from the `filter_timeout` setting.
+     */
+    int timeout_setting();
+
+    /**
+     * Is the output of filtering the given file cached?
+     *
+     * If not the file is filtered in the background, and false is
+     * returned; publish() will return true once it is complete.
+     */
+    bool prepare_file( const std::string &key, const std::string &command,
+                       const std::string &path );
+
+    /**
+     * Has any background filter completed since we were last called?
+     */
+    bool publish();
+
+    /**
+     * Are any filters running in the background?
+     */
+    bool busy();
+
+    /**
+     * Discard all cached output.
+     */
+    void clear();
+
+protected:
+
+    /**
+     * Protected functions to allow our singleton implementation.
+     */
+    CFilter();
+    CFilter(const CFilter &);
+    CFilter & operator=(const CFilter &);
+
+private:
+
+    /**
+     * Run the command with the given input, either text or a file.
+     */
+    static bool execute( const std::string &command, int input_fd,
+                         const std::string &input, std::string &output,
+                         int timeout );
+
+    /**
+     * The cache-key of the given command, for the given key.
+     */
+    static std::string cache_key( const std::string &key, const std::string &command );
+
+    /**
+     * Find a cached result, with the lock held.
+     */
+    bool lookup( const std::string &key, std::string &output, bool &success );
+
+    /**
+     * Store a result, with the lock held.
+     */
+    void store( const std::string &key, const std::string &output, bool success );
+
+    /**
+     * The file which stores the result with the given key.
+     */
+    std::string cache_file( const std::string &directory, const std::string &key );
+
+    /**
+     * Read, and write, a result in the given file.  The path of the
+     * message it came from is written too, so it can be pruned once
+     * that is removed.
+     */
+    bool load( const std::string &file, const std::string &key,
+               std::string &output, bool &success );
+    void save( const std::string &file, const std::string &key,
+               const std::string &source, const std::string &output, bool success );
+
+    /**
+     * Find a result in memory, or on disk; store it in both.
+     */
+    bool find( const std::string &key, std::string &output, bool &success );
+    void remember( const std::string &key, const std::string &source,
+                   const std::string &output, bool success );
+
+    /**
+     * Remove stale, and least recently used, results from the given
+     * directory.
+     */
+    void prune( const std::string &directory );
+
+    /**
+     * Start the background thread, with the lock held.
+     */
+    void start();
+
+    /**
+     * Queue a job, unless it already is, with the lock held.
+     */
+    void queue( const CFilterJob &job );
+
+    /**
+     * The body of the background thread.
+     */
+    void run_jobs();
+
+    /**
+     * The single instance of this class.
+     */
+    static CFilter *pinstance;
+
+    /**
+     * Protects everything below.
+     */
+    std::mutex m_lock;
+
+    /**
+     * Signalled when a job is queued.
+     */
+    std::condition_variable m_work;
+
+    /**
+     * The background thread, started on first use.
+     */
+    std::thread m_thread;
+    bool m_started;
+
+    /**
+     * Jobs waiting to run, and the keys of those queued or running.
+     */
+    std::deque<CFilterJob> m_jobs;
+    std::unordered_set<std::string> m_pending;
+
+    /**
+     * Has a job completed since publish() was last called?
+     */
+    bool m_completed;
+
+    /**
+     * The cached results, and a counter used to find the least
+     * recently used.
+     */
+    std::unordered_map<std::string, CFilterResult> m_cache;
+    unsigned long m_clock;
+
+    /**
+     * The directory holding cached output, empty if not persistent.
+     */
+    std::string m_directory;
+
+    /**
+     * Should the background thread prune the directory, and how many
+     * bytes have been saved there since it last did?
+     */
+    bool m_prune;
+    size_t m_written;
+
+};
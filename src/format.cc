@@ -0,0 +1,269 @@
+/**
+ * format.cc - Compiled format-strings, for index_format and maildir_format.
+ *
+ * This file is part of lumail: http://lumail.org/
+ *
+ * Copyright (c) 2013-2014 by Steve Kemp.  All rights reserved.
+ *
+ **
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 dated June, 1991, or (at your
+ * option) any later version.
+ *
+ * On Debian GNU/Linux systems, the complete text of version 2 of the GNU
+ * General Public License can be found in `/usr/share/common-licenses/GPL-2'
+ */
+
+#include <map>
+#include <stdlib.h>
+#include <string.h>
+
+#include "format.h"
+
+
+/**
+ * The most compiled formats we'll cache.
+ */
+#define MAX_CACHED_FORMATS 64
+
+
+/**
+ * Get the compiled form of the given format-string.
+ */
+std::shared_ptr<CFormat> CFormat::compile( const std::string &text, const char **fields )
+{
+    static std::map<std::pair<const char **, std::string>, std::shared_ptr<CFormat> > cache;
+
+    std::pair<const char **, std::string> key( fields, text );
+
+    std::map<std::pair<const char **, std::string>, std::shared_ptr<CFormat> >::iterator it;
+    it = cache.find( key );
+    if ( it != cache.end() )
+        return( it->second );
+
+    /**
+     * Formats are rarely changed, so if the cache is full something
+     * unusual is happening; just start again.
+     */
+    if ( cache.size() >= MAX_CACHED_FORMATS )
+        cache.clear();
+
+    std::shared_ptr<CFormat> compiled( new CFormat( text, fields ) );
+    cache[key] = compiled;
+    return( compiled );
+}
+
+
+/**
+ * Parse the given text.
+ */
+CFormat::CFormat( const std::string &text, const char **fields )
+{
+    static unsigned int next_id = 0;
+    m_id = ++next_id;
+
+    int count = 0;
+    while( fields[count] )
+        count += 1;
+    m_used.resize( count, false );
+
+    CFormatOp literal;
+    literal.field = -1;
+    literal.min   = -1;
+    literal.max   = -1;
+
+    size_t offset = 0;
+
+    while( offset < text.size() )
+    {
+        /**
+         * Find the longest field-name following a "$", so that "$MONTH"
+         * isn't mistaken for "$MON".
+         */
+        int    field  = -1;
+        size_t length = 0;
+
+        if ( text[offset] == '$' )
+        {
+            for( int i = 0; i < count; i++ )
+            {
+                size_t len = strlen( fields[i] );
+                if ( len > length &&
+                     text.compare( offset + 1, len, fields[i] ) == 0 )
+                {
+                    field  = i;
+                    length = len;
+                }
+            }
+        }
+
+        if ( field < 0 )
+        {
+            literal.text += text[offset];
+            offset       += 1;
+            continue;
+        }
+
+        if ( ! literal.text.empty() )
+        {
+            m_ops.push_back( literal );
+            literal.text.clear();
+        }
+
+        CFormatOp op;
+        op.field = field;
+        op.min   = -1;
+        op.max   = -1;
+        offset  += length + 1;
+
+        /**
+         * Is there a width specification?
+         */
+        if ( offset < text.size() && text[offset] == '{' )
+        {
+            size_t end = text.find( '}', offset );
+            if ( end != std::string::npos )
+            {
+                parse_spec( text.substr( offset + 1, end - offset - 1 ), op );
+                offset = end + 1;
+            }
+        }
+
+        m_ops.push_back( op );
+        m_used[field] = true;
+    }
+
+    if ( ! literal.text.empty() )
+        m_ops.push_back( literal );
+}
+
+
+/**
+ * Parse a width specification, such as "min:10 max:20".
+ *
+ * Anything we don't understand is ignored.
+ */
+void CFormat::parse_spec( const std::string &spec, CFormatOp &op )
+{
+    size_t offset = 0;
+
+    while( offset < spec.size() )
+    {
+        size_t end = spec.find( ' ', offset );
+        if ( end == std::string::npos )
+            end = spec.size();
+
+        std::string token = spec.substr( offset, end - offset );
+
+        if ( token.compare( 0, 4, "min:" ) == 0 )
+            op.min = atoi( token.c_str() + 4 );
+        else if ( token.compare( 0, 4, "max:" ) == 0 )
+            op.max = atoi( token.c_str() + 4 );
+
+        offset = end + 1;
+    }
+
+    /**
+     * Make sure min is not greater than max.
+     */
+    if ( op.max >= 0 && op.min > op.max )
+        op.min = op.max;
+}
+
+
+/**
+ * A unique identifier for this compiled format.
+ */
+unsigned int CFormat::id() const
+{
+    return( m_id );
+}
+
+
+/**
+ * Does the format contain the given field?
+ */
+bool CFormat::uses( int field ) const
+{
+    return( field >= 0 && field < (int)m_used.size() && m_used[field] );
+}
+
+
+/**
+ * Does the format contain any fields at all?
+ */
+bool CFormat::has_fields() const
+{
+    for (bool used : m_used)
+    {
+        if ( used )
+            return true;
+    }
+    return false;
+}
+
+
+/**
+ * Expand the format, given the value of each field it uses, into the
+ * given buffer.
+ */
+void CFormat::render( const std::vector<std::string> &values, std::string &out ) const
+{
+    out.clear();
+
+    for (const CFormatOp &op : m_ops)
+    {
+        if ( op.field < 0 )
+        {
+            out += op.text;
+            continue;
+        }
+
+        if ( op.field >= (int)values.size() )
+            continue;
+
+        const std::string &value = values[op.field];
+
+        if ( op.min < 0 && op.max < 0 )
+        {
+            out += value;
+            continue;
+        }
+
+        /**
+         * Widths are in characters, not bytes, so walk the UTF-8 to
+         * find where to truncate, counting as we go.
+         */
+        size_t bytes = 0;
+        int    chars = 0;
+
+        while( bytes < value.size() )
+        {
+            if ( op.max >= 0 && chars == op.max )
+                break;
+
+            bytes += 1;
+            while( bytes < value.size() && ( value[bytes] & 0xC0 ) == 0x80 )
+                bytes += 1;
+            chars += 1;
+        }
+
+        out.append( value, 0, bytes );
+
+        if ( chars < op.min )
+            out.append( op.min - chars, ' ' );
+    }
+}
+
+
+/**
+ * Expand the format, given the value of each field it uses.
+ */
+std::string CFormat::render( const std::vector<std::string> &values ) const
+{
+    std::string result;
+    render( values, result );
+    return( result );
+}
@@ -0,0 +1,135 @@
+/**
+ * format.h - Compiled format-strings, for index_format and maildir_format.
+ *
+ * This file is part of lumail: http://lumail.org/
+ *
+ * Copyright (c) 2013-2014 by Steve Kemp.  All rights reserved.
+ *
+ **
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 dated June, 1991, or (at your
+ * option) any later version.
+ *
+ * On Debian GNU/Linux systems, the complete text of version 2 of the GNU
+ * General Public License can be found in `/usr/share/common-licenses/GPL-2'
+ */
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+
+/**
+ * A single step of a compiled format: either literal text, or the
+ * expansion of a field.
+ */
+struct CFormatOp
+{
+    /**
+     * The offset of the field in the table the format was compiled
+     * against, or -1 for literal text.
+     */
+    int field;
+
+    /**
+     * The literal text.
+     */
+    std::string text;
+
+    /**
+     * The width a field is padded to, and truncated to, in characters,
+     * or -1 if unset.
+     */
+    int min;
+    int max;
+};
+
+
+/**
+ * A format-string, such as "[$FLAGS] $FROM - $SUBJECT", compiled into
+ * a list of operations.
+ *
+ * Formats are compiled against a NULL-terminated table of the names of
+ * the fields they may contain, without the leading "$".  The caller
+ * supplies the value of each field the format uses, by offset.
+ *
+ * A field may be followed by a width specification, for example
+ * "$FROM{min:20 max:20}" pads the sender to twenty characters, and
+ * truncates it to the same width.
+ */
+class CFormat
+{
+
+public:
+
+    /**
+     * Get the compiled form of the given format-string.  Compiled formats
+     * are cached, so this is cheap to call for every row.
+     */
+    static std::shared_ptr<CFormat> compile( const std::string &text, const char **fields );
+
+    /**
+     * A unique identifier for this compiled format.
+     */
+    unsigned int id() const;
+
+    /**
+     * Does the format contain the given field?
+     */
+    bool uses( int field ) const;
+
+    /**
+     * Does the format contain any fields at all?
+     */
+    bool has_fields() const;
+
+    /**
+     * Expand the format, given the value of each field it uses, into
+     * the given buffer.  The buffer is cleared first, but its storage is
+     * reused, so rendering many rows needn't allocate.
+     */
+    void render( const std::vector<std::string> &values, std::string &out ) const;
+
+    /**
+     * Expand the format, given the value of each field it uses.
+     */
+    std::string render( const std::vector<std::string> &values ) const;
+
+private:
+
+    /**
+     * Parse the given text.
+     */
+    CFormat( const std::string &text, const char **fields );
+
+    /**
+     * Not copyable.
+     */
+    CFormat( const CFormat & );
+    CFormat & operator=( const CFormat & );
+
+    /**
+     * Parse a width specification, such as "min:10 max:20".
+     */
+    void parse_spec( const std::string &spec, CFormatOp &op );
+
+    /**
+     * The operations, in order.
+     */
+    std::vector<CFormatOp> m_ops;
+
+    /**
+     * Whether each field is used, by offset.
+     */
+    std::vector<bool> m_used;
+
+    /**
+     * Our identifier.
+     */
+    unsigned int m_id;
+
+};
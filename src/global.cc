@@ -20,6 +20,7 @@
 #include <cstdlib>
 #include <fstream>
 #include <iostream>
+#include <iterator>
 #include <memory>
 #include <pcrecpp.h>
 #include <stdlib.h>
@@ -33,10 +34,16 @@
 #include "debug.h"
 #include "file.h"
 #include "global.h"
+#include "header_cache.h"
 #include "lua.h"
+#include "prefetch.h"
+#include "query.h"
+#include "sort.h"
 #include "maildir.h"
 #include "message.h"
 #include "util.h"
+#include "walker.h"
+#include "watcher.h"
 
 /**
  * Instance-handle.
@@ -67,12 +74,14 @@ CGlobal::CGlobal()
     m_cur_message    = 0;
     m_msg_offset     = 0;
     m_text_offset    = 0;
+    m_dirty          = VIEW_ALL;
     m_messages       = NULL;
     m_maildirs       = NULL;
 
     /**
      * Defaults as set in our variable hash-map.
      */
+    set_variable( "cache_directory",        new std::string( "" ) );
     set_variable( "completion_chars",       new std::string("'\"( ,") );
     set_variable( "display_filter",         new std::string("") );
     set_variable( "editor",                 new std::string("/usr/bin/vim") );
@@ -137,136 +146,40 @@ CGlobal::CGlobal()
 
 
 /**
- * Sort CMessages, by the user-selected criterion.
+ * Sort CMessages, by the compiled sort-order.
+ *
+ * The keys of each message are computed once, up front, rather than on
+ * every comparison.  The first `sorted` messages are already in order,
+ * so only the remainder are sorted, and merged with them.
  */
-bool sort_messages(std::shared_ptr<CMessage> a, std::shared_ptr<CMessage> b)
+void sort_messages(CMessageList &messages, const CSortOrder &order, size_t sorted = 0)
 {
-    assert( NULL != a );
-    assert( NULL != b );
-
-    /**
-     * Get the type of sort.
-     */
-    CGlobal   *global = CGlobal::Instance();
-    std::string *sort = global->get_variable("sort");
-
-    /**
-     * Sort by date.  Default if nothing is explicitly set.
-     */
-    if ( ( sort->empty() ) ||
-         ( strcmp( sort->c_str(), "date-asc" ) == 0 ) ||
-         ( strcmp( sort->c_str(), "date-desc" ) == 0 ) )
-    {
-        bool asc = true;
+    std::vector<CSortRecord> records( messages.size() );
 
-        /**
-         * Are we descending?
-         */
-        if  ( ( ! sort->empty() ) && ( strcmp( sort->c_str(), "date-desc" ) == 0 ) )
-            asc = false;
-
-        if ( asc )
-            return (a->mtime() < b->mtime());
-        else
-            return (b->mtime() < a->mtime());
-
-    }
-
-    /**
-     * Sort by subject, asc/desc.
-     */
-    if (  ( !sort->empty() ) &&
-          ( ( strcmp(sort->c_str(), "subject" ) == 0 )  ||
-            ( strcmp(sort->c_str(), "subject-asc" ) == 0 )  ||
-            ( strcmp(sort->c_str(), "subject-desc" ) == 0 )  ) )
+    for( size_t i = 0; i < messages.size(); i++ )
     {
-
-        bool asc = true;
-
-        /**
-         * Are we descending?
-         */
-        if  ( ( ! sort->empty() ) && ( strcmp( sort->c_str(), "subject-desc" ) == 0 ) )
-            asc = false;
-
-        std::string as = a->header("Subject");
-        std::string bs = b->header("Subject");
-
-        if ( ! asc )
-        {
-            std::string tmp = as;
-            as = bs;
-            bs = tmp;
-        }
-
-        std::transform(as.begin(), as.end(), as.begin(), tolower);
-        std::transform(bs.begin(), bs.end(), bs.begin(), tolower);
-
-        return( strcmp( as.c_str(), bs.c_str() ) < 0 );
+        std::shared_ptr<CMessage> message = messages[i];
+        assert( NULL != message );
+
+        CSortRecord &record = records[i];
+        record.index = i;
+        record.mtime = order.uses( SORT_MTIME ) ? message->mtime() : 0;
+        record.date  = order.uses( SORT_DATE_HEADER ) ? message->get_date_field() : 0;
+
+        if ( order.uses( SORT_SUBJECT ) )
+            record.subject = CSortOrder::fold( message->header( "Subject" ) );
+        if ( order.uses( SORT_FROM ) )
+            record.from = CSortOrder::fold( message->header( "From" ) );
     }
 
-    /**
-     * Sort by sender, asc/desc.
-     */
-    if (  ( !sort->empty() ) &&
-          ( ( strcmp(sort->c_str(), "from" ) == 0 )  ||
-            ( strcmp(sort->c_str(), "from-asc" ) == 0 )  ||
-            ( strcmp(sort->c_str(), "from-desc" ) == 0 )  ) )
-    {
-
-        bool asc = true;
+    order.sort( records, sorted );
 
-        /**
-         * Are we descending?
-         */
-        if  ( ( sort != NULL ) && ( strcmp( sort->c_str(), "from-desc" ) == 0 ) )
-            asc = false;
-
-        std::string as = a->header("From");
-        std::string bs = b->header("From");
-
-        if ( ! asc )
-        {
-            std::string tmp = as;
-            as = bs;
-            bs = tmp;
-        }
+    CMessageList result;
+    result.reserve( messages.size() );
+    for( CSortRecord &record : records )
+        result.push_back( messages[record.index] );
 
-        std::transform(as.begin(), as.end(), as.begin(), tolower);
-        std::transform(bs.begin(), bs.end(), bs.begin(), tolower);
-
-        return( strcmp( as.c_str(), bs.c_str() ) < 0 );
-    }
-
-
-    /**
-     * Sort by the date-header
-     */
-    if (  ( ! sort->empty() ) &&
-          ( ( strcmp(sort->c_str(), "header" ) == 0 )  ||
-            ( strcmp(sort->c_str(), "header-asc" ) == 0 )  ||
-            ( strcmp(sort->c_str(), "header-desc" ) == 0 )  ) )
-    {
-
-        bool asc = true;
-
-        /**
-         * Are we descending?
-         */
-        if  ( ( sort != NULL ) && ( strcmp( sort->c_str(), "header-desc" ) == 0 ) )
-            asc = false;
-
-        time_t at = a->get_date_field();
-        time_t bt = b->get_date_field();
-
-        if ( asc )
-            return ( at < bt );
-        else
-            return ( bt < at );
-
-    }
-
-    return false;
+    messages.swap( result );
 }
 
 
@@ -368,6 +281,7 @@ void CGlobal::update_maildirs()
      */
     if ( m_maildirs != NULL )
     {
+        CWatcher::Instance()->clear();
         delete( m_maildirs );
         m_maildirs = NULL;
     }
@@ -394,9 +308,13 @@ void CGlobal::update_maildirs()
     std::vector<UTFString> prefixes = CUtil::split( prefix->c_str(), '|' );
 
     /**
-     * We'll store each maildir here.
+     * The walker skips ignored folders, and doesn't descend into
+     * pruned ones, as it goes.
      */
-    std::vector<std::string> folders;
+    CLua *lua = CLua::Instance();
+    CMaildirWalker walker( lua->get_int( "maildir_max_depth", 0 ),
+                           lua->table_to_array( "ignored_folders" ),
+                           lua->table_to_array( "pruned_folders" ) );
 
     /**
      * For each maildir prefix we have add in the folders we've found.
@@ -404,64 +322,30 @@ void CGlobal::update_maildirs()
     for (std::string path : prefixes)
     {
         DEBUG_LOG( "Handling maildir_prefix " + path );
+
         /**
          * Get the folders, and merge in.
          */
-        std::vector<std::string> tmp = CFile::get_all_maildirs(path);
+        std::vector<std::string> tmp = walker.walk(path);
 
         for (std::string t : tmp)
-            folders.push_back( t );
+            m_maildirs->push_back(std::shared_ptr<CMaildir>(new CMaildir(t)));
     }
 
-
-
     /**
-     * Should we ignore folders?
+     * Sort, case-insensitively.
      */
-    CLua *lua = CLua::Instance();
-    std::vector<std::string> ignored = lua->table_to_array( "ignored_folders" );
-
-    for (std::string path : folders)
-    {
-        bool ignore = false;
-
-        /**
-         * Should we ignore this folder?
-         */
-        if ( ignored.size() > 0 )
-        {
-            /**
-             *  Iterate over all ignored paths.
-             */
-            for (std::string reg : ignored)
-            {
-                /**
-                 * Ignore empty strings.
-                 */
-                if ( reg.size() < 1 )
-                    break ;
-
-                /**
-                 * Perform the regex matching, via PCRE.
-                 */
-                if (pcrecpp::RE(reg, pcrecpp::RE_Options().set_caseless(true)).PartialMatch(path) )
-                    ignore = true;
-            }
-
-        }
-
-        /**
-         * Not ignoring anything.  Add the folder.
-         */
-        if ( ! ignore )
-            m_maildirs->push_back(std::shared_ptr<CMaildir>(new CMaildir(path)));
-    }
+    std::sort(m_maildirs->begin(), m_maildirs->end(), sort_maildir_ptr_by_name);
 
     /**
-     * Sort, case-insensitively.
+     * Watch the new set of maildirs for changes.
      */
-    std::sort(m_maildirs->begin(), m_maildirs->end(), sort_maildir_ptr_by_name);
+    CWatcher *watcher = CWatcher::Instance();
+    watcher->clear();
+    for (std::shared_ptr<CMaildir> maildir : *m_maildirs)
+        watcher->watch( maildir );
 
+    set_dirty( VIEW_MAILDIR | VIEW_INDEX );
 }
 
 
@@ -475,18 +359,13 @@ void CGlobal::update_messages()
 
 
     /**
-     * If we have items already then free each of them.
-     */
-    if ( m_messages != NULL )
-    {
-        delete( m_messages );
-        m_messages = NULL;
-    }
-
-    /**
-     * create a new store.
+     * Index the messages we already hold by their current path, so that
+     * unchanged messages keep their objects, and their cached headers.
      */
-    m_messages = new CMessageList;
+    std::unordered_map<std::string, std::shared_ptr<CMessage> > existing;
+    existing.reserve( m_all_messages.size() );
+    for (std::shared_ptr<CMessage> message : m_all_messages)
+        existing[message->path()] = message;
 
     /**
      * Get the selected maildirs.
@@ -497,46 +376,202 @@ void CGlobal::update_messages()
 
 
     /**
-     * For each selected maildir read the messages.
+     * If the filter needs to look at headers then parse them all in
+     * parallel before we apply it.  A query testing only the flags, or
+     * size, of each message doesn't, so can be applied as we go.
      */
+    CHeaderPrefetch *prefetch = CHeaderPrefetch::Instance();
+    bool needs_headers = ( ( filter != NULL ) &&
+                           ( strcmp( filter->c_str(), "all" ) != 0 ) &&
+                           ( strcmp( filter->c_str(), "new" ) != 0 ) );
+
+    if ( needs_headers && ( strncasecmp( filter->c_str(), "QUERY:", 6 ) == 0 ) )
+        needs_headers = CQuery::compile( filter->substr( 6 ) )->needs_headers();
+
+    /**
+     * For each selected maildir read the directory listing, creating
+     * messages only for the files we didn't previously know about.
+     */
+    CMessageList all;
+    all.reserve( m_all_messages.size() );
+
+    std::unordered_map<CMessage *, bool> visible;
+    CMessageList shown;
+
+    std::string file;
     for (std::string folder : folders)
     {
-        /**
-         * get the messages from this folder.
-         */
-        CMaildir tmp = CMaildir(folder);
-        CMessageList contents = tmp.getMessages();
+        CMaildirListing listing( folder );
 
-        /**
-         * Append to the list of messages combined.
-         */
-        for (std::shared_ptr<CMessage> content: contents)
+        while( listing.next( file ) )
+        {
+            std::shared_ptr<CMessage> message;
+
+            std::unordered_map<std::string, std::shared_ptr<CMessage> >::iterator it = existing.find( file );
+            if ( it != existing.end() )
+            {
+                message = it->second;
+                existing.erase( it );
+            }
+            else
+            {
+                message = std::make_shared<CMessage>( file );
+            }
+
+            all.push_back( message );
+
+            if ( !needs_headers && message->matches_filter( filter ) )
+            {
+                visible[message.get()] = true;
+                shown.push_back( message );
+            }
+        }
+    }
+    m_all_messages = all;
+
+    /**
+     * Anything left in the existing-map has been removed from disk, and
+     * will be freed when we return.  Apply the filter to the rest, if we
+     * couldn't as they were listed.
+     */
+    if ( needs_headers )
+    {
+        prefetch->submit( all );
+        prefetch->wait();
+
+        for (std::shared_ptr<CMessage> content : all)
         {
             if ( content->matches_filter( filter ) )
-                m_messages->push_back(content) ;
+            {
+                visible[content.get()] = true;
+                shown.push_back( content );
+            }
         }
     }
 
     /**
-     * Sort?
+     * Start parsing the headers of the visible messages.  Unless we're
+     * sorting by date they'll be published as they arrive, while the
+     * index is displayed.
      */
     CLua *lua = CLua::Instance();
+    std::string *sort = global->get_variable("sort");
+    CSortOrder order( ( sort != NULL ) ? *sort : "" );
+
+    prefetch->submit( shown );
+    if ( lua->is_function( "sort_messages" ) || order.needs_headers() )
+        prefetch->wait();
+
+    /**
+     * Sort?
+     */
+
+    CMessageList *updated = new CMessageList;
+
     if ( lua->is_function( "sort_messages" )  )
     {
         /**
          * Let the Lua function do all the sorting work.
          */
-        *m_messages = lua->call_messages("sort_messages", *m_messages);
+        for (std::shared_ptr<CMessage> content : all)
+        {
+            if ( visible.find( content.get() ) != visible.end() )
+                updated->push_back( content );
+        }
+        *updated = lua->call_messages("sort_messages", *updated);
+        m_sorted_by = "";
+    }
+    else if ( ( m_messages != NULL ) && ( sort != NULL ) && ( *sort == m_sorted_by ) )
+    {
+        /**
+         * The sort-order hasn't changed, so the messages we were already
+         * displaying are still in order.  Keep those which remain visible,
+         * sort only the new arrivals, and merge the two.
+         */
+        for (std::shared_ptr<CMessage> content : *m_messages)
+        {
+            std::unordered_map<CMessage *, bool>::iterator it = visible.find( content.get() );
+            if ( it != visible.end() )
+            {
+                updated->push_back( content );
+                visible.erase( it );
+            }
+        }
+
+        size_t count = updated->size();
+
+        for (std::shared_ptr<CMessage> content : all)
+        {
+            if ( visible.find( content.get() ) != visible.end() )
+                updated->push_back( content );
+        }
+        sort_messages( *updated, order, count );
+
+#ifdef LUMAIL_DEBUG
+        char dm[128] = { '\0' };
+        snprintf( dm, sizeof(dm)-1, "CGlobal::update_messages - kept %zu, added %zu",
+                  count, updated->size() - count );
+        DEBUG_LOG( dm );
+#endif
     }
     else
     {
         /*
          * ...or use the native sort based on the "sort" variable.
          */
-        std::sort(m_messages->begin(), m_messages->end(), sort_messages);
+        for (std::shared_ptr<CMessage> content : all)
+        {
+            if ( visible.find( content.get() ) != visible.end() )
+                updated->push_back( content );
+        }
+        sort_messages( *updated, order );
+
+        if ( sort != NULL )
+            m_sorted_by = *sort;
     }
 
+    /**
+     * If we have items already then free each of them.
+     */
+    if ( m_messages != NULL )
+        delete( m_messages );
 
+    m_messages = updated;
+
+    /**
+     * Sorting & filtering will have populated the headers of every
+     * message, so persist any that weren't already cached.
+     */
+    CHeaderCache::Instance()->save( m_all_messages );
+
+    set_dirty( VIEW_INDEX | VIEW_MESSAGE );
+}
+
+
+/**
+ * Remove the message with the given path from the list of messages,
+ * without rescanning the selected folders.
+ */
+void CGlobal::remove_message( std::string path )
+{
+    CMessageList *lists[] = { m_messages, &m_all_messages };
+
+    for( CMessageList *list : lists )
+    {
+        if ( list == NULL )
+            continue;
+
+        for (CMessageList::iterator it = list->begin(); it != list->end(); ++it )
+        {
+            if ( (*it)->path() == path )
+            {
+                list->erase( it );
+                break;
+            }
+        }
+    }
+
+    set_dirty( VIEW_INDEX | VIEW_MESSAGE );
 }
 
 /**
@@ -546,6 +581,8 @@ void CGlobal::unset_folders()
 {
     m_selected_folders.clear();
     assert( m_selected_folders.size() == 0 );
+
+    set_dirty( VIEW_MAILDIR | VIEW_INDEX );
 }
 
 /**
@@ -559,6 +596,7 @@ void CGlobal::add_folder(std::string path)
     if (it == m_selected_folders.end())
     {
         m_selected_folders.push_back(path);
+        set_dirty( VIEW_MAILDIR | VIEW_INDEX );
     }
     assert( m_selected_folders.size() > 0 );
 }
@@ -581,6 +619,7 @@ bool CGlobal::remove_folder(std::string path)
     if (it != m_selected_folders.end())
     {
         m_selected_folders.erase(it);
+        set_dirty( VIEW_MAILDIR | VIEW_INDEX );
         return true;
     }
 
@@ -643,6 +682,11 @@ void CGlobal::set_variable( std::string name, std::string *value )
      */
     m_variables[ name ] = value;
 
+    /**
+     * Any view may depend upon the value.
+     */
+    set_dirty( VIEW_ALL );
+
 #ifdef LUMAIL_DEBUG
     std::string dm = "Set variable named '" ;
     dm += name ;
@@ -739,6 +783,7 @@ void CGlobal::close_domain_socket()
 void CGlobal::set_text( std::vector<UTFString> text )
 {
     m_text = text;
+    set_dirty( VIEW_TEXT );
 }
 
 std::vector<UTFString> CGlobal::get_text()
@@ -29,6 +29,19 @@
 class CMaildir;
 class CMessage;
 
+/**
+ * The views which may need to be redrawn, as a bitmask.
+ */
+enum TView
+{
+    VIEW_MAILDIR = 1,
+    VIEW_INDEX   = 2,
+    VIEW_MESSAGE = 4,
+    VIEW_TEXT    = 8,
+    VIEW_ALL     = 15
+};
+
+
 /**
  * A singleton class to store global data:
  *
@@ -75,6 +88,11 @@ public:
      */
     void update_messages();
 
+    /**
+     * Remove a single message from the global list of messages.
+     */
+    void remove_message( std::string path );
+
 
     /**
      * Update the global list of Maildirs.
@@ -128,6 +146,8 @@ public:
      */
     void set_selected_folder(int offset)
     {
+        int old = m_cur_folder;
+
         /**
          * If we have selected folders.
          */
@@ -149,6 +169,9 @@ public:
         }
         else
             m_cur_folder = 0;
+
+        if ( m_cur_folder != old )
+            set_dirty( VIEW_MAILDIR );
     }
 
 
@@ -161,6 +184,7 @@ public:
     }
     void set_selected_message(int offset)
     {
+        int old   = m_cur_message;
         int count = get_messages()->size();
 
         if ( count > 0 )
@@ -176,6 +200,9 @@ public:
         {
             m_cur_message = 0;
         }
+
+        if ( m_cur_message != old )
+            set_dirty( VIEW_INDEX | VIEW_MESSAGE );
     }
 
 
@@ -188,6 +215,9 @@ public:
     }
     void set_message_offset(int offset)
     {
+        if ( m_msg_offset != offset )
+            set_dirty( VIEW_MESSAGE );
+
         m_msg_offset = offset;
     }
 
@@ -201,6 +231,7 @@ public:
     }
     void set_text_offset(int offset)
     {
+        int old   = m_text_offset;
         int count = m_text.size();
         if ( count > 0 )
         {
@@ -213,6 +244,9 @@ public:
         }
         else
             m_text_offset = 0;
+
+        if ( m_text_offset != old )
+            set_dirty( VIEW_TEXT );
     }
 
     /**
@@ -238,6 +272,32 @@ public:
     std::unordered_map<std::string, std::string *> get_variables();
 
 
+    /**
+     * Mark the given views, a mask of TView values, as needing to be
+     * redrawn.
+     */
+    void set_dirty( int views = VIEW_ALL )
+    {
+        m_dirty |= views;
+    }
+
+    /**
+     * Does the given view need to be redrawn?
+     */
+    bool is_dirty( int view )
+    {
+        return( ( m_dirty & view ) != 0 );
+    }
+
+    /**
+     * The given view has been redrawn.
+     */
+    void clear_dirty( int view )
+    {
+        m_dirty &= ~view;
+    }
+
+
 protected:
 
     /**
@@ -274,6 +334,11 @@ private:
      */
     int m_text_offset;
 
+    /**
+     * The views which need to be redrawn.
+     */
+    int m_dirty;
+
     /**
      * Currently selected folders.
      */
@@ -284,6 +349,16 @@ private:
      */
     std::vector<std::shared_ptr<CMessage> > *m_messages;
 
+    /**
+     * Every message in the selected folders, ignoring the index_limit.
+     */
+    std::vector<std::shared_ptr<CMessage> > m_all_messages;
+
+    /**
+     * The sort-order the list of visible messages is in.
+     */
+    std::string m_sorted_by;
+
     /**
      * The list of all currently visible maildirs.
      */
@@ -0,0 +1,494 @@
+/**
+ * header_cache.cc - Persistent cache of decoded message-headers.
+ *
+ * This file is part of lumail: http://lumail.org/
+ *
+ * Copyright (c) 2013-2014 by Steve Kemp.  All rights reserved.
+ *
+ **
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 dated June, 1991, or (at your
+ * option) any later version.
+ *
+ * On Debian GNU/Linux systems, the complete text of version 2 of the GNU
+ * General Public License can be found in `/usr/share/common-licenses/GPL-2'
+ */
+
+#include <cstdlib>
+#include <cstdio>
+#include <dirent.h>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_set>
+
+#include "debug.h"
+#include "file.h"
+#include "global.h"
+#include "header_cache.h"
+#include "message.h"
+
+
+/**
+ * The first line of every cache-file.
+ */
+#define HEADER_CACHE_MAGIC "lumail-header-cache 3"
+
+
+/**
+ * Read the next NUL-terminated field from the given data, updating
+ * the offset.  If no complete field remains then valid is cleared.
+ */
+static std::string next_field( const std::string &data, size_t &offset, bool &valid )
+{
+    size_t end = data.find( '\0', offset );
+    if ( end == std::string::npos )
+    {
+        valid = false;
+        return "";
+    }
+
+    std::string result = data.substr( offset, end - offset );
+    offset = end + 1;
+    return result;
+}
+
+
+/**
+ * Instance-handle.
+ */
+CHeaderCache *CHeaderCache::pinstance = NULL;
+
+
+/**
+ * Get access to our singleton-object.
+ */
+CHeaderCache *CHeaderCache::Instance()
+{
+    if (!pinstance)
+        pinstance = new CHeaderCache;
+
+    return pinstance;
+}
+
+
+/**
+ * Constructor - This is private as this class is a singleton.
+ */
+CHeaderCache::CHeaderCache()
+{
+    m_hits   = 0;
+    m_misses = 0;
+}
+
+
+/**
+ * Set the directory to store cache-files within.
+ */
+void CHeaderCache::set_directory( std::string path )
+{
+    /**
+     * Flush anything pending to the old location.
+     */
+    save();
+    m_folders.clear();
+
+    m_directory = path;
+
+    /**
+     * Create the directory, if it is missing.
+     */
+    if ( !m_directory.empty() && !CFile::make_directories( m_directory, 0700 ) )
+        DEBUG_LOG( "CHeaderCache::set_directory - failed to create " + m_directory );
+}
+
+
+/**
+ * Is the cache enabled?
+ */
+bool CHeaderCache::enabled()
+{
+    return( !m_directory.empty() );
+}
+
+
+/**
+ * Lookup the cached headers, and date, for the given message.
+ */
+bool CHeaderCache::lookup( std::string path, off_t size, time_t mtime,
+                           std::unordered_map<std::string, UTFString> &headers,
+                           time_t &date )
+{
+    std::string maildir;
+    std::string key;
+
+    if ( !enabled() || !split_path( path, maildir, key ) )
+        return false;
+
+    CHeaderCacheFolder *cache = folder( maildir );
+
+    std::unordered_map<std::string, CHeaderCacheEntry>::iterator it = cache->entries.find( key );
+    if ( ( it == cache->entries.end() ) ||
+         ( it->second.size != size ) ||
+         ( it->second.mtime != mtime ) )
+    {
+        m_misses += 1;
+        return false;
+    }
+
+    m_hits += 1;
+
+    headers = it->second.headers;
+    if ( it->second.date != 0 )
+        date = it->second.date;
+
+    return true;
+}
+
+
+/**
+ * Store the headers, & date, of the given message.
+ */
+void CHeaderCache::store( std::string path, off_t size, time_t mtime,
+                          const std::unordered_map<std::string, UTFString> &headers,
+                          time_t date )
+{
+    std::string maildir;
+    std::string key;
+
+    if ( !enabled() || !split_path( path, maildir, key ) )
+        return;
+
+    CHeaderCacheFolder *cache = folder( maildir );
+    CHeaderCacheEntry &entry  = cache->entries[key];
+
+    entry.size    = size;
+    entry.mtime   = mtime;
+    entry.date    = date;
+    entry.headers = headers;
+
+    cache->dirty = true;
+}
+
+
+/**
+ * Update the cached date of a message which has already been stored.
+ */
+void CHeaderCache::update_date( std::string path, time_t date )
+{
+    std::string maildir;
+    std::string key;
+
+    if ( !enabled() || !split_path( path, maildir, key ) )
+        return;
+
+    CHeaderCacheFolder *cache = folder( maildir );
+
+    std::unordered_map<std::string, CHeaderCacheEntry>::iterator it = cache->entries.find( key );
+    if ( ( it != cache->entries.end() ) && ( it->second.date != date ) )
+    {
+        it->second.date = date;
+        cache->dirty    = true;
+    }
+}
+
+
+/**
+ * Write all modified caches to disk.
+ */
+void CHeaderCache::save()
+{
+    save( CMessageList() );
+}
+
+
+/**
+ * Write all modified caches to disk, using the given messages to find
+ * those which still exist.
+ */
+void CHeaderCache::save( const CMessageList &messages )
+{
+    if ( !enabled() )
+        return;
+
+    /**
+     * The keys of the messages we were given, by maildir.
+     */
+    std::unordered_map<std::string, std::unordered_set<std::string> > listed;
+    std::string maildir;
+    std::string key;
+
+    for (std::shared_ptr<CMessage> message : messages)
+    {
+        if ( split_path( message->path(), maildir, key ) )
+            listed[maildir].insert( key );
+    }
+
+    std::unordered_map<std::string, CHeaderCacheFolder>::iterator it;
+    for (it = m_folders.begin(); it != m_folders.end(); ++it )
+    {
+        if ( !it->second.dirty )
+            continue;
+
+        std::unordered_map<std::string, std::unordered_set<std::string> >::iterator found = listed.find( it->first );
+        if ( found != listed.end() )
+            save( it->first, it->second, &found->second );
+        else
+            save( it->first, it->second, NULL );
+    }
+}
+
+
+/**
+ * Number of cache hits since startup.
+ */
+int CHeaderCache::hits()
+{
+    return( m_hits );
+}
+
+
+/**
+ * Number of cache misses since startup.
+ */
+int CHeaderCache::misses()
+{
+    return( m_misses );
+}
+
+
+/**
+ * Split a message path into its maildir, and cache-key.
+ */
+bool CHeaderCache::split_path( std::string path, std::string &maildir, std::string &key )
+{
+    size_t offset = path.rfind( "/cur/" );
+    if ( offset == std::string::npos )
+        offset = path.rfind( "/new/" );
+
+    if ( offset == std::string::npos )
+        return false;
+
+    maildir = path.substr( 0, offset );
+    key     = path.substr( offset + 5 );
+
+    /**
+     * Strip any ":2,FLAGS" suffix.
+     */
+    size_t colon = key.find( ':' );
+    if ( colon != std::string::npos )
+        key = key.substr( 0, colon );
+
+    return( !key.empty() );
+}
+
+
+/**
+ * Find the cache for the given maildir, loading it if required.
+ */
+CHeaderCacheFolder *CHeaderCache::folder( std::string maildir )
+{
+    /**
+     * The filter which applies to the headers currently.
+     */
+    std::string filter = CMessage::header_filter();
+
+    std::unordered_map<std::string, CHeaderCacheFolder>::iterator it = m_folders.find( maildir );
+    if ( it == m_folders.end() )
+    {
+        CHeaderCacheFolder &cache = m_folders[maildir];
+        cache.dirty  = false;
+        cache.filter = filter;
+        load( maildir, cache );
+        return( &cache );
+    }
+
+    /**
+     * If the mail_filter has changed the headers we hold are stale.
+     */
+    if ( it->second.filter != filter )
+    {
+        DEBUG_LOG( "CHeaderCache::folder(" + maildir + ") - mail_filter changed, discarding" );
+        it->second.entries.clear();
+        it->second.filter = filter;
+        it->second.dirty  = true;
+    }
+
+    return( &it->second );
+}
+
+
+/**
+ * The file which stores the cache of the given maildir.
+ */
+std::string CHeaderCache::cache_file( std::string maildir )
+{
+    char buf[32] = { '\0' };
+    snprintf( buf, sizeof(buf)-1, "%016zx", std::hash<std::string>()( maildir ) );
+
+    return( m_directory + "/" + buf );
+}
+
+
+/**
+ * Load the on-disk cache for the given maildir.
+ */
+void CHeaderCache::load( std::string maildir, CHeaderCacheFolder &cache )
+{
+    std::ifstream input( cache_file( maildir ).c_str(), std::ios::in | std::ios::binary );
+    if ( !input.is_open() )
+        return;
+
+    std::string magic;
+    std::string name;
+    std::string filter;
+
+    getline( input, magic );
+    getline( input, name );
+    getline( input, filter );
+
+    /**
+     * Ignore caches of different versions, hash-collisions, and
+     * those made with a different mail_filter.
+     */
+    if ( ( magic != HEADER_CACHE_MAGIC ) ||
+         ( name != maildir ) ||
+         ( filter != cache.filter ) )
+        return;
+
+    std::stringstream ss;
+    ss << input.rdbuf();
+    std::string data = ss.str();
+
+    size_t offset = 0;
+    bool   valid  = true;
+
+    while( valid && offset < data.size() )
+    {
+        CHeaderCacheEntry entry;
+
+        std::string key = next_field( data, offset, valid );
+        entry.size      = strtoll( next_field( data, offset, valid ).c_str(), NULL, 10 );
+        entry.mtime     = strtoll( next_field( data, offset, valid ).c_str(), NULL, 10 );
+        entry.date      = strtoll( next_field( data, offset, valid ).c_str(), NULL, 10 );
+
+        long count = strtol( next_field( data, offset, valid ).c_str(), NULL, 10 );
+        for( long i = 0; valid && i < count; i++ )
+        {
+            std::string hname  = next_field( data, offset, valid );
+            std::string hvalue = next_field( data, offset, valid );
+            entry.headers[hname] = hvalue;
+        }
+
+        if ( valid )
+            cache.entries[key] = entry;
+    }
+
+#ifdef LUMAIL_DEBUG
+    char count[32] = { '\0' };
+    snprintf( count, sizeof(count)-1, "%zu", cache.entries.size() );
+
+    std::string dm = "CHeaderCache::load(";
+    dm += maildir;
+    dm += ") - ";
+    dm += count;
+    dm += " entries";
+    DEBUG_LOG( dm );
+#endif
+}
+
+
+/**
+ * Write the cache for the given maildir to disk.
+ */
+void CHeaderCache::save( std::string maildir, CHeaderCacheFolder &cache,
+                         const std::unordered_set<std::string> *listed )
+{
+    /**
+     * Find the messages which still exist, so that we don't keep
+     * entries for deleted messages forever.  If the caller hasn't
+     * already listed the maildir then read it ourselves.
+     */
+    std::unordered_set<std::string> present;
+    const char *subdirs[] = { "/cur/", "/new/" };
+
+    if ( listed != NULL )
+        present = *listed;
+
+    for( const char *sub : subdirs )
+    {
+        if ( listed != NULL )
+            break;
+
+        std::string path = maildir + sub;
+        DIR *dp = opendir( path.c_str() );
+        if ( dp == NULL )
+            continue;
+
+        struct dirent *de;
+        while( ( de = readdir( dp ) ) != NULL )
+        {
+            if ( de->d_name[0] == '.' )
+                continue;
+
+            std::string key = de->d_name;
+            size_t colon = key.find( ':' );
+            if ( colon != std::string::npos )
+                key = key.substr( 0, colon );
+
+            present.insert( key );
+        }
+        closedir( dp );
+    }
+
+    std::string file = cache_file( maildir );
+    std::string tmp  = file + ".tmp";
+
+    std::ofstream output( tmp.c_str(), std::ios::out | std::ios::binary | std::ios::trunc );
+    if ( !output.is_open() )
+    {
+        DEBUG_LOG( "CHeaderCache::save - failed to open " + tmp );
+        return;
+    }
+
+    output << HEADER_CACHE_MAGIC << "\n" << maildir << "\n" << cache.filter << "\n";
+
+    std::unordered_map<std::string, CHeaderCacheEntry>::iterator it = cache.entries.begin();
+    while( it != cache.entries.end() )
+    {
+        if ( present.find( it->first ) == present.end() )
+        {
+            it = cache.entries.erase( it );
+            continue;
+        }
+
+        CHeaderCacheEntry &entry = it->second;
+
+        output << it->first << '\0'
+               << (long long)entry.size << '\0'
+               << (long long)entry.mtime << '\0'
+               << (long long)entry.date << '\0'
+               << entry.headers.size() << '\0';
+
+        for( auto &header : entry.headers )
+            output << header.first << '\0' << header.second << '\0';
+
+        ++it;
+    }
+
+    output.close();
+
+    if ( output.fail() || rename( tmp.c_str(), file.c_str() ) != 0 )
+    {
+        DEBUG_LOG( "CHeaderCache::save - failed to write " + file );
+        unlink( tmp.c_str() );
+        return;
+    }
+
+    cache.dirty = false;
+}
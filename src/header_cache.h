@@ -0,0 +1,208 @@
+/**
+ * header_cache.h - Persistent cache of decoded message-headers.
+ *
+ * This file is part of lumail: http://lumail.org/
+ *
+ * Copyright (c) 2013-2014 by Steve Kemp.  All rights reserved.
+ *
+ **
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 dated June, 1991, or (at your
+ * option) any later version.
+ *
+ * On Debian GNU/Linux systems, the complete text of version 2 of the GNU
+ * General Public License can be found in `/usr/share/common-licenses/GPL-2'
+ */
+
+#pragma once
+
+#include <string>
+#include <time.h>
+#include <sys/types.h>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "maildir.h"
+#include "utfstring.h"
+
+
+/**
+ * A single cached message.
+ */
+struct CHeaderCacheEntry
+{
+    /**
+     * The size and mtime of the file when it was cached.
+     */
+    off_t size;
+    time_t mtime;
+
+    /**
+     * The parsed date of the message, zero if not yet known.
+     */
+    time_t date;
+
+    /**
+     * The decoded values of the summary headers, (those used for
+     * display, sorting, and limiting), keyed by lower-case name.
+     */
+    std::unordered_map<std::string, UTFString> headers;
+};
+
+
+/**
+ * The cached messages beneath a single maildir.
+ */
+struct CHeaderCacheFolder
+{
+    /**
+     * The mail_filter in use when the entries were parsed.
+     */
+    std::string filter;
+
+    /**
+     * Have we changed since the cache-file was read?
+     */
+    bool dirty;
+
+    /**
+     * Entries, keyed by the unique part of the message filename.
+     */
+    std::unordered_map<std::string, CHeaderCacheEntry> entries;
+};
+
+
+/**
+ * Singleton class to maintain an on-disk cache of message headers.
+ *
+ * Each maildir gets a single file beneath the cache directory, and
+ * each message is keyed by the unique part of its filename, (i.e. without
+ * the ":2,FLAGS" suffix), so that flag-changes don't invalidate entries.
+ * Entries are only used if the size and mtime of the message still match.
+ */
+class CHeaderCache
+{
+
+public:
+
+    /**
+     * Get access to the singleton instance.
+     */
+    static CHeaderCache *Instance();
+
+    /**
+     * Set the directory to store cache-files within.
+     *
+     * An empty value disables the cache.
+     */
+    void set_directory( std::string path );
+
+    /**
+     * Is the cache enabled?
+     */
+    bool enabled();
+
+    /**
+     * Lookup the cached headers, and date, for the given message.
+     *
+     * Returns false on a cache-miss.
+     */
+    bool lookup( std::string path, off_t size, time_t mtime,
+                 std::unordered_map<std::string, UTFString> &headers,
+                 time_t &date );
+
+    /**
+     * Store the headers, & date, of the given message.
+     */
+    void store( std::string path, off_t size, time_t mtime,
+                const std::unordered_map<std::string, UTFString> &headers,
+                time_t date );
+
+    /**
+     * Update the cached date of a message which has already been stored.
+     */
+    void update_date( std::string path, time_t date );
+
+    /**
+     * Write all modified caches to disk.
+     */
+    void save();
+
+    /**
+     * Write all modified caches to disk.
+     *
+     * The given messages are every message beneath the maildirs they
+     * are in, so those maildirs needn't be read again to find which
+     * entries refer to deleted messages.
+     */
+    void save( const CMessageList &messages );
+
+    /**
+     * Number of cache hits/misses since startup.
+     */
+    int hits();
+    int misses();
+
+protected:
+
+    /**
+     * Protected functions to allow our singleton implementation.
+     */
+    CHeaderCache();
+    CHeaderCache(const CHeaderCache &);
+    CHeaderCache & operator=(const CHeaderCache &);
+
+private:
+
+    /**
+     * Split a message path into its maildir, and cache-key.
+     *
+     * Returns false if the path isn't beneath a maildir.
+     */
+    bool split_path( std::string path, std::string &maildir, std::string &key );
+
+    /**
+     * Find the cache for the given maildir, loading it if required.
+     */
+    CHeaderCacheFolder *folder( std::string maildir );
+
+    /**
+     * The file which stores the cache of the given maildir.
+     */
+    std::string cache_file( std::string maildir );
+
+    /**
+     * Load the on-disk cache for the given maildir.
+     */
+    void load( std::string maildir, CHeaderCacheFolder &cache );
+
+    /**
+     * Write the cache for the given maildir to disk.
+     */
+    void save( std::string maildir, CHeaderCacheFolder &cache,
+               const std::unordered_set<std::string> *listed );
+
+    /**
+     * The single instance of this class.
+     */
+    static CHeaderCache *pinstance;
+
+    /**
+     * The directory we store our cache-files within, may be empty.
+     */
+    std::string m_directory;
+
+    /**
+     * The caches we've loaded, keyed by maildir path.
+     */
+    std::unordered_map<std::string, CHeaderCacheFolder> m_folders;
+
+    /**
+     * Statistics.
+     */
+    int m_hits;
+    int m_misses;
+
+};
@@ -0,0 +1,413 @@
+/**
+ * header_parser.cc - Parse & decode the header-block of a message.
+ *
+ * This file is part of lumail: http://lumail.org/
+ *
+ * Copyright (c) 2013-2014 by Steve Kemp.  All rights reserved.
+ *
+ **
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 dated June, 1991, or (at your
+ * option) any later version.
+ *
+ * On Debian GNU/Linux systems, the complete text of version 2 of the GNU
+ * General Public License can be found in `/usr/share/common-licenses/GPL-2'
+ */
+
+#include <algorithm>
+#include <errno.h>
+#include <iconv.h>
+#include <string.h>
+#include <glib.h>
+
+#include "header_parser.h"
+
+
+/**
+ * Append raw header text to the result.
+ *
+ * Unencoded 8-bit text isn't allowed in headers, but is common.  If it
+ * isn't valid UTF-8 we assume it is Latin-1.
+ */
+static void append_text( std::string &result, const char *text, size_t len )
+{
+    if ( g_utf8_validate( text, len, NULL ) )
+    {
+        result.append( text, len );
+        return;
+    }
+
+    for( size_t i = 0; i < len; i++ )
+    {
+        unsigned char c = text[i];
+        if ( c < 0x80 )
+            result += (char)c;
+        else
+        {
+            result += (char)( 0xC0 | ( c >> 6 ) );
+            result += (char)( 0x80 | ( c & 0x3F ) );
+        }
+    }
+}
+
+
+/**
+ * Decode base64 text, ignoring anything invalid.
+ */
+static std::string decode_base64( const char *text, size_t len )
+{
+    std::string result;
+    unsigned int buffer = 0;
+    int bits = 0;
+
+    for( size_t i = 0; i < len; i++ )
+    {
+        char c = text[i];
+        int val;
+
+        if ( c >= 'A' && c <= 'Z' )
+            val = c - 'A';
+        else if ( c >= 'a' && c <= 'z' )
+            val = c - 'a' + 26;
+        else if ( c >= '0' && c <= '9' )
+            val = c - '0' + 52;
+        else if ( c == '+' )
+            val = 62;
+        else if ( c == '/' )
+            val = 63;
+        else
+            continue;
+
+        buffer = ( buffer << 6 ) | val;
+        bits  += 6;
+
+        if ( bits >= 8 )
+        {
+            bits -= 8;
+            result += (char)( ( buffer >> bits ) & 0xFF );
+        }
+    }
+    return( result );
+}
+
+
+/**
+ * Decode the "Q" encoding of RFC 2047.
+ */
+static std::string decode_q( const char *text, size_t len )
+{
+    std::string result;
+
+    for( size_t i = 0; i < len; i++ )
+    {
+        if ( text[i] == '_' )
+            result += ' ';
+        else if ( ( text[i] == '=' ) && ( i + 2 < len ) &&
+                  isxdigit( (unsigned char) text[i+1] ) &&
+                  isxdigit( (unsigned char) text[i+2] ) )
+        {
+            char hex[3] = { text[i+1], text[i+2], '\0' };
+            result += (char) strtol( hex, NULL, 16 );
+            i += 2;
+        }
+        else
+            result += text[i];
+    }
+    return( result );
+}
+
+
+/**
+ * Attempt to decode the encoded-word which starts at the given offset,
+ * (which points to "=?").  On success the offset of the first character
+ * after the word is stored in end.
+ */
+static bool decode_word( const std::string &value, size_t start, std::string &output, size_t &end )
+{
+    /**
+     * =?charset?E?text?=
+     */
+    size_t q1 = value.find( '?', start + 2 );
+    if ( ( q1 == std::string::npos ) || ( q1 + 3 >= value.size() ) || ( value[q1 + 2] != '?' ) )
+        return false;
+
+    size_t q2 = value.find( "?=", q1 + 3 );
+    if ( q2 == std::string::npos )
+        return false;
+
+    std::string charset = value.substr( start + 2, q1 - start - 2 );
+    if ( charset.empty() || ( charset.find_first_of( " \t" ) != std::string::npos ) )
+        return false;
+
+    /**
+     * Drop any RFC 2231 language suffix: "utf-8*en".
+     */
+    size_t star = charset.find( '*' );
+    if ( star != std::string::npos )
+        charset = charset.substr( 0, star );
+
+    const char *text = value.c_str() + q1 + 3;
+    size_t len = q2 - q1 - 3;
+
+    std::string raw;
+    switch( value[q1 + 1] )
+    {
+    case 'B':
+    case 'b':
+        raw = decode_base64( text, len );
+        break;
+    case 'Q':
+    case 'q':
+        raw = decode_q( text, len );
+        break;
+    default:
+        return false;
+    }
+
+    output.clear();
+    if ( !CHeaderParser::to_utf8( charset, raw, output ) )
+    {
+        output.clear();
+        append_text( output, raw.c_str(), raw.size() );
+    }
+
+    end = q2 + 2;
+    return true;
+}
+
+
+/**
+ * Find the length of the header-block at the start of the given data.
+ */
+size_t CHeaderParser::header_length( const char *data, size_t len )
+{
+    const char *p   = data;
+    const char *end = data + len;
+
+    while( p < end )
+    {
+        const char *nl = (const char *) memchr( p, '\n', end - p );
+        if ( nl == NULL )
+            break;
+
+        /**
+         * A newline followed by another, or by CRLF, ends the headers.
+         */
+        if ( ( nl + 1 < end ) && ( nl[1] == '\n' ) )
+            return( nl + 1 - data );
+        if ( ( nl + 2 < end ) && ( nl[1] == '\r' ) && ( nl[2] == '\n' ) )
+            return( nl + 1 - data );
+
+        p = nl + 1;
+    }
+    return( len );
+}
+
+
+/**
+ * Parse the header-block at the start of the given data.
+ */
+void CHeaderParser::parse( const char *data, size_t len,
+                           std::unordered_map<std::string, UTFString> &headers,
+                           const std::unordered_set<std::string> *names )
+{
+    const char *p   = data;
+    const char *end = data + len;
+
+    /**
+     * Skip any mbox "From " separator.
+     */
+    if ( ( len > 5 ) && ( strncmp( p, "From ", 5 ) == 0 ) )
+    {
+        const char *nl = (const char *) memchr( p, '\n', len );
+        p = ( nl == NULL ) ? end : nl + 1;
+    }
+
+    std::string name;
+    std::string value;
+    bool have = false;
+
+    while( true )
+    {
+        const char *eol = NULL;
+        size_t line = 0;
+
+        if ( p < end )
+        {
+            eol = (const char *) memchr( p, '\n', end - p );
+            if ( eol == NULL )
+                eol = end;
+
+            line = eol - p;
+            if ( ( line > 0 ) && ( p[line - 1] == '\r' ) )
+                line -= 1;
+        }
+
+        /**
+         * Folded continuation lines are appended to the current value,
+         * anything else completes it.
+         */
+        if ( ( line > 0 ) && ( p[0] == ' ' || p[0] == '\t' ) )
+        {
+            if ( have )
+                value.append( p, line );
+            p = eol + 1;
+            continue;
+        }
+
+        if ( have )
+        {
+            size_t first = value.find_first_not_of( " \t" );
+            size_t last  = value.find_last_not_of( " \t" );
+
+            if ( first == std::string::npos )
+                value = "";
+            else
+                value = value.substr( first, last - first + 1 );
+
+            headers[name] = decode( value );
+            have = false;
+        }
+
+        /**
+         * A blank line, or the end of the data, ends the headers.
+         */
+        if ( line == 0 )
+            break;
+
+        const char *colon = (const char *) memchr( p, ':', line );
+        if ( colon != NULL )
+        {
+            name.assign( p, colon - p );
+            size_t last = name.find_last_not_of( " \t" );
+            name = ( last == std::string::npos ) ? "" : name.substr( 0, last + 1 );
+            std::transform( name.begin(), name.end(), name.begin(), tolower );
+
+            value.assign( colon + 1, ( p + line ) - ( colon + 1 ) );
+            have = !name.empty() &&
+                ( ( names == NULL ) || ( names->find( name ) != names->end() ) );
+        }
+
+        p = eol + 1;
+    }
+}
+
+
+/**
+ * Decode any RFC 2047 encoded-words in the given header value.
+ */
+std::string CHeaderParser::decode( const std::string &value )
+{
+    std::string result;
+    size_t pos = 0;
+    bool last_encoded = false;
+
+    /**
+     * The common case: nothing to decode.
+     */
+    if ( value.find( "=?" ) == std::string::npos )
+    {
+        append_text( result, value.c_str(), value.size() );
+        return( result );
+    }
+
+    while( pos < value.size() )
+    {
+        size_t start = value.find( "=?", pos );
+        if ( start == std::string::npos )
+        {
+            append_text( result, value.c_str() + pos, value.size() - pos );
+            break;
+        }
+
+        std::string decoded;
+        size_t end;
+
+        if ( !decode_word( value, start, decoded, end ) )
+        {
+            append_text( result, value.c_str() + pos, start + 2 - pos );
+            pos = start + 2;
+            last_encoded = false;
+            continue;
+        }
+
+        /**
+         * Whitespace between two adjacent encoded-words is dropped.
+         */
+        std::string between = value.substr( pos, start - pos );
+        if ( !( last_encoded && ( between.find_first_not_of( " \t" ) == std::string::npos ) ) )
+            append_text( result, between.c_str(), between.size() );
+
+        result += decoded;
+        pos = end;
+        last_encoded = true;
+    }
+
+    return( result );
+}
+
+
+/**
+ * Convert the given text from the named character set to UTF-8.
+ */
+bool CHeaderParser::to_utf8( const std::string &charset, const std::string &input, std::string &output )
+{
+    std::string cs = charset;
+    std::transform( cs.begin(), cs.end(), cs.begin(), tolower );
+
+    /**
+     * UTF-8, and ASCII, need no conversion - if they're valid.
+     */
+    if ( ( cs == "utf-8" || cs == "utf8" || cs == "us-ascii" || cs == "ascii" ) &&
+         g_utf8_validate( input.c_str(), input.size(), NULL ) )
+    {
+        output = input;
+        return true;
+    }
+
+    iconv_t cd = iconv_open( "UTF-8", charset.c_str() );
+    if ( cd == (iconv_t) -1 )
+        return false;
+
+    char buf[4096];
+    char *in = (char *) input.c_str();
+    size_t in_left = input.size();
+
+    output.clear();
+
+    while( in_left > 0 )
+    {
+        char *out = buf;
+        size_t out_left = sizeof(buf);
+
+        size_t ret = iconv( cd, &in, &in_left, &out, &out_left );
+        output.append( buf, out - buf );
+
+        if ( ret == (size_t) -1 )
+        {
+            if ( errno == E2BIG )
+                continue;
+
+            /**
+             * Replace invalid input, and carry on.
+             */
+            if ( errno == EILSEQ )
+            {
+                output += '?';
+                in++;
+                in_left--;
+                continue;
+            }
+
+            /**
+             * Truncated input.
+             */
+            break;
+        }
+    }
+
+    iconv_close( cd );
+    return true;
+}
@@ -0,0 +1,70 @@
+/**
+ * header_parser.h - Parse & decode the header-block of a message.
+ *
+ * This file is part of lumail: http://lumail.org/
+ *
+ * Copyright (c) 2013-2014 by Steve Kemp.  All rights reserved.
+ *
+ **
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 dated June, 1991, or (at your
+ * option) any later version.
+ *
+ * On Debian GNU/Linux systems, the complete text of version 2 of the GNU
+ * General Public License can be found in `/usr/share/common-licenses/GPL-2'
+ */
+
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "utfstring.h"
+
+
+/**
+ * A collection of primitives for reading RFC 5322 headers, without
+ * building a complete GMime message.
+ *
+ * All of these are safe to call from any thread.
+ */
+class CHeaderParser
+{
+
+public:
+
+    /**
+     * Find the length of the header-block at the start of the given data,
+     * including the newline which ends the last header.
+     */
+    static size_t header_length( const char *data, size_t len );
+
+    /**
+     * Parse the header-block at the start of the given data.
+     *
+     * Folded lines are joined, names are lower-cased, and values are
+     * decoded to UTF-8.  Where a header is repeated the last value wins.
+     *
+     * If names is given only the headers it holds are decoded.
+     */
+    static void parse( const char *data, size_t len,
+                       std::unordered_map<std::string, UTFString> &headers,
+                       const std::unordered_set<std::string> *names = NULL );
+
+    /**
+     * Decode any RFC 2047 encoded-words in the given header value,
+     * returning UTF-8.
+     */
+    static std::string decode( const std::string &value );
+
+    /**
+     * Convert the given text from the named character set to UTF-8.
+     *
+     * Returns false if the conversion is unsupported, or fails.
+     */
+    static bool to_utf8( const std::string &charset, const std::string &input, std::string &output );
+
+};
@@ -52,3 +52,10 @@
  * message, but no message is currently selected.
  */
 #define MISSING_MESSAGE "Finding the current message failed."
+
+
+/**
+ * Displayed in place of the body of a message while the display_filter
+ * runs.
+ */
+#define FILTERING_MESSAGE "filtering..."
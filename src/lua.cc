@@ -35,6 +35,14 @@
  ** TODO: Reorder code to match the order in the header.
  **/
 
+/**
+ * The name of the registry-table holding compiled keymap bindings,
+ * keyed by their source, and the most bindings it may hold.
+ */
+#define KEYMAP_CACHE "lumail_keymap_cache"
+#define MAX_COMPILED_BINDINGS 256
+
+
 /**
  * Instance-handle.
  */
@@ -67,9 +75,11 @@ struct CLuaMapping primitive_list[] =
     {"dump_stack", "Dump the Lua-stack for debugging purposes", (lua_CFunction) lua_dump_stack },
     {"exec", "Execute an external command.", (lua_CFunction) exec },
     {"exit", "Exit lumail.", (lua_CFunction) exit },
+    {"header_cache_stats", "Return a table of the header-cache hits and misses.", (lua_CFunction) header_cache_stats },
     {"help", "Show brief help for primitives.", (lua_CFunction) show_help },
     {"history_file", "The path to log history to.", (lua_CFunction) history_file },
     {"log_message", "Add a message to the debug-log.", (lua_CFunction) log_message },
+    {"memory_stats", "Return a table of the memory used by the messages in the index.", (lua_CFunction) memory_stats },
     {"mime_type", "Get the MIME-type for a file.", (lua_CFunction) mime_type },
     {"msg", "Write a message to the status-area.", (lua_CFunction) msg },
     {"screen_height", "Return the height of the screen in rows.", (lua_CFunction) screen_height },
@@ -104,6 +114,7 @@ struct CLuaMapping primitive_list[] =
  * Get/Set variables: defined in src/variables.cc
  */
     {"bounce_path", "Get/set the binary to send bounces with.", (lua_CFunction) bounce_path },
+    {"cache_directory", "Query or update the directory used to cache message-headers.", (lua_CFunction) cache_directory },
     {"completion_chars", "Get/set the characters to tokenize on for completion.", (lua_CFunction) completion_chars },
     {"display_filter", "Query or update the filter to apply to messages being viewed.", (lua_CFunction) display_filter },
     {"editor", "Query or update the editor to use.", (lua_CFunction) editor },
@@ -149,7 +160,7 @@ struct CLuaMapping primitive_list[] =
     {"bounce", "Resent a message to a new recipient.", (lua_CFunction) bounce },
     {"compose", "Compose a new outgoing email.", (lua_CFunction) compose },
     {"count_lines", "Count the number of lines in the message body", (lua_CFunction) count_lines},
-    {"count_messages", "Count the messages in the currently selected Maildir(s).", (lua_CFunction) count_messages },
+    {"count_messages", "Count the messages in the currently selected Maildir(s), optionally only those which are new, or have the given flags.", (lua_CFunction) count_messages },
     {"current_message", "Retrieve the path to the current message.", (lua_CFunction) current_message },
     {"delete", "Delete the current message.", (lua_CFunction) delete_message },
     {"forward", "Forward the current message to a new recipient.", (lua_CFunction) forward },
@@ -168,7 +179,9 @@ struct CLuaMapping primitive_list[] =
     {"jump_message_to", "Scroll the current message to the given offset.", (lua_CFunction) jump_message_to },
     {"scroll_message_up", "Scroll the current message up.", (lua_CFunction) scroll_message_up },
     {"scroll_message_to", "Scroll the current message to the next matching regexp.", (lua_CFunction) scroll_message_to },
+    {"search", "Return the messages in the selected folders containing all the given words.", (lua_CFunction) search },
     {"send_email", "Send an email, via Lua.", (lua_CFunction) send_email },
+    {"set_flags", "Add, and remove, flags from each of the given messages.", (lua_CFunction) set_flags },
     {"write_message_to_disk", "Write a message to disk.", (lua_CFunction)write_message_to_disk },
 
 /**
@@ -249,6 +262,7 @@ CLua::CLua()
      * Create a new Lua object.
      */
     m_lua = luaL_newstate();
+    m_compiled_bindings = 0;
 
 
     /**
@@ -326,152 +340,221 @@ bool CLua::load_file(std::string filename)
 void CLua::execute(std::string lua, bool show_error )
 {
     if ( luaL_dostring(m_lua, lua.c_str()))
-    {
-        const char *err = NULL;
-        if ( lua_isstring(m_lua, -1))
-            err = lua_tostring(m_lua,-1);
+        report_error( lua, show_error );
+}
+
+
+/**
+ * Report the error at the top of the stack, and pop it.
+ */
+void CLua::report_error( const std::string &lua, bool show_error )
+{
+    const char *err = "";
+    if ( lua_isstring(m_lua, -1))
+        err = lua_tostring(m_lua,-1);
 
 #ifdef LUMAIL_DEBUG
-        std::string dm = "CLua::execute(\"";
-        dm += lua;
-        dm += "\"); -> ";
+    std::string dm = "CLua::execute(\"";
+    dm += lua;
+    dm += "\"); -> ";
 
-        dm += err;
-        DEBUG_LOG( dm );
+    dm += err;
+    DEBUG_LOG( dm );
+#else
+    (void)lua;
 #endif
 
-        if ( show_error )
+    if ( show_error )
+    {
+        /**
+         * Invoke the lua-callback "on_error".
+         *
+         * NOTE: The error message will be something
+         * horrible such as:
+         *
+         * [string "scroll_index_to( false );"]:1: Missing argument to scroll_index_to(..)
+         *
+         *
+         * We want to escape the quotes to avoid issues.
+         */
+
+        std::string e = "on_error( \"";
+
+        for (unsigned int i = 0; i < strlen( err ); i++ )
         {
-            /**
-             * Invoke the lua-callback "on_error".
-             *
-             * NOTE: The error message will be something
-             * horrible such as:
-             *
-             * [string "scroll_index_to( false );"]:1: Missing argument to scroll_index_to(..)
-             *
-             *
-             * We want to escape the quotes to avoid issues.
-             */
-
-            std::string e = "on_error( \"";
-
-            for (unsigned int i = 0; i < strlen( err ); i++ )
-            {
-                if ( err[i] != '"' )
-                    e += err[i];
-                else
-                    e += "\\\"" ;
-            }
-            e += "\");" ;
-            execute( e, false );
+            if ( err[i] != '"' )
+                e += err[i];
+            else
+                e += "\\\"" ;
         }
+        e += "\");" ;
 
+        lua_pop(m_lua, 1);
+        execute( e, false );
+        return;
     }
-}
 
+    lua_pop(m_lua, 1);
+}
 
 
 /**
- * Lookup a value in a nested-table.
+ * Look up the binding for the named keystroke in our keymap(s).
  *
- * (Used for keybinding lookups.)
+ * If the result is a function call it, if it is a string then call the
+ * function compiled from it.
  */
-char *CLua::get_nested_table( std::string table, std::string key, std::string subkey )
+bool CLua::on_keypress(const char *keypress)
 {
-    char *result = NULL;
-    static char quit_string[] =  {"exit();"};
+    int top = lua_gettop(m_lua);
 
     /**
-     * Ensure the table exists.
+     * If the keymap doesn't exist we'll exit, if the keypress
+     * was one of: q/Q/x/X
      */
-    lua_getglobal(m_lua, table.c_str() );
-    if (lua_isnil (m_lua, -1 ) )
+    lua_getglobal(m_lua, "keymap");
+    if ( !lua_istable(m_lua, -1) )
     {
-        /**
-         * If the table doesn't exist we'll return "exit();",
-         * if the keypress was one of: q/Q/x/X
-         *
-         * We can do this here because we don't call the function
-         * from elsewhere.
-         */
-        if ( ( subkey.size() > 0 ) &&
-             ( ( subkey.at(0) == 'q' ) ||
-               ( subkey.at(0) == 'Q' ) ||
-               ( subkey.at(0) == 'x' ) ||
-               ( subkey.at(0) == 'X' ) ) )
-            result = quit_string;
+        lua_settop(m_lua, top);
 
-        return result;
+        if ( ( keypress[0] != '\0' ) && ( strchr( "qQxX", keypress[0] ) != NULL ) )
+        {
+            execute( "exit();" );
+            return true;
+        }
+        return false;
     }
 
     /**
-     * Get the sub-table.
+     * Get the current global-mode.
      */
-    lua_pushstring(m_lua, key.c_str() );
-    lua_gettable(m_lua, -2);
-    if (! lua_istable(m_lua, -1 ) )
-        return result;
+    CGlobal *global   = CGlobal::Instance();
+    std::string *mode = global->get_variable("global_mode");
 
     /**
-     * Get the value.
+     * Lookup the keypress in the current-mode-keymap, and if that fails
+     * then lookup the global keymap.
+     *
+     * This order ensures you can have a "global" keymap, overridden in just one mode.
      */
-    lua_pushstring(m_lua, subkey.c_str());
-    lua_gettable(m_lua, -2);
-    if (lua_isnil (m_lua, -1 ) )
-        return result;
+    if ( !find_binding( mode->c_str(), keypress ) &&
+         !find_binding( "global", keypress ) )
+    {
+        lua_settop(m_lua, top);
+        return false;
+    }
 
     /**
-     * If it worked, and is a string .. return it.
+     * Strings of Lua are compiled once, and the function reused.
      */
-    if (lua_isstring(m_lua, -1))
-        result = (char *)lua_tostring(m_lua, -1);
-    return result;
+    std::string source;
+    if ( !lua_isfunction(m_lua, -1) )
+    {
+        source = lua_tostring(m_lua, -1);
+
+        if ( !compile_binding() )
+        {
+            report_error( source, true );
+            lua_settop(m_lua, top);
+            return true;
+        }
+    }
+
+    if ( lua_pcall(m_lua, 0, 0, 0) != 0 )
+        report_error( source, true );
+
+    lua_settop(m_lua, top);
+    return true;
 }
 
 
 /**
- * Look up the binding for the named keystroke in our keymap(s).
+ * Push the binding of the given key in the named section of the
+ * keymap-table at the top of the stack.
+ */
+bool CLua::find_binding( const char *section, const char *keypress )
+{
+    lua_getfield(m_lua, -1, section);
+    if ( lua_istable(m_lua, -1) )
+    {
+        lua_getfield(m_lua, -1, keypress);
+
+        /**
+         * Bindings are either functions, or strings to evaluate.
+         */
+        if ( lua_isfunction(m_lua, -1) || lua_isstring(m_lua, -1) )
+        {
+            lua_remove(m_lua, -2);
+            return true;
+        }
+        lua_pop(m_lua, 1);
+    }
+    lua_pop(m_lua, 1);
+    return false;
+}
+
+
+/**
+ * Replace the string of Lua at the top of the stack with the function
+ * compiled from it.
  *
- * If the result is a string then execute it as a function.
+ * Compiled functions are cached in the registry, keyed by their source,
+ * so a binding which is changed is simply compiled afresh.
  */
-bool CLua::on_keypress(const char *keypress)
+bool CLua::compile_binding()
 {
-    /**
-     * The result of the lookup.
-     */
-    char *result = NULL;
+    size_t len;
+    const char *source = lua_tolstring(m_lua, -1, &len);
 
     /**
-     * Get the current global-mode.
+     * Find the cache, creating it if it doesn't exist or has grown too
+     * large from bindings being changed.
      */
-    CGlobal *global   = CGlobal::Instance();
-    std::string *mode = global->get_variable("global_mode");
+    lua_getfield(m_lua, LUA_REGISTRYINDEX, KEYMAP_CACHE);
+    if ( !lua_istable(m_lua, -1) || ( m_compiled_bindings >= MAX_COMPILED_BINDINGS ) )
+    {
+        lua_pop(m_lua, 1);
+        lua_newtable(m_lua);
+        lua_pushvalue(m_lua, -1);
+        lua_setfield(m_lua, LUA_REGISTRYINDEX, KEYMAP_CACHE);
+        m_compiled_bindings = 0;
+    }
 
     /**
-     * Lookup the keypress in the current-mode-keymap.
+     * Stack: source, cache.
      */
-    result = get_nested_table( "keymap", mode->c_str(), keypress );
-
+    lua_pushvalue(m_lua, -2);
+    lua_rawget(m_lua, -2);
+    if ( lua_isfunction(m_lua, -1) )
+    {
+        lua_replace(m_lua, -3);
+        lua_pop(m_lua, 1);
+        return true;
+    }
+    lua_pop(m_lua, 1);
 
     /**
-     * If that failed then lookup the global keymap.
-     *
-     * This order ensures you can have a "global" keymap, overridden in just one mode.
+     * Compile the source, named as luaL_dostring() would name it, so
+     * errors read the same.
      */
-    if ( result == NULL )
-        result = get_nested_table( "keymap", "global", keypress );
+    if ( luaL_loadbuffer(m_lua, source, len, source) != 0 )
+    {
+        lua_replace(m_lua, -3);
+        lua_pop(m_lua, 1);
+        return false;
+    }
 
     /**
-     * If one/other of these lookups resulted in success then we're golden.
+     * Stack: source, cache, function.
      */
-    if ( result != NULL )
-        execute(result);
+    lua_pushvalue(m_lua, -3);
+    lua_pushvalue(m_lua, -2);
+    lua_rawset(m_lua, -4);
+    m_compiled_bindings += 1;
 
-    /**
-     * We succeeded if the result wasn't NULL.
-     */
-    return( result != NULL );
+    lua_replace(m_lua, -3);
+    lua_pop(m_lua, 1);
+    return true;
 }
 
 /*
@@ -758,6 +841,24 @@ bool CLua::get_bool( std::string name, bool default_value )
 
 }
 
+/**
+ * Return the value of the Lua-defined integer variable.
+ */
+int CLua::get_int( std::string name, int default_value )
+{
+    int ret = default_value;
+    lua_getglobal(m_lua, name.c_str() );
+    if (lua_type(m_lua, -1) != LUA_TNUMBER )
+    {
+        lua_pop(m_lua, 1);
+        return ret;
+    }
+    ret = lua_tointeger(m_lua,-1);
+    lua_pop(m_lua,1);
+    return ret;
+
+}
+
 /**
  * Get the MIME-type of a given file.  Using the suffix-only.
  */
@@ -115,13 +115,6 @@ public:
      */
     void execute(std::string lua, bool show_error = true);
 
-    /**
-     * Lookup a value in a nested-table.
-     *
-     * (Used for keybinding lookups.)
-     */
-    char *get_nested_table( std::string table, std::string key, std::string subkey );
-
 
     /**
      * Convert a Lua table to an array of strings.
@@ -133,6 +126,11 @@ public:
      */
     bool get_bool( std::string name, bool default_value = false );
 
+    /**
+     * Return the value of the Lua-defined integer variable.
+     */
+    int get_int( std::string name, int default_value = 0 );
+
 
 /**
  ** Helper methods.
@@ -175,6 +173,9 @@ public:
 
     /**
      * Execute a function from the global keymap.
+     *
+     * Bindings may be functions, or strings of Lua which are compiled
+     * once and then cached.
      */
     bool on_keypress(const char *keypress );
 
@@ -285,4 +286,28 @@ private:
      */
     lua_State *m_lua;
 
+    /**
+     * Report the error at the top of the stack, from evaluating the
+     * given code, and pop it.
+     */
+    void report_error( const std::string &lua, bool show_error );
+
+    /**
+     * Push the binding of the given key in the named section of the
+     * keymap-table at the top of the stack.  Returns false, leaving the
+     * stack unchanged, if there is none.
+     */
+    bool find_binding( const char *section, const char *keypress );
+
+    /**
+     * Replace the string of Lua at the top of the stack with the function
+     * compiled from it, or the error if it failed to compile.
+     */
+    bool compile_binding();
+
+    /**
+     * The number of bindings held in the cache of compiled bindings.
+     */
+    int m_compiled_bindings;
+
 };
@@ -26,24 +26,42 @@
 #include <sys/un.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/time.h>
 #include <signal.h>
 #include <poll.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "debug.h"
 #include "file.h"
+#include "filter.h"
 #include "global.h"
 #include "input.h"
 #include "lua.h"
 #include "lumail.h"
 #include "maildir.h"
 #include "message.h"
+#include "prefetch.h"
+#include "query.h"
 #include "screen.h"
+#include "search_index.h"
 #include "version.h"
+#include "watcher.h"
 
 
 
 
+/**
+ * The current time, in milliseconds.
+ */
+static long long now_ms()
+{
+    struct timeval tv;
+    gettimeofday( &tv, NULL );
+    return( (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000 );
+}
+
+
 /**
  * Constructor:  Setup the screen, Gmime, etc.
  */
@@ -269,6 +287,7 @@ void CLumail::domain_socket_pump(int socket_fd)
             DEBUG_LOG( "Read from domain-socket:"  + std::string(buf) );
 #endif
             m_lua->execute(buf);
+            CGlobal::Instance()->set_dirty();
         }
     } while (rval > 0);
 
@@ -281,6 +300,11 @@ void CLumail::domain_socket_pump(int socket_fd)
  */
 void CLumail::run_event_loop()
 {
+    /**
+     * on_idle() is called after a second without a keypress.
+     */
+    long long idle_at = now_ms() + 1000;
+
     /**
      * Now enter our event-loop
      */
@@ -304,19 +328,84 @@ void CLumail::run_event_loop()
         if ( sock >= 0 )
                 domain_socket_pump( sock );
 
+        /**
+         * Update the maildir counts from any filesystem changes.
+         */
+        if ( CWatcher::Instance()->process_events() )
+            global->set_dirty( VIEW_MAILDIR | VIEW_INDEX );
+
+        /**
+         * Show any headers which have been parsed in the background,
+         * and poll more often while that continues.
+         */
+        CHeaderPrefetch *prefetch = CHeaderPrefetch::Instance();
+        if ( prefetch->publish() )
+            global->set_dirty( VIEW_INDEX );
+
+        /**
+         * Likewise the output of any display_filter.
+         */
+        CFilter *filter = CFilter::Instance();
+        if ( filter->publish() )
+            global->set_dirty( VIEW_MESSAGE );
+
+        /**
+         * Once messages have been indexed in the background re-apply
+         * any limit which searches them.
+         */
+        CSearchIndex *search = CSearchIndex::Instance();
+        if ( search->publish() )
+        {
+            std::string *limit = global->get_variable( "index_limit" );
+            if ( ( limit != NULL ) &&
+                 ( strncasecmp( limit->c_str(), "QUERY:", 6 ) == 0 ) &&
+                 CQuery::compile( limit->substr( 6 ) )->needs_search() )
+            {
+                global->update_messages();
+                global->set_dirty( VIEW_INDEX );
+            }
+        }
+
+        bool busy = prefetch->busy() || filter->busy() || search->busy();
+        int  wait = 100;
+
+        if ( busy )
+            idle_at = now_ms() + 1000;
+        else
+            wait = (int) std::max( 0LL, std::min( 1000LL, idle_at - now_ms() ) );
 
         gunichar key;
-        int  r = CInput::Instance()->get_wchar(&key);
+        int  r = read_key( &key, wait );
 
         if (r== ERR)
         {
             /*
-             * Timeout - so we go round the loop again.
+             * Timeout, or a maildir changed - so we go round the loop again.
+             *
+             * The short timeouts while prefetching aren't idleness.
              */
-            m_lua->execute("on_idle()");
+            if ( !busy && ( now_ms() >= idle_at ) )
+            {
+                /**
+                 * Maildirs we can't watch must be checked for changes.
+                 */
+                if ( !CWatcher::Instance()->watching_all() )
+                    global->set_dirty( VIEW_MAILDIR );
+
+                m_lua->execute("on_idle()");
+                idle_at = now_ms() + 1000;
+            }
         }
         else
         {
+            idle_at = now_ms() + 1000;
+
+            /**
+             * A keypress may do anything, including resizing the
+             * terminal, so redraw everything afterwards.
+             */
+            global->set_dirty();
+
             /**
              * The human-readable version of the key which has
              * been pressed.
@@ -343,3 +432,64 @@ void CLumail::run_event_loop()
 
 }
 
+
+/**
+ * Wait up to the given number of milliseconds for a keypress.
+ *
+ * The inotify descriptor is polled along with stdin, so that changes to
+ * the maildirs are shown as they happen rather than after the timeout.
+ */
+int CLumail::read_key( gunichar *key, int wait )
+{
+    CInput *input = CInput::Instance();
+    int watch_fd  = CWatcher::Instance()->fd();
+    int r         = ERR;
+
+    /**
+     * Without a watcher curses can do all the waiting.
+     */
+    if ( watch_fd < 0 )
+    {
+        timeout( wait );
+        r = input->get_wchar( key );
+        timeout( 1000 );
+        return( r );
+    }
+
+    /**
+     * Take any key we, or curses, already hold: those won't make stdin
+     * readable.
+     */
+    timeout( 0 );
+    r = input->get_wchar( key );
+
+    if ( r == ERR )
+    {
+        struct pollfd fds[2];
+
+        fds[0].fd     = STDIN_FILENO;
+        fds[0].events = POLLIN;
+        fds[1].fd     = watch_fd;
+        fds[1].events = POLLIN;
+
+        int ready = poll( fds, 2, wait );
+
+        /**
+         * Once stdin is readable let curses wait for the rest of any
+         * escape-sequence.  If we were interrupted by a signal, such as
+         * SIGWINCH, curses may have a key for us.
+         */
+        if ( ( ready > 0 ) && ( fds[0].revents != 0 ) )
+        {
+            timeout( std::max( wait, 100 ) );
+            r = input->get_wchar( key );
+        }
+        else if ( ready < 0 )
+        {
+            r = input->get_wchar( key );
+        }
+    }
+
+    timeout( 1000 );
+    return( r );
+}
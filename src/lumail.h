@@ -25,6 +25,7 @@ class CLua;
 class CScreen;
 
 
+#include <glib.h>
 #include <vector>
 
 
@@ -74,6 +75,12 @@ public:
 
 private:
 
+    /**
+     * Wait up to the given number of milliseconds for a keypress,
+     * returning early, with ERR, if a watched maildir changes.
+     */
+    int read_key( gunichar *key, int wait );
+
     /**
      * Handle to our lua wrapper.
      */
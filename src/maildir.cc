@@ -18,16 +18,24 @@
 
 #include <algorithm>
 #include <dirent.h>
-#include <iomanip>
-#include <pcrecpp.h>
+#include <fcntl.h>
 #include <sstream>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <vector>
 
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
 #include "debug.h"
 #include "file.h"
+#include "format.h"
 #include "global.h"
 #include "maildir.h"
 #include "message.h"
+#include "regex_cache.h"
 
 
 /**
@@ -40,6 +48,7 @@ CMaildir::CMaildir(std::string path)
     m_modified = 0;   /* mtime of the maildir */
     m_unread   = -1;  /* unread messages in maildir */
     m_total    = -1;  /* total messages in maildir */
+    m_watched  = false;
 
 #ifdef LUMAIL_DEBUG
     std::string dm = "CMaildir::CMaildir(";
@@ -101,15 +110,39 @@ time_t CMaildir::last_modified()
 
 
 
+/**
+ * Is the message with the given filename new?
+ *
+ * This matches CMessage::is_new(), without needing to create a message.
+ */
+static bool is_new_file( const char *name, bool in_new )
+{
+    if ( in_new )
+        return true;
+
+    const char *flags = strstr( name, ":2," );
+    if ( flags == NULL )
+        return true;
+
+    return( strchr( flags + 3, 'S' ) == NULL );
+}
+
+
 /**
  * Update the cached total/unread message counts.
  */
 void CMaildir::update_cache()
 {
+    /**
+     * If we're being watched then the counts are already current.
+     */
+    if ( m_watched && ( m_unread != -1 ) && ( m_total != -1 ) )
+        return;
+
     /**
      * If the cached date isn't different then we need do nothing.
      */
-    time_t last_mod = last_modified();
+    time_t last_mod = m_watched ? 0 : last_modified();
 
     /**
      * If we've got -1 for the count/unread then we've
@@ -127,22 +160,84 @@ void CMaildir::update_cache()
 
 
     /**
-     * Get all messages, and update the total
+     * Count the messages, and the unread messages.  We only need the
+     * filenames to do so.
      */
-    CMessageList all = getMessages();
-    m_total = all.size();
+    std::string new_dir = m_path + "/new/";
 
+    int total  = 0;
+    int unread = 0;
 
-    /**
-     * Now update the unread count.
-     */
-    m_unread = 0;
-    for (std::shared_ptr<CMessage> message : all)
+    CMaildirListing listing( m_path );
+    std::string file;
+
+    while( listing.next( file ) )
     {
-        if ( message->is_new() )
-            m_unread++;
+        bool in_new = ( file.compare( 0, new_dir.size(), new_dir ) == 0 );
+        const char *name = file.c_str() + file.rfind( '/' ) + 1;
 
+        total += 1;
+        if ( is_new_file( name, in_new ) )
+            unread += 1;
     }
+
+    m_total  = total;
+    m_unread = unread;
+}
+
+
+/**
+ * Is this maildir being watched for changes?
+ */
+void CMaildir::set_watched( bool watched )
+{
+    m_watched = watched;
+
+    /**
+     * When the watcher stops we must go back to polling, so forget
+     * the modification time too.
+     */
+    invalidate();
+}
+
+
+/**
+ * Discard the cached counts, forcing them to be recalculated.
+ */
+void CMaildir::invalidate()
+{
+    m_modified = 0;
+    m_unread   = -1;
+    m_total    = -1;
+}
+
+
+/**
+ * A message-file was added.
+ */
+void CMaildir::message_added( const char *name, bool in_new )
+{
+    if ( ( name[0] == '.' ) || ( m_total == -1 ) )
+        return;
+
+    m_total += 1;
+    if ( is_new_file( name, in_new ) )
+        m_unread += 1;
+}
+
+
+/**
+ * A message-file was removed.
+ */
+void CMaildir::message_removed( const char *name, bool in_new )
+{
+    if ( ( name[0] == '.' ) || ( m_total == -1 ) )
+        return;
+
+    if ( m_total > 0 )
+        m_total -= 1;
+    if ( is_new_file( name, in_new ) && ( m_unread > 0 ) )
+        m_unread -= 1;
 }
 
 
@@ -202,13 +297,29 @@ std::string CMaildir::path()
 }
 
 
+/**
+ * The fields which may be used in maildir_format, by offset.
+ */
+enum TMaildirField
+{
+    MAILDIR_CHECK,
+    MAILDIR_TOTAL,
+    MAILDIR_READ,
+    MAILDIR_NEW,
+    MAILDIR_UNREAD,
+    MAILDIR_PATH,
+    MAILDIR_NAME,
+    MAILDIR_FIELDS
+};
+
+static const char *maildir_fields[MAILDIR_FIELDS + 1] = { "CHECK", "TOTAL", "READ", "NEW", "UNREAD", "PATH", "NAME", 0 };
+
+
 /**
  * Format this maildir for display in maildir-mode.
  */
 std::string CMaildir::format( bool selected, std::string fmt )
 {
-    std::string result;
-
     /**
      * Get the format-string we'll expand from the global
      * setting, if it wasn't supplied.
@@ -216,90 +327,55 @@ std::string CMaildir::format( bool selected, std::string fmt )
     if ( fmt.empty() )
     {
         CGlobal *global  = CGlobal::Instance();
-        std::string *fmt = global->get_variable("maildir_format");
-        result = std::string(*fmt);
-    }
-    else
-    {
-        result = fmt;
+        std::string *f   = global->get_variable("maildir_format");
+        fmt = std::string(*f);
     }
 
+    std::shared_ptr<CFormat> compiled = CFormat::compile( fmt, maildir_fields );
 
     /**
-     * The variables we know about.
+     * The values, and the output, are kept between calls to reuse
+     * their storage.
      */
-    const char *fields[8] = { "$CHECK",
-                              "$TOTAL",
-                              "$READ",
-                              "$NEW",
-                              "$UNREAD",
-                              "$PATH",
-                              "$NAME",
-                              0 };
-    const char **std_name = fields;
-
+    static std::vector<std::string> values( MAILDIR_FIELDS );
+    static std::string buffer;
 
     /**
-     * Iterate over everything we could possibly-expand.
+     * Expand only the fields which are used; the counts are zero-padded.
      */
-    for( int i = 0 ; std_name[i] ; ++i)
+    char num[16];
+
+    if ( compiled->uses( MAILDIR_CHECK ) )
+        values[MAILDIR_CHECK] = selected ? "[X]" : "[ ]";
+
+    if ( compiled->uses( MAILDIR_TOTAL ) || compiled->uses( MAILDIR_READ ) )
     {
-        size_t offset = result.find( std_name[i], 0 );
+        int total = total_messages();
+        snprintf( num, sizeof(num), "%04d", total );
+        values[MAILDIR_TOTAL] = num;
 
-        if ( ( offset != std::string::npos ) && ( offset < result.size() ) )
+        if ( compiled->uses( MAILDIR_READ ) )
         {
-
-            /**
-             * Remove the part we don't care about.
-             */
-            result.erase( offset, strlen( std_name[i] ) );
-
-            /**
-             * Conversion helper.
-             */
-            std::ostringstream convert;
-
-            /**
-             * Expand the specific variables.
-             */
-            if ( strcmp(std_name[i] , "$CHECK" ) == 0 )
-            {
-                if ( selected )
-                    result.insert(offset, "[X]" );
-                else
-                    result.insert(offset, "[ ]" );
-            }
-            if ( strcmp(std_name[i] , "$TOTAL" ) == 0 )
-            {
-                int total = total_messages();
-                convert << std::setfill('0') << std::setw(4) << total;
-                result.insert(offset, convert.str());
-            }
-            if ( strcmp(std_name[i] , "$READ" ) == 0 )
-            {
-                int read = total_messages() - unread_messages();;
-                convert << std::setfill('0') << std::setw(4) << read;
-                result.insert(offset, convert.str());
-            }
-            if ( ( strcmp(std_name[i] , "$NEW" ) == 0 ) ||
-                 ( strcmp(std_name[i] , "$UNREAD" ) == 0 ) )
-            {
-                int unread = unread_messages();
-                convert << std::setfill('0') << std::setw(4) << unread;
-                result.insert(offset, convert.str());
-            }
-            if ( strcmp(std_name[i] , "$PATH" ) == 0 )
-            {
-                result.insert(offset, path());
-            }
-            if ( strcmp(std_name[i] , "$NAME" ) == 0 )
-            {
-                result.insert(offset, name());
-            }
+            snprintf( num, sizeof(num), "%04d", total - unread_messages() );
+            values[MAILDIR_READ] = num;
         }
     }
-    return( result );
 
+    if ( compiled->uses( MAILDIR_NEW ) || compiled->uses( MAILDIR_UNREAD ) )
+    {
+        snprintf( num, sizeof(num), "%04d", unread_messages() );
+        values[MAILDIR_NEW]    = num;
+        values[MAILDIR_UNREAD] = num;
+    }
+
+    if ( compiled->uses( MAILDIR_PATH ) )
+        values[MAILDIR_PATH] = path();
+
+    if ( compiled->uses( MAILDIR_NAME ) )
+        values[MAILDIR_NAME] = name();
+
+    compiled->render( values, buffer );
+    return( buffer );
 }
 
 
@@ -332,7 +408,7 @@ bool CMaildir::matches_regexp( std::string *regexp )
     /**
      * Regexp Matching.
      */
-    if (pcrecpp::RE(*regexp, pcrecpp::RE_Options().set_caseless(true)).PartialMatch(p) )
+    if ( CRegexCache::Instance()->matches( *regexp, p ) )
         return true;
 
     return false;
@@ -348,72 +424,213 @@ bool CMaildir::matches_regexp( std::string *regexp )
  *
  * The return value is *all possible messages*, no attention to `index_limit`
  * is paid.
- *
- *  TODO:  Use CFile::files_in_directory().
- *
  */
 CMessageList CMaildir::getMessages()
 {
     CMessageList result;
-    dirent *de;
-    DIR *dp;
 
     /**
-     * Directories we search.
+     * The last count we made, if any, is a good estimate of the size.
      */
-    std::vector<std::string> dirs;
-    dirs.push_back(m_path + "/cur/");
-    dirs.push_back(m_path + "/new/");
+    if ( m_total > 0 )
+        result.reserve( m_total );
+
+    CMaildirListing listing( m_path );
+    std::string file;
+
+    while( listing.next( file ) )
+        result.push_back( std::make_shared<CMessage>( file ) );
+
+    return result;
+}
+
+
+/**
+ * Get the path of each message in the folder.
+ *
+ * This only reads the directories, so it is much cheaper than
+ * getMessages() when the caller already holds CMessage objects.
+ */
+std::vector<std::string> CMaildir::getMessagePaths()
+{
+    std::vector<std::string> result;
+
+    if ( m_total > 0 )
+        result.reserve( m_total );
+
+    CMaildirListing listing( m_path );
+    std::string file;
+
+    while( listing.next( file ) )
+        result.push_back( file );
+
+    return result;
+}
+
+
+/**
+ * Constructor.
+ */
+CMaildirListing::CMaildirListing( std::string maildir )
+{
+    m_maildir = maildir;
+    m_dir     = 0;
+    m_fd      = -1;
+    m_dp      = NULL;
+    m_length  = 0;
+    m_offset  = 0;
 
 #ifdef LUMAIL_DEBUG
-    std::string dm = "CMessage::getMessages()";
-    DEBUG_LOG( dm );
+    DEBUG_LOG( "CMaildirListing::CMaildirListing(" + maildir + ")" );
 #endif
+}
 
-    /**
-     * For each directory.
-     */
-    for (std::string path : dirs)
-    {
-        dp = opendir(path.c_str());
-        if (dp)
-        {
-            while (true)
-            {
-                de = readdir(dp);
-                if (de == NULL)
-                    break;
-
-                /** Maybe we should check for DT_REG || DT_LNK ? */
-                if ( (de->d_type != DT_DIR)
-                   || ( de->d_type == DT_UNKNOWN && !CFile::is_directory (std::string(path + de->d_name))))
-                {
-
-                    if ( de->d_name[0] != '.' )
-                    {
-                        std::shared_ptr<CMessage> t = std::shared_ptr<CMessage>(new CMessage(std::string(path + de->d_name)));
-                        result.push_back(t);
 
-#ifdef LUMAIL_DEBUG
-                        std::string dm = "CMessage::getMessages() - found ";
-                        dm += path + de->d_name;
-                        DEBUG_LOG( dm );
+/**
+ * Destructor.  Closes any open directory.
+ */
+CMaildirListing::~CMaildirListing()
+{
+    if ( m_dp != NULL )
+        closedir( m_dp );
+    else if ( m_fd >= 0 )
+        close( m_fd );
+}
+
+
+/**
+ * Open the next of "cur/" and "new/".
+ */
+bool CMaildirListing::open_next()
+{
+    if ( m_dp != NULL )
+        closedir( m_dp );
+    else if ( m_fd >= 0 )
+        close( m_fd );
+
+    m_dp     = NULL;
+    m_fd     = -1;
+    m_length = 0;
+    m_offset = 0;
+
+    const char *dirs[] = { "/cur/", "/new/" };
+
+    while( m_dir < 2 )
+    {
+        m_prefix = m_maildir + dirs[m_dir];
+        m_dir   += 1;
+
+#ifdef __linux__
+        m_fd = open( m_prefix.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+#else
+        m_dp = opendir( m_prefix.c_str() );
+        if ( m_dp != NULL )
+            m_fd = dirfd( m_dp );
 #endif
-                    }
-                    else
-                    {
-#ifdef LUMAIL_DEBUG
-                        std::string dm = "CMessage::getMessages() - ignoring dotfile ";
-                        dm += path + de->d_name;
-                        DEBUG_LOG( dm );
+        if ( m_fd >= 0 )
+            return true;
+    }
+
+    return false;
+}
+
+
+/**
+ * Read the next batch of entries from the open directory.
+ *
+ * On Linux we use getdents64 to read many entries with each system call,
+ * elsewhere readdir() does its own buffering.
+ */
+bool CMaildirListing::fill()
+{
+    m_offset = 0;
+    m_length = 0;
+
+#ifdef __linux__
+    long n = syscall( SYS_getdents64, m_fd, m_buffer, sizeof(m_buffer) );
+    if ( n <= 0 )
+        return false;
+
+    m_length = n;
+    return true;
+#else
+    return false;
 #endif
-                    }
-                }
-            }
-            closedir(dp);
+}
+
+
+/**
+ * Is the named entry, of the given type, a message-file?
+ *
+ * Dotfiles are ignored, as are directories.  If the filesystem doesn't
+ * tell us the type of the entry we have to stat it.
+ */
+bool CMaildirListing::is_message( const char *name, unsigned char type )
+{
+    if ( name[0] == '.' )
+        return false;
+
+    if ( type == DT_REG || type == DT_LNK )
+        return true;
+
+    if ( type != DT_UNKNOWN )
+        return false;
+
+    struct stat sb;
+    if ( fstatat( m_fd, name, &sb, 0 ) != 0 )
+        return false;
+
+    return( !S_ISDIR( sb.st_mode ) );
+}
+
+
+/**
+ * Get the path of the next message.
+ */
+bool CMaildirListing::next( std::string &path )
+{
+    while( true )
+    {
+        if ( m_fd < 0 && !open_next() )
+            return false;
+
+        const char   *name = NULL;
+        unsigned char type = DT_UNKNOWN;
+
+#ifdef __linux__
+        if ( m_offset >= m_length && !fill() )
+        {
+            close( m_fd );
+            m_fd = -1;
+            continue;
         }
+
+        struct dirent64 *de = (struct dirent64 *)( (char *)m_buffer + m_offset );
+        m_offset += de->d_reclen;
+
+        name = de->d_name;
+        type = de->d_type;
+#else
+        struct dirent *de = readdir( m_dp );
+        if ( de == NULL )
+        {
+            closedir( m_dp );
+            m_dp = NULL;
+            m_fd = -1;
+            continue;
+        }
+
+        name = de->d_name;
+        type = de->d_type;
+#endif
+
+        if ( !is_message( name, type ) )
+            continue;
+
+        path.assign( m_prefix );
+        path.append( name );
+        return true;
     }
-    return result;
 }
 
 
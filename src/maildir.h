@@ -18,6 +18,7 @@
 
 #pragma once
 
+#include <dirent.h>
 #include <vector>
 #include <string>
 #include <memory>
@@ -86,6 +87,23 @@ public:
      */
     bool matches_regexp( std::string *regexp );
 
+    /**
+     * Is this maildir being watched for changes?  If so the counts
+     * are maintained by the watcher rather than by polling.
+     */
+    void set_watched( bool watched );
+
+    /**
+     * Discard the cached counts, forcing them to be recalculated.
+     */
+    void invalidate();
+
+    /**
+     * Update the cached counts, as a message-file was added or removed.
+     */
+    void message_added( const char *name, bool in_new );
+    void message_removed( const char *name, bool in_new );
+
     /**
      * Generate a new filename in the given folder.
      */
@@ -108,6 +126,11 @@ public:
      */
     CMessageList getMessages();
 
+    /**
+     * Get the paths of all messages in the folder.
+     */
+    std::vector<std::string> getMessagePaths();
+
 
 private:
 
@@ -140,12 +163,96 @@ private:
     int m_unread;
     int m_total;
 
+    /**
+     * Are the counts being kept current by the watcher?
+     */
+    bool m_watched;
+
     /**
      * Cached name.
      */
     std::string m_name;
 };
 
+/**
+ * Lists the message-files beneath a maildir, reading the directories a
+ * large batch of entries at a time.
+ *
+ * Usage:
+ *
+ *   CMaildirListing listing( path );
+ *   std::string file;
+ *   while( listing.next( file ) )
+ *      ...
+ */
+class CMaildirListing
+{
+public:
+
+    /**
+     * Constructor.
+     */
+    CMaildirListing( std::string maildir );
+
+    /**
+     * Destructor.  Closes any open directory.
+     */
+    ~CMaildirListing();
+
+    /**
+     * Get the path of the next message, returning false when there are
+     * none left.  The storage of the given string is reused.
+     */
+    bool next( std::string &path );
+
+private:
+
+    /**
+     * Not copyable.
+     */
+    CMaildirListing( const CMaildirListing & );
+    CMaildirListing & operator=( const CMaildirListing & );
+
+    /**
+     * Open the next of "cur/" and "new/", returning false when both have
+     * been read.
+     */
+    bool open_next();
+
+    /**
+     * Read the next batch of entries from the open directory, returning
+     * false at its end.
+     */
+    bool fill();
+
+    /**
+     * Is the named entry, of the given type, a message-file?
+     */
+    bool is_message( const char *name, unsigned char type );
+
+    /**
+     * The maildir, and the directory being read.
+     */
+    std::string m_maildir;
+    std::string m_prefix;
+    int m_dir;
+
+    /**
+     * The open directory.
+     */
+    int m_fd;
+    DIR *m_dp;
+
+    /**
+     * The current batch of entries, and our offset within it.  This is
+     * declared as an array of longs so that it is suitably aligned.
+     */
+    long m_buffer[4096];
+    long m_length;
+    long m_offset;
+};
+
+
 /**
  * Type of a list of maildir folders.
  */
@@ -20,38 +20,99 @@
 #include <cstdlib>
 #include <iostream>
 #include <fstream>
+#include <list>
 #include <sstream>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 #include <string>
 #include <unistd.h>
 #include <unordered_map>
-#include <pcrecpp.h>
 
 
+#include "charset.h"
 #include "debug.h"
 #include "file.h"
+#include "filter.h"
+#include "format.h"
 #include "global.h"
+#include "header_cache.h"
+#include "header_parser.h"
 #include "lua.h"
 #include "message.h"
 #include "maildir.h"
+#include "query.h"
+#include "regex_cache.h"
+#include "string_pool.h"
 #include "utfstring.h"
 
 
+/**
+ * The number of messages which may hold a parsed MIME-tree at once.
+ */
+#define MAX_PARSED_MESSAGES 8
+
+
+/**
+ * The messages holding a parsed MIME-tree, most recently used first.
+ *
+ * Each message keeps its tree until it is evicted from here, so the
+ * body, the attachments, and the MIME-parts may all be read from a
+ * single parse.
+ */
+static std::list<CMessage *> parsed_messages;
+
+
+/**
+ * The bit which represents the given flag.
+ *
+ * "A" to "Z" are the lowest bits, followed by "a" to "z", so that the
+ * order of the bits is that of the sorted flags.  Anything else has
+ * no bit.
+ */
+static inline uint64_t flag_bit( char c )
+{
+    if ( c >= 'A' && c <= 'Z' )
+        return( (uint64_t) 1 << ( c - 'A' ) );
+    if ( c >= 'a' && c <= 'z' )
+        return( (uint64_t) 1 << ( c - 'a' + 26 ) );
+    return 0;
+}
+
+
+/**
+ * The flags which decide if a message is new.
+ */
+static const uint64_t FLAG_NEW  = (uint64_t) 1 << ( 'N' - 'A' );
+static const uint64_t FLAG_SEEN = (uint64_t) 1 << ( 'S' - 'A' );
+
+
 /**
  * Constructor.
  */
 CMessage::CMessage(std::string filename)
 {
-    m_path         = filename;
+    set_path( filename );
     m_date         = 0;
     m_time_cache   = 0;
     m_read         = false;
     m_message      = NULL;
     m_fd           = -1;
+    m_in_parsed    = false;
+    m_headers_pending = false;
+    m_have_headers = false;
+    m_format_id    = 0;
+    m_format_flags = 0;
+
+    for( int i = 0; i < SUMMARY_HEADERS; i++ )
+        m_summary[i] = NULL;
 
 #ifdef LUMAIL_DEBUG
     std::string dm = "CMessage::CMessage(";
-    dm += m_path;
+    dm += path();
     dm += ");";
     DEBUG_LOG( dm );
 #endif
@@ -68,7 +129,7 @@ CMessage::~CMessage()
 
 #ifdef LUMAIL_DEBUG
     std::string dm = "CMessage::~CMessage(";
-    dm += m_path;
+    dm += path();
     dm += ");";
     DEBUG_LOG( dm );
 #endif
@@ -95,87 +156,80 @@ bool CMessage::message_parse()
      * If we've already parsed the message then we're good.
      */
     if ( is_valid() )
+    {
+        remember_parsed();
         return true;
+    }
 
     /**
      * See if we're filtering the body.
      */
     CGlobal     *global = CGlobal::Instance();
     std::string *filter = global->get_variable("mail_filter");
-    std::string *tmp    = global->get_variable("tmp");
 
     if ( ( filter != NULL ) && ( ! ( filter->empty() ) ) )
     {
         /**
-         * Generate a temporary file for the filter output.
+         * Parse the filter output, if the filter succeeded.
          */
-        char filename[256] = { '\0' };
-        snprintf( filename, sizeof(filename)-1, "%s/body.filter.XXXXXX", tmp->c_str() );
-
-        /**
-         * Open the file.
-         */
-        int fd  = mkstemp(filename);
+        std::string output;
+        if ( CFilter::Instance()->filter_file( filter_key(), *filter, path(), output ) )
+        {
+            open_message_text( output );
+            if ( is_valid() )
+                remember_parsed();
+            return is_valid();
+        }
 
-        /**
-         * Build up the command to execute, via cat.
-         */
-        std::string cmd = "/bin/cat" ;
-        assert( CFile::exists( cmd ) );
+        DEBUG_LOG( "CMessage::message_parse - mail_filter failed for " + path() );
+    }
 
-        cmd += " ";
-        cmd += path();
-        cmd += "|";
-        cmd += *filter;
+    /**
+     * OK we've not parsed the message, and there is no filter present,
+     * or it failed, so parse the literal message.
+     */
+    open_message( path().c_str() );
+    if ( is_valid() )
+        remember_parsed();
 
-        /**
-         * Run through the popen dance.
-         */
-        FILE* pipe = popen(cmd.c_str(), "r");
-        if (pipe)
-        {
-            char buffer[16384] = { '\0' };
-            std::string tmp = "";
+    return is_valid();
+}
 
-            while(!feof(pipe))
-            {
-                if(fgets(buffer, sizeof(buffer)-1, pipe) != NULL)
-                    tmp += buffer;
 
-                memset(buffer, '\0', sizeof(buffer));
-            }
-            pclose(pipe);
+/**
+ * Can the message be parsed without waiting for the mail_filter?
+ */
+bool CMessage::parse_ready()
+{
+    if ( is_valid() )
+        return true;
 
-            /**
-             * Write the body out to disk.
-             */
-            std::ofstream on;
-            on.open(filename, std::ios::binary);
-            on.write(tmp.c_str(), tmp.size());
-            on.close();
+    std::string *filter = CGlobal::Instance()->get_variable("mail_filter");
+    if ( ( filter == NULL ) || filter->empty() )
+        return true;
 
-            /**
-             * Parse the message, from the temporary file.
-             */
-            open_message( filename );
-        }
+    return( CFilter::Instance()->prepare_file( filter_key(), *filter, path() ) );
+}
 
-        /**
-         * Don't leak the filename
-         */
-        close(fd);
-        CFile::delete_file( filename );
-        return is_valid();
 
+/**
+ * Record that we've been parsed, most recently, closing the message
+ * which was parsed least recently if too many are held.
+ */
+void CMessage::remember_parsed()
+{
+    if ( m_in_parsed )
+    {
+        parsed_messages.splice( parsed_messages.begin(), parsed_messages, m_parsed );
+        return;
     }
 
-    /**
-     * OK we've not parsed the message, and there is not filter present.
-     * so parse the literal message.
-     */
-    open_message( path().c_str() );
+    parsed_messages.push_front( this );
+    m_parsed    = parsed_messages.begin();
+    m_in_parsed = true;
 
-    return is_valid();
+    while( parsed_messages.size() > MAX_PARSED_MESSAGES )
+        parsed_messages.back()->close_message();
 }
 
 
@@ -185,7 +239,7 @@ bool CMessage::message_parse()
  */
 std::string CMessage::path()
 {
-    return (m_path);
+    return ( *m_folder + m_file );
 }
 
 size_t CMessage::size()
@@ -203,7 +257,7 @@ size_t CMessage::size()
  */
 void CMessage::path( std::string new_path )
 {
-    m_path = new_path;
+    set_path( new_path );
 
     /**
      * Reset the cached stat() data.
@@ -217,6 +271,29 @@ void CMessage::path( std::string new_path )
 }
 
 
+/**
+ * Set our path, and parse the flags it holds.
+ */
+void CMessage::set_path( const std::string &path )
+{
+    size_t slash = path.rfind( '/' );
+    m_folder     = CStringPool::Instance()->intern( path.substr( 0, slash + 1 ) );
+    m_file       = path.substr( slash + 1 );
+
+    m_flags = 0;
+
+    size_t offset = m_file.find( ":2," );
+    if ( offset != std::string::npos )
+        m_flags = flag_mask( m_file.substr( offset + 3 ) );
+
+    /**
+     * Sleazy Hack.
+     */
+    if ( m_folder->find( "/new/" ) != std::string::npos )
+        m_flags |= FLAG_NEW;
+}
+
+
 /**
  * Copy this message to a different maildir.
  */
@@ -249,32 +326,80 @@ void CMessage::remove()
  */
 std::string CMessage::get_flags()
 {
-    std::string flags = "";
-    std::string pth   = path();
+    return( flag_string( m_flags ) );
+}
 
-    if (pth.empty())
-        return (flags);
 
-    size_t offset = pth.find(":2,");
-    if (offset != std::string::npos)
-        flags = pth.substr(offset + 3);
+/**
+ * Retrieve the current flags for this message, as a mask.
+ */
+uint64_t CMessage::flags()
+{
+    return( m_flags );
+}
 
-    /**
-     * Sleazy Hack.
-     */
-    if ( pth.find( "/new/" ) != std::string::npos )
-        flags += "N";
 
+/**
+ * Convert the given flags to a mask.
+ */
+uint64_t CMessage::flag_mask( const std::string &flags )
+{
+    uint64_t mask = 0;
 
-    /**
-     * Sort the flags, and remove duplicates
-     */
-    std::sort( flags.begin(), flags.end());
-    flags.erase(std::unique(flags.begin(), flags.end()), flags.end());
+    for (char c : flags)
+        mask |= flag_bit( c );
 
-    return flags;
+    return( mask );
 }
 
+
+/**
+ * Convert the given mask to a string of flags, in sorted order.
+ */
+std::string CMessage::flag_string( uint64_t mask )
+{
+    std::string flags;
+
+    for( int i = 0; i < 52; i++ )
+    {
+        if ( mask & ( (uint64_t) 1 << i ) )
+            flags += (char) ( ( i < 26 ) ? ( 'A' + i ) : ( 'a' + i - 26 ) );
+    }
+
+    return( flags );
+}
+
+
+/**
+ * Count the messages which have all of the flags in the given mask.
+ *
+ * This is used for every message in a folder, so avoids branching.
+ */
+size_t CMessage::count_flags( const std::vector<std::shared_ptr<CMessage> > &messages, uint64_t mask )
+{
+    size_t count = 0;
+
+    for (const std::shared_ptr<CMessage> &message : messages )
+        count += ( ( message->m_flags & mask ) == mask );
+
+    return( count );
+}
+
+
+/**
+ * Count the messages which are new.
+ */
+size_t CMessage::count_new( const std::vector<std::shared_ptr<CMessage> > &messages )
+{
+    size_t count = 0;
+
+    for (const std::shared_ptr<CMessage> &message : messages )
+        count += ( ( message->m_flags & ( FLAG_SEEN | FLAG_NEW ) ) != FLAG_SEEN );
+
+    return( count );
+}
+
+
 /**
  * Set the flags for this message.
  */
@@ -283,9 +408,7 @@ void CMessage::set_flags( std::string new_flags )
     /**
      * Sort the flags.
      */
-    std::string flags = new_flags;
-    std::sort( flags.begin(), flags.end());
-    flags.erase(std::unique(flags.begin(), flags.end()), flags.end());
+    std::string flags = flag_string( flag_mask( new_flags ) );
 
     /**
      * Get the current ending position.
@@ -310,12 +433,96 @@ void CMessage::set_flags( std::string new_flags )
 
 
     DEBUG_LOG( "CMessage::set_flags()" + cur_path + " to " + dst_path );
-    if ( cur_path != dst_path )
+    rename_to( dst_path );
+}
+
+
+/**
+ * Add, and remove, the given flags with a single rename.
+ */
+bool CMessage::update_flags( const std::string &add, const std::string &remove )
+{
+    uint64_t add_mask    = flag_mask( add );
+    uint64_t remove_mask = flag_mask( remove );
+
+    /**
+     * The flags held in the filename, as opposed to the "N" we
+     * report for messages beneath new/.
+     */
+    std::string base     = m_file;
+    uint64_t file_flags  = 0;
+
+    size_t offset = m_file.find( ":2," );
+    if ( offset != std::string::npos )
+    {
+        base       = m_file.substr( 0, offset );
+        file_flags = flag_mask( m_file.substr( offset + 3 ) );
+    }
+
+    uint64_t updated = ( file_flags | add_mask ) & ~remove_mask;
+
+    /**
+     * Removing "N" from a message beneath new/ moves it to cur/.
+     */
+    std::string folder = *m_folder;
+    if ( ( remove_mask & FLAG_NEW ) && ( folder.size() >= 5 ) &&
+         ( folder.compare( folder.size() - 5, 5, "/new/" ) == 0 ) )
+        folder.replace( folder.size() - 5, 5, "/cur/" );
+
+    /**
+     * Only add the info-suffix if there are flags, or there was one.
+     */
+    std::string dst_path = folder + base;
+    if ( ( offset != std::string::npos ) || ( updated != 0 ) )
+    {
+        dst_path += ":2,";
+        dst_path += flag_string( updated );
+    }
+
+    return( rename_to( dst_path ) );
+}
+
+
+/**
+ * Add, and remove, the given flags from each of the given messages.
+ */
+size_t CMessage::update_flags( const std::vector<std::shared_ptr<CMessage> > &messages,
+                               const std::string &add, const std::string &remove )
+{
+    size_t updated = 0;
+
+    for (const std::shared_ptr<CMessage> &message : messages )
     {
-        CFile::move( cur_path, dst_path );
-        path( dst_path );
-        close_message();
+        if ( message->update_flags( add, remove ) )
+            updated += 1;
     }
+
+    return( updated );
+}
+
+
+/**
+ * Rename the message to the given path, if that differs from ours.
+ */
+bool CMessage::rename_to( const std::string &dst_path )
+{
+    std::string cur_path = path();
+    if ( cur_path == dst_path )
+        return true;
+
+    if ( rename( cur_path.c_str(), dst_path.c_str() ) != 0 )
+    {
+        DEBUG_LOG( "CMessage::rename_to - failed to rename " + cur_path + " to " + dst_path );
+        return false;
+    }
+
+    path( dst_path );
+
+    /**
+     * The index, and the unread-counts, show the flags.
+     */
+    CGlobal::Instance()->set_dirty( VIEW_INDEX | VIEW_MAILDIR );
+    return true;
 }
 
 
@@ -326,17 +533,12 @@ void CMessage::set_flags( std::string new_flags )
  */
 bool CMessage::add_flag( char c )
 {
-    std::string flags = get_flags();
-
-    size_t offset = std::string::npos;
-
     /**
      * If the flag was missing, add it.
      */
-    if ( ( offset = flags.find( c ) ) == std::string::npos )
+    if ( ( m_flags & flag_bit( c ) ) == 0 )
     {
-        flags += c;
-        set_flags( flags );
+        update_flags( std::string( 1, c ), "" );
         return true;
     }
     else
@@ -354,10 +556,7 @@ bool CMessage::has_flag( char c )
      */
     c = toupper(c);
 
-    if ( get_flags().find( c ) != std::string::npos)
-        return true;
-    else
-        return false;
+    return( ( m_flags & flag_bit( c ) ) != 0 );
 }
 
 /**
@@ -369,22 +568,15 @@ bool CMessage::remove_flag( char c )
 {
     c = toupper(c);
 
-    std::string current = get_flags();
+    uint64_t bit = flag_bit( c );
 
     /**
      * If the flag is not present, return.
      */
-    if ( current.find( c ) == std::string::npos)
+    if ( ( m_flags & bit ) == 0 )
         return false;
 
-    /**
-     * Remove the flag.
-     */
-    std::string::size_type k = 0;
-    while((k=current.find(c,k))!=current.npos)
-        current.erase(k, 1);
-
-    set_flags( current );
+    update_flags( "", std::string( 1, c ) );
 
     return true;
 }
@@ -408,6 +600,12 @@ bool CMessage::matches_filter( std::string *filter )
             return false;
     }
 
+    /**
+     * Is this a query?
+     */
+    if ( filter->length() > 6 && strncasecmp( filter->c_str(), "QUERY:", 6 ) == 0 )
+        return( CQuery::compile( filter->substr( 6 ) )->matches( this ) );
+
     /**
      * Is this a header-limit?
      */
@@ -429,13 +627,15 @@ bool CMessage::matches_filter( std::string *filter )
              * Split the header list by "|" and return true if any of
              * them match.
              */
+            std::shared_ptr<CRegex> re = CRegexCache::Instance()->get( pattern );
+
             std::istringstream helper(head);
             std::string tmp;
             while (std::getline(helper, tmp, '|'))
             {
                 std::string value = header( tmp );
 
-                if (pcrecpp::RE(pattern, pcrecpp::RE_Options().set_caseless(true)).PartialMatch(value) )
+                if ( re->matches( value ) )
                     return true;
             }
             return false;
@@ -452,7 +652,7 @@ bool CMessage::matches_filter( std::string *filter )
     /**
      * Regexp Matching.
      */
-    if (pcrecpp::RE(*filter, pcrecpp::RE_Options().set_caseless(true)).PartialMatch(formatted) )
+    if ( CRegexCache::Instance()->matches( *filter, formatted ) )
         return true;
 
     return false;
@@ -470,10 +670,7 @@ bool CMessage::is_new()
      * It has the flag "N".
      * It does not have the flag "S".
      */
-    if ( ( has_flag( 'N' ) ) || ( ! has_flag( 'S' ) ) )
-        return true;
-
-    return false;
+    return( ( m_flags & ( FLAG_SEEN | FLAG_NEW ) ) != FLAG_SEEN );
 }
 
 
@@ -517,50 +714,11 @@ time_t CMessage::mtime()
  */
 bool CMessage::mark_read()
 {
-    /*
-     * Get the current path, and build a new one.
-     */
-    std::string c_path = path();
-    std::string n_path = "";
-
-    size_t offset = std::string::npos;
-
     /**
-     * If we find /new/ in the path then rename to be /cur/
+     * Moving the message from new/ to cur/, and marking it as seen,
+     * is a single rename.
      */
-    if ( ( offset = c_path.find( "/new/" ) )!= std::string::npos )
-    {
-        /**
-         * Path component before /new/ + after it.
-         */
-        std::string before = c_path.substr(0,offset);
-        std::string after  = c_path.substr(offset+strlen("/new/"));
-
-        n_path = before + "/cur/" + after;
-        if ( rename(  c_path.c_str(), n_path.c_str() )  == 0 )
-        {
-            path(n_path);
-            add_flag( 'S' );
-            return true;
-        }
-        else
-        {
-            return false;
-        }
-    }
-    else
-    {
-        /**
-         * The file is new, but not in the new folder.
-         *
-         * That means we need to remove "N" from the flag-component of the path.
-         *
-         */
-        remove_flag( 'N' );
-        add_flag( 'S' );
-        return true;
-    }
-
+    return( update_flags( "S", "N" ) );
 }
 
 
@@ -609,228 +767,657 @@ bool CMessage::mark_unflagged()
 }
 
 
+/**
+ * The names of the summary headers, by offset, which are those used
+ * for display, sorting, and limiting.
+ */
+static const char *summary_names[] = { "date", "from", "to", "cc", "subject" };
+
+
+/**
+ * The other headers the `index_limit` refers to, the names of all the
+ * headers we keep, and the limit they were found from.
+ */
+static std::vector<std::string> limit_names;
+static std::unordered_set<std::string> kept_names;
+static std::string kept_limit;
+
+
+/**
+ * Add the names in the given "|"-separated list to the limit headers,
+ * unless they're summary headers.
+ */
+static void add_limit_names( const std::string &list )
+{
+    std::istringstream helper( list );
+    std::string name;
+    while( std::getline( helper, name, '|' ) )
+    {
+        std::transform( name.begin(), name.end(), name.begin(), tolower );
+
+        if ( name.empty() || ( kept_names.find( name ) != kept_names.end() ) )
+            continue;
+
+        kept_names.insert( name );
+        limit_names.push_back( name );
+    }
+}
+
+
+/**
+ * Find the headers the `index_limit` refers to, if it has changed.
+ */
+static const std::vector<std::string> &limit_headers()
+{
+    static const std::string none;
+
+    std::string *limit = CGlobal::Instance()->get_variable( "index_limit" );
+    const std::string &text = ( limit != NULL ) ? *limit : none;
+
+    if ( !kept_names.empty() && ( text == kept_limit ) )
+        return( limit_names );
+
+    kept_limit = text;
+    limit_names.clear();
+    kept_names.clear();
+
+    for( const char *name : summary_names )
+        kept_names.insert( name );
+
+    if ( text.length() > 6 && strncasecmp( text.c_str(), "QUERY:", 6 ) == 0 )
+    {
+        std::vector<std::string> names;
+        CQuery::compile( text.substr( 6 ) )->header_names( names );
+
+        for (std::string name : names)
+            add_limit_names( name );
+    }
+    else if ( text.length() > 8 && strncasecmp( text.c_str(), "HEADER:", 7 ) == 0 )
+    {
+        size_t offset = text.find( ":", 8 );
+        if ( offset != std::string::npos )
+            add_limit_names( text.substr( 7, offset - 7 ) );
+    }
+
+    return( limit_names );
+}
+
+
+/**
+ * The names of the headers which are kept for each message.
+ */
+const std::unordered_set<std::string> &CMessage::kept_headers()
+{
+    limit_headers();
+    return( kept_names );
+}
+
+
+/**
+ * Does the given set of headers hold those the `index_limit` refers to?
+ *
+ * Those which were absent are stored, empty, in the cache, so this is
+ * false only for entries stored when the limit was different.
+ */
+static bool has_limit_names( const std::unordered_map<std::string, UTFString> &values )
+{
+    for (const std::string &name : limit_headers())
+    {
+        if ( values.find( name ) == values.end() )
+            return false;
+    }
+    return true;
+}
+
+
+/**
+ * The fields which may be used in index_format, by offset.
+ */
+enum TIndexField
+{
+    INDEX_FLAGS,
+    INDEX_FROM,
+    INDEX_TO,
+    INDEX_SUBJECT,
+    INDEX_DATE,
+    INDEX_YEAR,
+    INDEX_MONTH,
+    INDEX_MON,
+    INDEX_DAY,
+    INDEX_FIELDS
+};
+static const char *index_fields[INDEX_FIELDS + 1] = { "FLAGS", "FROM", "TO", "SUBJECT", "DATE", "YEAR", "MONTH", "MON", "DAY", 0 };
+
+
 /**
  * Format the message for display in the header - via the lua format string.
  */
 UTFString CMessage::format( std::string fmt )
 {
-    UTFString result = fmt;
-
     /**
      * Get the format-string we'll expand from the global
      * setting, if it wasn't supplied.
      */
-    if ( result.empty() )
+    if ( fmt.empty() )
     {
         CGlobal *global  = CGlobal::Instance();
-        std::string *fmt = global->get_variable("index_format");
-        result = std::string(*fmt);
+        std::string *f   = global->get_variable("index_format");
+        fmt = std::string(*f);
     }
 
+    std::shared_ptr<CFormat> compiled = CFormat::compile( fmt, index_fields );
+
     /**
-     * The variables we know about.
+     * If we've already formatted ourselves with this format, and our
+     * flags haven't changed since, then we're done.
      */
-    const char *fields[10] = { "$FLAGS", "$FROM", "$TO", "$SUBJECT",  "$DATE", "$YEAR", "$MONTH", "$MON", "$DAY", 0 };
-    const char **std_name = fields;
+    if ( ( m_format_id == compiled->id() ) && ( m_format_flags == m_flags ) )
+        return( m_formatted );
+
+    UTFString result;
 
+    if ( ! compiled->has_fields() && fmt.size() > 1 && fmt.at(0) == '$' )
+    {
+        /**
+         * See if it is header value we can find.
+         */
+        result = header( fmt.substr(1) );
+        if ( result.empty() )
+            result = "[unset]";
+    }
+    else
+    {
+        /**
+         * Expand only the fields which are used.
+         *
+         * The values, and the output, are kept between calls to reuse
+         * their storage.
+         */
+        static std::vector<std::string> values( INDEX_FIELDS );
+        static std::string buffer;
+
+        if ( compiled->uses( INDEX_FLAGS ) )
+        {
+            /**
+             * Ensure the flags are suitably padded.
+             */
+            values[INDEX_FLAGS] = get_flags();
+            while( values[INDEX_FLAGS].size() < 4 )
+                values[INDEX_FLAGS] += " ";
+        }
+        if ( compiled->uses( INDEX_FROM ) )
+            values[INDEX_FROM] = header( "From" );
+        if ( compiled->uses( INDEX_TO ) )
+            values[INDEX_TO] = header( "To" );
+        if ( compiled->uses( INDEX_SUBJECT ) )
+            values[INDEX_SUBJECT] = header( "Subject" );
+        if ( compiled->uses( INDEX_DATE ) )
+            values[INDEX_DATE] = date();
+        if ( compiled->uses( INDEX_YEAR ) )
+            values[INDEX_YEAR] = date(EYEAR);
+        if ( compiled->uses( INDEX_MONTH ) )
+            values[INDEX_MONTH] = date(EMONTH);
+        if ( compiled->uses( INDEX_MON ) )
+            values[INDEX_MON] = date(EMON);
+        if ( compiled->uses( INDEX_DAY ) )
+            values[INDEX_DAY] = date(EDAY);
+
+        compiled->render( values, buffer );
+        result = buffer;
+    }
+
+    m_format_id    = compiled->id();
+    m_format_flags = m_flags;
+    m_formatted    = result;
+
+    return( result );
+}
+
+
+/**
+ * Retrieve the value of a given header from the message.
+ *
+ * NOTE: All headers are converted to lower-case prior to lookup.
+ *
+ */
+UTFString CMessage::header( std::string name )
+{
+    std::string nm(name);
+    std::transform(nm.begin(), nm.end(), nm.begin(), tolower);
+
+    std::string val;
 
     /**
-     * Iterate over everything we could possibly-expand.
+     * The summary headers are held for every message, but anything else
+     * requires all the headers to be read.
      */
-    for( int i = 0 ; std_name[i] ; ++i)
+    int field = -1;
+    for( int i = 0; i < SUMMARY_HEADERS; i++ )
     {
+        if ( nm == summary_names[i] )
+            field = i;
+    }
 
-        size_t offset = result.find( std_name[i], 0 );
+    if ( field >= 0 )
+    {
+        if ( !m_have_headers )
+        {
+            DEBUG_LOG( "CMessage::header(" + name + ") - Reading summary headers" );
+
+            std::unordered_map<std::string, UTFString> values;
+            m_headers_pending = false;
+            read_headers( values, true );
+            set_summary( values );
+        }
 
-        if ( ( offset != std::string::npos ) && ( offset < result.size() ) )
+        if ( m_summary[field] != NULL )
+            val = *m_summary[field];
+    }
+    else if ( kept_headers().find( nm ) != kept_headers().end() )
+    {
+        /**
+         * The `index_limit` refers to this header, so it's kept too,
+         * unless the limit changed after the headers were read.
+         */
+        if ( !has_headers() )
+        {
+            DEBUG_LOG( "CMessage::header(" + name + ") - Reading limit headers" );
+
+            std::unordered_map<std::string, UTFString> values;
+            m_headers_pending = false;
+            read_headers( values, true );
+            set_summary( values );
+        }
+
+        for( auto &kept : m_limit_headers )
+        {
+            if ( ( *kept.first == nm ) && ( kept.second != NULL ) )
+                val = *kept.second;
+        }
+    }
+    else
+    {
+        const std::unordered_map<std::string, UTFString> &all = headers();
+        std::unordered_map<std::string, UTFString>::const_iterator it = all.find( nm );
+        if ( it != all.end() )
+            val = it->second;
+    }
+
+    /**
+     * Headers shouldn't have newlines in them.
+     */
+    val.erase(std::remove(val.begin(), val.end(), '\n'), val.end());
+    val.erase(std::remove(val.begin(), val.end(), '\r'), val.end());
+
+    return( val );
+
+}
+
+
+
+/**
+ * Copy the decoded headers of the given GMime object into the map.
+ */
+static void collect_headers( GMimeObject *obj, std::unordered_map<std::string, UTFString> &headers )
+{
+    const char *name;
+    const char *value;
+
+    /**
+     * Prepare to iterate.
+     */
+    GMimeHeaderList *ls   = obj->headers;
+    GMimeHeaderIter *iter = g_mime_header_iter_new ();
+
+    if (g_mime_header_list_get_iter (ls, iter))
+    {
+        while (g_mime_header_iter_is_valid (iter))
         {
+            /**
+             * Get the name + value.
+             */
+            name = g_mime_header_iter_get_name (iter);
+            value = g_mime_header_iter_get_value (iter);
 
             /**
-             * The bit before the variable, the bit after, and the body we'll replace it with.
+             * Downcase the name.
              */
-            std::string before = result.substr(0, offset);
-            std::string body = "";
-            std::string after  = result.substr(offset+strlen(std_name[i]));
+            std::string nm(name);
+            std::transform(nm.begin(), nm.end(), nm.begin(), tolower);
 
             /**
-             * Expand the specific variables.
+             * Decode the value.
              */
-            if ( strcmp(std_name[i] , "$TO" ) == 0 )
-            {
-                body = header( "To" );
-            }
-            if ( strcmp(std_name[i] , "$DATE" ) == 0 )
-            {
-                body = date();
-            }
-            if ( strcmp(std_name[i] , "$FROM" ) == 0 )
-            {
-                body += header( "From" );
-            }
-            if ( strcmp(std_name[i] , "$FLAGS" ) == 0 )
-            {
-                /**
-                 * Ensure the flags are suitably padded.
-                 */
-                body = get_flags();
+            char *decoded = g_mime_utils_header_decode_text ( value );
 
-                while( body.size() < 4 )
-                    body += " ";
-            }
-            if ( strcmp(std_name[i] , "$SUBJECT" ) == 0 )
-            {
-                body = header( "Subject" );
-            }
-            if ( strcmp(std_name[i],  "$YEAR" ) == 0 )
-            {
-                body = date(EYEAR);
-            }
-            if ( strcmp(std_name[i],  "$MONTH" ) == 0 )
-            {
-                body = date(EMONTH);
-            }
-            if ( strcmp(std_name[i],  "$MON" ) == 0 )
-            {
-                body = date(EMON);
-            }
-            if ( strcmp(std_name[i],  "$DAY" ) == 0 )
-            {
-                body = date(EDAY);
-            }
+            /**
+             * Store the result.
+             */
+            headers[nm] = decoded;
+
+            g_free(decoded);
 
-            result = before + body + after;
+            if (!g_mime_header_iter_next (iter))
+                break;
         }
     }
+    g_mime_header_iter_free (iter);
+}
 
-    /**
-     * If the value is still unchanged ..
-     */
-    if ( result.size() > 1 && result.at(0) == '$' )
+
+/**
+ * Retrieve all headers, and their values, from the message.
+ */
+const std::unordered_map<std::string, UTFString> &CMessage::headers()
+{
+    if ( !m_all_headers )
     {
+        DEBUG_LOG( "CMessage::headers() - Reading from message:" + path() );
+
         /**
-         * See if it is header value we can find.
+         * If we're being parsed in the background we'll get there
+         * first, and any late result will be ignored.
          */
-        result = header( result.substr(1) );
-        if ( result.empty() )
-            result = "[unset]";
+        m_headers_pending = false;
+
+        /**
+         * The persistent cache holds only the summary headers, so
+         * can't help here.
+         */
+        m_all_headers.reset( new std::unordered_map<std::string, UTFString> );
+        read_headers( *m_all_headers, false );
+    }
+    else
+    {
+        DEBUG_LOG( "CMessage::headers() - Cached values maintained: " + path() );
+    }
+
+    return( *m_all_headers );
+}
+
+
+/**
+ * Read the headers of the message.
+ */
+bool CMessage::read_headers( std::unordered_map<std::string, UTFString> &values, bool summary )
+{
+    /**
+     * See if the persistent cache already holds the headers.
+     */
+    CHeaderCache *cache = CHeaderCache::Instance();
+    struct stat s;
+
+    if ( summary && cache->enabled() && ( stat( path().c_str(), &s ) == 0 ) )
+    {
+        m_time_cache = s.st_mtime;
+
+        if ( cache->lookup( path(), s.st_size, s.st_mtime, values, m_date ) &&
+             has_limit_names( values ) )
+            return true;
+
+        values.clear();
+    }
+
+    /**
+     * Unless the mail_filter applies to them the headers are in the
+     * file itself, so read just those, rather than building the whole
+     * MIME tree.
+     */
+    if ( header_filter().empty() )
+    {
+        off_t size;
+        time_t mtime;
+
+        if ( !parse_headers( path(), values, size, mtime,
+                             summary ? &kept_headers() : NULL ) )
+            return false;
+
+        m_time_cache = mtime;
+        set_summary( values );
+        store_summary( size, mtime );
+        return true;
+    }
+
+    /**
+     * Parse the message and return if invalid.
+     */
+    if ( !message_parse() )
+        return false;
+
+    collect_headers( GMIME_OBJECT(m_message), values );
+
+    set_summary( values );
+    if ( stat( path().c_str(), &s ) == 0 )
+        store_summary( s.st_size, s.st_mtime );
+
+    return true;
+}
+
+
+/**
+ * Keep the summary headers, and those the limit refers to, from the
+ * given set.
+ */
+void CMessage::set_summary( const std::unordered_map<std::string, UTFString> &values )
+{
+    CStringPool *pool = CStringPool::Instance();
+
+    for( int i = 0; i < SUMMARY_HEADERS; i++ )
+    {
+        std::unordered_map<std::string, UTFString>::const_iterator it = values.find( summary_names[i] );
+        if ( it == values.end() )
+            m_summary[i] = NULL;
+        else
+            m_summary[i] = pool->intern( it->second.raw() );
+    }
+
+    m_limit_headers.clear();
+    for (const std::string &name : limit_headers())
+    {
+        std::unordered_map<std::string, UTFString>::const_iterator it = values.find( name );
+        const std::string *value = NULL;
+        if ( it != values.end() )
+            value = pool->intern( it->second.raw() );
+
+        m_limit_headers.push_back( std::make_pair( pool->intern( name ), value ) );
     }
 
-    return( result );
+    m_have_headers = true;
+
+    /**
+     * Any cached formatting was made without these headers.
+     */
+    m_format_id = 0;
+}
+
+
+/**
+ * Update the persistent cache with our summary headers.
+ */
+void CMessage::store_summary( off_t size, time_t mtime )
+{
+    CHeaderCache *cache = CHeaderCache::Instance();
+    if ( !cache->enabled() )
+        return;
+
+    std::unordered_map<std::string, UTFString> values;
+    for( int i = 0; i < SUMMARY_HEADERS; i++ )
+    {
+        if ( m_summary[i] != NULL )
+            values[summary_names[i]] = *m_summary[i];
+    }
+
+    /**
+     * Absent limit headers are stored empty, so a later lookup can tell
+     * they were looked for.
+     */
+    for( auto &kept : m_limit_headers )
+        values[*kept.first] = ( kept.second != NULL ) ? *kept.second : "";
+
+    cache->store( path(), size, mtime, values, m_date );
+}
+
+
+/**
+ * Have the headers of this message been read?
+ */
+bool CMessage::has_headers()
+{
+    if ( !m_have_headers )
+        return false;
+
+    /**
+     * The limit may refer to headers which weren't kept when they were.
+     */
+    for (const std::string &name : limit_headers())
+    {
+        bool found = false;
+        for( auto &kept : m_limit_headers )
+        {
+            if ( *kept.first == name )
+                found = true;
+        }
+
+        if ( !found )
+            return false;
+    }
+    return true;
+}
+
+
+/**
+ * Populate the headers from the persistent cache, if they are present.
+ */
+bool CMessage::load_cached_headers()
+{
+    CHeaderCache *cache = CHeaderCache::Instance();
+    if ( !cache->enabled() )
+        return false;
+
+    struct stat s;
+    if ( stat( path().c_str(), &s ) != 0 )
+        return false;
+
+    m_time_cache = s.st_mtime;
+
+    std::unordered_map<std::string, UTFString> values;
+    if ( !cache->lookup( path(), s.st_size, s.st_mtime, values, m_date ) ||
+         !has_limit_names( values ) )
+        return false;
+
+    set_summary( values );
+    return true;
+}
+
+
+/**
+ * Set the headers of this message, as parsed elsewhere.
+ */
+void CMessage::set_headers( const std::unordered_map<std::string, UTFString> &headers,
+                            off_t size, time_t mtime )
+{
+    m_headers_pending = false;
+    m_time_cache      = mtime;
+
+    set_summary( headers );
+    store_summary( size, mtime );
+}
+
+
+/**
+ * Mark the headers as being parsed in the background.
+ */
+void CMessage::set_headers_pending( bool pending )
+{
+    m_headers_pending = pending;
+}
+
+
+/**
+ * Can the headers be read without parsing the message?
+ */
+bool CMessage::headers_available()
+{
+    return( !m_headers_pending || m_have_headers );
 }
 
 
 /**
- * Retrieve the value of a given header from the message.
+ * Read and decode the header-block of the given file.
  *
- * NOTE: All headers are converted to lower-case prior to lookup.
+ * The file is mapped, rather than read, so only the pages holding the
+ * headers are ever touched, and GMime is never involved.
  *
+ * NOTE: This is called from the prefetch workers, so must not touch
+ * any shared state.
  */
-UTFString CMessage::header( std::string name )
+bool CMessage::parse_headers( std::string path,
+                              std::unordered_map<std::string, UTFString> &headers,
+                              off_t &size, time_t &mtime,
+                              const std::unordered_set<std::string> *names )
 {
-    /**
-     * If we don't have the set of header:value pairs from the
-     * message then open the message for parsing and read them all.
-     */
-    if ( m_header_values.empty() )
+    int fd = open( path.c_str(), O_RDONLY | O_CLOEXEC );
+    if ( fd < 0 )
+        return false;
+
+    struct stat s;
+    if ( ( fstat( fd, &s ) != 0 ) || ( s.st_size == 0 ) )
     {
-        DEBUG_LOG( "CMessage::header(" + name + ") - Triggering CMessage::headers()" );
-        headers();
+        close( fd );
+        return false;
     }
+    size  = s.st_size;
+    mtime = s.st_mtime;
 
-    /**
-     * Lookup the cached values.
-     */
-    std::string nm(name);
-    std::transform(nm.begin(), nm.end(), nm.begin(), tolower);
+    void *data = mmap( NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    close( fd );
+
+    if ( data == MAP_FAILED )
+        return false;
 
     /**
-     * Headers shouldn't have newlines in them.
+     * Find the blank line which ends the headers, but don't look through
+     * unbounded amounts of a broken message.
      */
-    std::string val = m_header_values[nm];
-    val.erase(std::remove(val.begin(), val.end(), '\n'), val.end());
-    val.erase(std::remove(val.begin(), val.end(), '\r'), val.end());
+    size_t len = std::min( (size_t) s.st_size, (size_t) ( 1024 * 1024 ) );
+    len = CHeaderParser::header_length( (const char *) data, len );
 
-    return( val );
+    CHeaderParser::parse( (const char *) data, len, headers, names );
+    munmap( data, s.st_size );
 
+    return( true );
 }
 
 
-
 /**
- * Retrieve all headers, and their values, from the message.
+ * The approximate number of bytes of memory used by this message.
+ *
+ * Pooled strings are shared, so aren't counted here.
  */
-std::unordered_map<std::string, UTFString> CMessage::headers()
+size_t CMessage::memory_usage()
 {
-    /**
-     * If the headers are empty then read them.
-     */
-    if ( m_header_values.empty() )
-    {
-        DEBUG_LOG( "CMessage::headers() - Reading from message:" + path() );
-
-        const char *name;
-        const char *value;
+    size_t total = sizeof( CMessage );
 
-        /**
-         * Parse the message and return if invalid.
-         */
-        if ( !message_parse() )
-            return m_header_values;
+    total += CStringPool::heap_size( m_file );
+    total += CStringPool::heap_size( m_formatted.raw() );
 
-        /**
-         * Prepare to iterate.
-         */
-        GMimeHeaderList *ls   = GMIME_OBJECT (m_message)->headers;
-        GMimeHeaderIter *iter = g_mime_header_iter_new ();
+    if ( m_all_headers )
+    {
+        total += sizeof( *m_all_headers );
+        total += m_all_headers->bucket_count() * sizeof( void * );
 
-        if (g_mime_header_list_get_iter (ls, iter))
+        for( auto it = m_all_headers->begin(); it != m_all_headers->end(); ++it )
         {
-            while (g_mime_header_iter_is_valid (iter))
-            {
-                /**
-                 * Get the name + value.
-                 */
-                name = g_mime_header_iter_get_name (iter);
-                value = g_mime_header_iter_get_value (iter);
-
-                /**
-                 * Downcase the name.
-                 */
-                std::string nm(name);
-                std::transform(nm.begin(), nm.end(), nm.begin(), tolower);
-
-                /**
-                 * Decode the value.
-                 */
-                char *decoded = g_mime_utils_header_decode_text ( value );
-
-                /**
-                 * Store the result.
-                 */
-                m_header_values[nm] = decoded;
-
-                g_free(decoded);
-
-                if (!g_mime_header_iter_next (iter))
-                    break;
-            }
+            total += sizeof( *it ) + sizeof( void * );
+            total += CStringPool::heap_size( it->first );
+            total += CStringPool::heap_size( it->second.raw() );
         }
-        g_mime_header_iter_free (iter);
-
-        /**
-         * Close the message.
-         */
-        close_message();
-    }
-    else
-    {
-        DEBUG_LOG( "CMessage::headers() - Cached values maintained: " + path() );
     }
 
-    /**
-     * Return the results.
-     */
-    return( m_header_values );
+    total += m_limit_headers.capacity() * sizeof( m_limit_headers[0] );
+    total += m_attachments.capacity() * sizeof( CAttachList::value_type );
+
+    return( total );
 }
 
 
@@ -975,6 +1562,11 @@ std::string CMessage::date(TDate fmt)
              */
             m_date = timegm(&t);
         }
+
+        /**
+         * Save the parsed date alongside the cached headers.
+         */
+        CHeaderCache::Instance()->update_date( path(), m_date );
     }
 
     if ( fmt == EFULL )
@@ -1078,27 +1670,98 @@ time_t CMessage::get_date_field()
 
 
 /**
- * Get the body from our message, using GMime.
+ * Open a stream of the decoded content of a part, which the caller must
+ * unref.
+ *
+ * The content is decoded as it is read, rather than written to memory
+ * first, as g_mime_data_wrapper_write_to_stream() would.
  */
-UTFString CMessage::get_body()
+static GMimeStream *decoded_stream( GMimeDataWrapper *content )
 {
-    /**
-     * The body we'll return back to the caller.  May be empty if there
-     * is no text/plain part in the message.
-     */
-    UTFString result;
+    GMimeStream *source = g_mime_data_wrapper_get_stream( content );
+    if ( source == NULL )
+        return NULL;
 
-    /**
-     * Parse the message, if not yet done.
-     * Return empty string if parsing failed.
-     */
-    if ( !message_parse() )
-        return result;
+    g_mime_stream_reset( source );
+
+    GMimeContentEncoding encoding = g_mime_data_wrapper_get_encoding( content );
+    if ( encoding == GMIME_CONTENT_ENCODING_DEFAULT ||
+         encoding == GMIME_CONTENT_ENCODING_7BIT ||
+         encoding == GMIME_CONTENT_ENCODING_8BIT ||
+         encoding == GMIME_CONTENT_ENCODING_BINARY )
+    {
+        g_object_ref( source );
+        return( source );
+    }
+
+    GMimeStream *stream = g_mime_stream_filter_new( source );
+    GMimeFilter *filter = g_mime_filter_basic_new( encoding, FALSE );
+
+    g_mime_stream_filter_add( GMIME_STREAM_FILTER( stream ), filter );
+    g_object_unref( filter );
+
+    return( stream );
+}
+
+
+/**
+ * Read the given stream to its end, appending it to the output.
+ */
+static void read_stream( GMimeStream *stream, std::string &output )
+{
+    char buf[4096];
+
+    while( !g_mime_stream_eos( stream ) )
+    {
+        ssize_t len = g_mime_stream_read( stream, buf, sizeof(buf) );
+        if ( len < 0 )
+            break;
+
+        output.append( buf, len );
+    }
+}
+
+
+/**
+ * Append the text of the given part to the output, decoding it, and
+ * converting it to UTF-8 if it isn't already.  If the conversion fails
+ * then the text is appended regardless.
+ */
+static void part_text( GMimeObject *obj, std::string &text )
+{
+    if ( ( obj == NULL ) || !GMIME_IS_PART( obj ) )
+        return;
+
+    GMimeContentType *content_type = g_mime_object_get_content_type (obj);
+
+    const char *charset = NULL;
+    if ( content_type != NULL )
+        charset = g_mime_content_type_get_parameter(content_type, "charset");
+
+    GMimeDataWrapper *c = g_mime_part_get_content_object( GMIME_PART(obj) );
+    GMimeStream *stream = decoded_stream( c );
+    if ( stream == NULL )
+        return;
+
+    CCharset::Instance()->to_utf8( charset, stream, text );
+    g_object_unref(stream);
+}
+
+
+/**
+ * Append the text of the body of the given message to the output: its
+ * first text/plain part, or failing that its last text/html part.
+ *
+ * Returns false if neither was found, and the body was used instead.
+ */
+static bool message_text( GMimeMessage *message, std::string &text )
+{
+    size_t length = text.size();
 
     /**
      * Create an iterator to walk over the MIME-parts of the message.
      */
-    GMimePartIter *iter =  g_mime_part_iter_new ((GMimeObject *) m_message);
+    GMimePartIter *iter =  g_mime_part_iter_new ((GMimeObject *) message);
     assert(iter != NULL);
 
     GMimeObject *last = NULL;
@@ -1119,11 +1782,6 @@ UTFString CMessage::get_body()
              */
             GMimeContentType *content_type = g_mime_object_get_content_type (part);
 
-            /**
-             * LOGGING.
-             */
-            DEBUG_LOG( "CMessage::get_body() - " + UTFString(content_type->type) + " " + UTFString(content_type->subtype) );
-
             /**
              * If the content-type is NULL then text/plain is implied.
              *
@@ -1133,16 +1791,17 @@ UTFString CMessage::get_body()
              */
             if ( ( ( content_type == NULL ) ||
                    ( g_mime_content_type_is_type (content_type, "text", "plain") ) ) &&
-                 ( result.empty() ) )
+                 ( text.size() == length ) )
             {
-                result = mime_part_to_text( part );
+                part_text( part, text );
             }
 
             /**
              * If we've found text/html save that away for the last-ditch
              * attempt.
              */
-            if ( g_mime_content_type_is_type (content_type, "text", "html") )
+            if ( ( content_type != NULL ) &&
+                 g_mime_content_type_is_type (content_type, "text", "html") )
             {
                 last = part ;
             }
@@ -1150,20 +1809,16 @@ UTFString CMessage::get_body()
     }
     while (g_mime_part_iter_next (iter));
 
-
-    if ( result.empty() )
-    {
-        if ( last )
-        {
-            result = mime_part_to_text( last );
-        }
-    }
+    if ( ( text.size() == length ) && last )
+        part_text( last, text );
 
     /**
      * Cleanup.
      */
     g_mime_part_iter_free (iter);
 
+    if ( text.size() > length )
+        return true;
 
     /**
      * If the result is empty then we'll just revert to reading the
@@ -1174,27 +1829,59 @@ UTFString CMessage::get_body()
      *  * There is no text/plain part of the message.
      *  * The message is bogus.
      *
+     * This function is depreciated ..
      */
-    if ( result.empty() )
-    {
-        DEBUG_LOG( "CMessage::get_body() - Fell back to g_mime_message_get_body()" );
+    part_text( g_mime_message_get_body( message ), text );
+    return false;
+}
 
-        /**
-         * This function is depreciated ..
-         */
-        GMimeObject *x = g_mime_message_get_body( m_message );
-        result = mime_part_to_text( x );
+
+/**
+ * Get the body from our message, using GMime.
+ */
+UTFString CMessage::get_body()
+{
+    /**
+     * Parse the message, if not yet done.
+     * Return empty string if parsing failed.
+     */
+    if ( !message_parse() )
+        return "";
+
+    std::string text;
+    if ( message_text( m_message, text ) )
+    {
+        DEBUG_LOG( "CMessage::get_body() - SUCCEEDED With GMime/iconv/etc" );
     }
     else
     {
-        DEBUG_LOG( "CMessage::get_body() - SUCCEEDED With GMime/iconv/etc" );
+        DEBUG_LOG( "CMessage::get_body() - Fell back to g_mime_message_get_body()" );
     }
 
     /**
      * All done.
      */
-    close_message();
-    return( result );
+    return( UTFString( text ) );
+}
+
+
+/**
+ * Parse the message read from the given stream, and append the text of
+ * its body to the output.
+ */
+bool CMessage::parse_body( GMimeStream *stream, std::string &text )
+{
+    GMimeParser *parser = g_mime_parser_new_with_stream (stream);
+    GMimeMessage *message = g_mime_parser_construct_message (parser);
+    g_object_unref (parser);
+
+    if ( message == NULL )
+        return false;
+
+    message_text( message, text );
+    g_object_unref( message );
+
+    return true;
 }
 
 
@@ -1204,12 +1891,26 @@ UTFString CMessage::get_body()
 std::vector<UTFString> CMessage::body()
 {
     std::vector<UTFString> result;
+    body( result, true );
+    return( result );
+}
+
+
+/**
+ * Get the body of the message, as a vector of lines.
+ *
+ * If wait is false, and the display_filter hasn't already been run over
+ * this message, it is started in the background and false is returned.
+ */
+bool CMessage::body( std::vector<UTFString> &result, bool wait )
+{
+    result.clear();
 
     /**
      * Ensure the message has been read.
      */
     if ( !message_parse() )
-        return result;
+        return true;
 
 
     /**
@@ -1221,73 +1922,25 @@ std::vector<UTFString> CMessage::body()
     /**
      * At this point we have a std::string containing the body.
      *
-     * If we have a message_filter set then we should pipe this
-     * through it.
-     *
+     * If we have a display_filter set then we should pipe this
+     * through it.  The output depends upon the mail_filter too, if
+     * one is set, so that is part of the key the result is cached by.
      */
     CGlobal     *global = CGlobal::Instance();
     std::string *filter = global->get_variable("display_filter");
-    std::string *tmp    = global->get_variable("tmp");
 
     if ( ( filter != NULL ) && ( ! ( filter->empty() ) ) )
     {
-        /**
-         * Generate a temporary file for the filter output.
-         */
-        char filename[256] = { '\0' };
-        snprintf( filename, sizeof(filename)-1, "%s/msg.filter.XXXXXX", tmp->c_str() );
-
-        /**
-         * Open the file.
-         */
-        int fd  = mkstemp(filename);
-
-        std::ofstream on;
-        on.open(filename, std::ios::binary);
-        on.write(body.c_str(), body.size());
-        on.close();
-
-        /**
-         * Build up the command to execute, via cat.
-         */
-        std::string cmd = "/bin/cat" ;
-        assert( CFile::exists( cmd ) );
-
-        cmd += " ";
-        cmd += filename;
-        cmd += "|";
-        cmd += *filter;
-
-        /**
-         * Run through the popen dance.
-         */
-        FILE* pipe = popen(cmd.c_str(), "r");
-        if (pipe)
-        {
-            char buffer[16384] = { '\0' };
-            std::string tmp = "";
-
-            while(!feof(pipe))
-            {
-                if(fgets(buffer, sizeof(buffer)-1, pipe) != NULL)
-                    tmp += buffer;
-
-                memset(buffer, '\0', sizeof(buffer));
-            }
-            pclose(pipe);
+        std::string key = filter_key();
+        std::string *mail_filter = global->get_variable("mail_filter");
+        if ( mail_filter != NULL )
+            key += "|" + *mail_filter;
 
-            /**
-             * Replace the body we previously generated
-             * with that we've read from popen.
-             */
-            body = tmp;
-        }
+        std::string output;
+        if ( ! CFilter::Instance()->filter( key, path(), *filter, body, output, wait ) )
+            return false;
 
-        /**
-         * Don't leak the temporary file.
-         */
-        close( fd );
-        CFile::delete_file( filename );
+        body = output;
     }
 
     /**
@@ -1304,9 +1957,7 @@ std::vector<UTFString> CMessage::body()
         result.push_back( line );
     }
 
-
-    close_message();
-    return(result);
+    return true;
 }
 
 
@@ -1336,7 +1987,8 @@ bool CMessage::parse_attachments()
     bool view_inline = lua->get_bool( "view_inline_attachments", true );
 
 
-    int count = 1;
+    int count  = 1;
+    int number = -1;
 
     GMimePartIter *iter =  g_mime_part_iter_new ((GMimeObject *) m_message);
     assert(iter != NULL);
@@ -1350,16 +2002,13 @@ bool CMessage::parse_attachments()
         if  (GMIME_IS_MULTIPART( part ) )
             continue;
 
+        number += 1;
+
         /**
          * Name of the attachment, if we found one.
          */
         char *aname = NULL;
 
-        /**
-         * Attachment content, if we found one.
-         */
-        char *adata = NULL;
-
 
         /**
          * Get the content-disposition, so that we can determine
@@ -1381,75 +2030,144 @@ bool CMessage::parse_attachments()
         }
 
 
-        /**
-         * Get the attachment data.
-         */
-        GMimeStream *mem = g_mime_stream_mem_new();
+        /**
+         * Find the size of the attachment, as stored, without decoding it.
+         */
+        size_t len = 0;
+
+        if (GMIME_IS_MESSAGE_PART (part))
+        {
+            GMimeMessage *msg = g_mime_message_part_get_message (GMIME_MESSAGE_PART (part));
+
+            GMimeStream *null = g_mime_stream_null_new();
+            g_mime_object_write_to_stream (GMIME_OBJECT (msg), null);
+            len = GMIME_STREAM_NULL (null)->written;
+            g_object_unref (null);
+        }
+        else if ( GMIME_IS_PART(part))
+        {
+            GMimeDataWrapper *content = g_mime_part_get_content_object (GMIME_PART (part));
+            GMimeStream *stream       = g_mime_data_wrapper_get_stream (content);
+
+            gint64 length = g_mime_stream_length (stream);
+            if ( length > 0 )
+                len = length;
+        }
+        else
+        {
+            continue;
+        }
+
+        /**
+         * Save the resulting attachment to the array we return.
+         */
+        char tmp[128] = { '\0' };
+        bool is_inline = false;
+
+        GMimeContentType *content_type = g_mime_object_get_content_type (part);
+        gchar *type = g_mime_content_type_to_string ( content_type );
+
+        if ( aname == NULL || ( strlen( aname ) < 1 ) )
+        {
+            snprintf(tmp, sizeof(tmp)-1, "inline-part-%d %s", count, type );
+            count += 1;
+            aname = tmp;
+            is_inline = true;
+        }
+
+        /**
+         * We add inline parts only if we've been told to.
+         */
+        if ( ( view_inline == true ) ||
+             ( view_inline == false && ( is_inline == false ) ) )
+        {
+            std::shared_ptr<CAttachment> foo = std::shared_ptr<CAttachment>(new CAttachment( aname, type, number, len ));
+            m_attachments.push_back(foo);
+        }
+
+        g_free( type );
+    }
+    while (g_mime_part_iter_next (iter));
+
+    g_mime_part_iter_free (iter);
+
+    return( true );
+}
+
+
+/**
+ * Find the given MIME-part, counting only those which aren't multipart
+ * containers.  The result belongs to the parsed message.
+ */
+GMimeObject *CMessage::find_part( int number )
+{
+    if ( !message_parse() )
+        return NULL;
+
+    GMimeObject *result = NULL;
+
+    GMimePartIter *iter =  g_mime_part_iter_new ((GMimeObject *) m_message);
+    assert(iter != NULL);
 
-        if (GMIME_IS_MESSAGE_PART (part))
-        {
-            GMimeMessage *msg = g_mime_message_part_get_message (GMIME_MESSAGE_PART (part));
+    do
+    {
+        GMimeObject *part  = g_mime_part_iter_get_current (iter);
+        if  (GMIME_IS_MULTIPART( part ) )
+            continue;
 
-            g_mime_object_write_to_stream (GMIME_OBJECT (msg), mem);
-        }
-        else if ( GMIME_IS_PART(part))
+        if ( number == 0 )
         {
-            GMimeDataWrapper *content = g_mime_part_get_content_object (GMIME_PART (part));
-
-            g_mime_data_wrapper_write_to_stream (content, mem);
+            result = part;
+            break;
         }
+        number -= 1;
+    }
+    while (g_mime_part_iter_next (iter));
 
-        /**
-         * NOTE: by setting the owner to FALSE, it means unreffing the
-         * memory stream won't free the GByteArray data.
-         */
-        g_mime_stream_mem_set_owner (GMIME_STREAM_MEM (mem), FALSE);
+    g_mime_part_iter_free (iter);
 
-        GByteArray *res =  g_mime_stream_mem_get_byte_array (GMIME_STREAM_MEM (mem));
+    return( result );
+}
 
-        /**
-         * The actual data from the array, and the size of that data.
-         */
-        adata = (char *)res->data;
-        size_t len = (res->len);
 
-        g_object_unref (mem);
+/**
+ * Decode the content of the given attachment, if that hasn't been done.
+ */
+bool CMessage::load_attachment( std::shared_ptr<CAttachment> attachment )
+{
+    if ( attachment->loaded() )
+        return true;
 
-        /**
-         * Save the resulting attachment to the array we return.
-         */
-        if ( adata != NULL )
-        {
-            char tmp[128] = { '\0' };
-            bool is_inline = false;
+    GMimeObject *part = find_part( attachment->part() );
+    if ( part == NULL )
+        return false;
 
-            GMimeContentType *content_type = g_mime_object_get_content_type (part);
-            gchar *type = g_mime_content_type_to_string ( content_type );
+    GMimeStream *mem = g_mime_stream_mem_new();
 
-            if ( aname == NULL || ( strlen( aname ) < 1 ) )
-            {
-                snprintf(tmp, sizeof(tmp)-1, "inline-part-%d %s", count, type );
-                count += 1;
-                aname = tmp;
-                is_inline = true;
-            }
+    if (GMIME_IS_MESSAGE_PART (part))
+    {
+        GMimeMessage *msg = g_mime_message_part_get_message (GMIME_MESSAGE_PART (part));
 
-            /**
-             * We add inline parts only if we've been told to.
-             */
-            if ( ( view_inline == true ) ||
-                 ( view_inline == false && ( is_inline == false ) ) )
-            {
-                std::shared_ptr<CAttachment> foo = std::shared_ptr<CAttachment>(new CAttachment( aname, (void *)adata,(size_t ) len ));
-                m_attachments.push_back(foo);
-            }
-        }
+        g_mime_object_write_to_stream (GMIME_OBJECT (msg), mem);
     }
-    while (g_mime_part_iter_next (iter));
+    else if ( GMIME_IS_PART(part))
+    {
+        GMimeDataWrapper *content = g_mime_part_get_content_object (GMIME_PART (part));
 
-    g_mime_part_iter_free (iter);
+        g_mime_data_wrapper_write_to_stream (content, mem);
+    }
 
-    return( true );
+    /**
+     * NOTE: by setting the owner to FALSE, it means unreffing the
+     * memory stream won't free the GByteArray data, which the
+     * attachment takes ownership of rather than copying.
+     */
+    g_mime_stream_mem_set_owner (GMIME_STREAM_MEM (mem), FALSE);
+    attachment->set_content( g_mime_stream_mem_get_byte_array (GMIME_STREAM_MEM (mem)) );
+
+    g_object_unref (mem);
+
+    return true;
 }
 
 
@@ -1497,21 +2215,151 @@ bool CMessage::save_attachment( int offset, std::string output_path )
     if ( offset < 0 || offset >= (int)m_attachments.size() )
         return false;
 
-    /**
-     * Get the attachment object.
-     */
     std::shared_ptr<CAttachment> cur = m_attachments.at( offset );
 
+    int fd = open( output_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666 );
+    if ( fd < 0 )
+        return false;
+
+    bool ret = write_attachment( cur, fd );
+
+    if ( close( fd ) != 0 )
+        ret = false;
+
+    return( ret );
+}
+
+
+/**
+ * Write all of the given data to the given file.
+ */
+static bool write_all( int fd, const char *data, size_t len )
+{
+    while( len > 0 )
+    {
+        ssize_t n = write( fd, data, len );
+        if ( n < 0 && errno == EINTR )
+            continue;
+        if ( n <= 0 )
+            return false;
+
+        data += n;
+        len  -= n;
+    }
+    return true;
+}
+
+
+/**
+ * Copy the given range of one file to another, within the kernel.
+ *
+ * Returns false if neither copy_file_range() nor sendfile() could be
+ * used, in which case the output may hold part of the range.
+ */
+static bool copy_range( int in, off_t offset, size_t len, int out )
+{
+#ifdef __linux__
+    while( len > 0 )
+    {
+        ssize_t n = copy_file_range( in, &offset, out, NULL, len, 0 );
+
+        /**
+         * Older kernels, and some filesystems, only allow sendfile().
+         */
+        if ( n < 0 && errno != EINTR )
+            n = sendfile( out, in, &offset, len );
+
+        if ( n < 0 && errno == EINTR )
+            continue;
+        if ( n <= 0 )
+            return false;
+
+        len -= n;
+    }
+    return true;
+#else
+    (void)in;
+    (void)offset;
+    (void)len;
+    (void)out;
+    return false;
+#endif
+}
+
+
+/**
+ * Write the content of the given attachment to the given file.
+ *
+ * Unless it has already been decoded the content is streamed from the
+ * message, through any decoder, so the memory used is the same however
+ * large the attachment is.
+ */
+bool CMessage::write_attachment( std::shared_ptr<CAttachment> attachment, int fd )
+{
+    if ( attachment->loaded() )
+        return( write_all( fd, (const char *)attachment->body(), attachment->size() ) );
+
+    GMimeObject *part = find_part( attachment->part() );
+    if ( part == NULL )
+        return false;
+
+    if ( GMIME_IS_PART(part) )
+    {
+        GMimeDataWrapper *content = g_mime_part_get_content_object (GMIME_PART (part));
+        GMimeStream *stream       = g_mime_data_wrapper_get_stream (content);
+
+        /**
+         * If the part isn't encoded, and was parsed from the file itself
+         * rather than the output of the mail_filter, it is a range of
+         * that file which can be copied directly.
+         */
+        GMimeContentEncoding encoding = g_mime_data_wrapper_get_encoding (content);
+        if ( ( encoding == GMIME_CONTENT_ENCODING_DEFAULT ||
+               encoding == GMIME_CONTENT_ENCODING_7BIT ||
+               encoding == GMIME_CONTENT_ENCODING_8BIT ||
+               encoding == GMIME_CONTENT_ENCODING_BINARY ) &&
+             ( stream->super_stream != NULL ) &&
+             GMIME_IS_STREAM_FS( stream->super_stream ) &&
+             ( stream->bound_end > stream->bound_start ) )
+        {
+            int in = GMIME_STREAM_FS( stream->super_stream )->fd;
+
+            if ( copy_range( in, stream->bound_start, stream->bound_end - stream->bound_start, fd ) )
+                return true;
+
+            DEBUG_LOG( "CMessage::write_attachment - falling back from copying the range" );
+            if ( ( ftruncate( fd, 0 ) != 0 ) || ( lseek( fd, 0, SEEK_SET ) != 0 ) )
+                return false;
+        }
+    }
+
     /**
-     * Write out the data.
-     *
-     * TODO: Does this cope with partial writes?  I think it does.
+     * Otherwise let GMime decode the part as it writes it.
      */
-    std::ofstream out(output_path, std::ios::out | std::ios::binary );
-    out.write( (char *)cur->body(), cur->size() );
-    out.close();
+    GMimeStream *out = g_mime_stream_fs_new (fd);
+    g_mime_stream_fs_set_owner (GMIME_STREAM_FS (out), FALSE);
 
-    return( true );
+    ssize_t written = -1;
+
+    if (GMIME_IS_MESSAGE_PART (part))
+    {
+        GMimeMessage *msg = g_mime_message_part_get_message (GMIME_MESSAGE_PART (part));
+
+        written = g_mime_object_write_to_stream (GMIME_OBJECT (msg), out);
+    }
+    else if ( GMIME_IS_PART(part))
+    {
+        GMimeDataWrapper *content = g_mime_part_get_content_object (GMIME_PART (part));
+
+        written = g_mime_data_wrapper_write_to_stream (content, out);
+    }
+
+    if ( g_mime_stream_flush (out) != 0 )
+        written = -1;
+
+    g_object_unref (out);
+
+    return( written >= 0 );
 }
 
 
@@ -1519,6 +2367,23 @@ bool CMessage::save_attachment( int offset, std::string output_path )
  * Return the content of the given attachment.
  */
 std::shared_ptr<CAttachment> CMessage::get_attachment( int offset )
+{
+    std::shared_ptr<CAttachment> cur = describe_attachment( offset );
+
+    /**
+     * Decode the content, if we've not already done so.
+     */
+    if ( !cur || !load_attachment( cur ) )
+        return NULL;
+
+    return( cur );
+}
+
+
+/**
+ * Return the description of the given attachment, without its content.
+ */
+std::shared_ptr<CAttachment> CMessage::describe_attachment( int offset )
 {
     /**
      * Parse attachments if empty.
@@ -1537,11 +2402,7 @@ std::shared_ptr<CAttachment> CMessage::get_attachment( int offset )
     if ( offset < 0 || offset >= (int)m_attachments.size() )
         return NULL;
 
-    /**
-     * Get the attachment object, and return it.
-     */
-    std::shared_ptr<CAttachment> cur = m_attachments.at( offset );
-    return( cur );
+    return( m_attachments.at( offset ) );
 }
 
 /**
@@ -1582,7 +2443,7 @@ void CMessage::open_message( const char *filename )
 
     GMimeParser *parser;
     GMimeStream *stream;
-    m_fd = open( filename, O_RDONLY, 0);
+    m_fd = open( filename, O_RDONLY | O_CLOEXEC, 0);
 
     if ( m_fd < 0 )
     {
@@ -1601,6 +2462,10 @@ void CMessage::open_message( const char *filename )
         DEBUG_LOG( "file->open : " + std::string( filename ) );
     }
 
+    /**
+     * The stream owns the descriptor from here on, and closes it when
+     * the last reference to it, held by the message, is dropped.
+     */
     stream = g_mime_stream_fs_new (m_fd);
 
     parser = g_mime_parser_new_with_stream (stream);
@@ -1615,6 +2480,93 @@ void CMessage::open_message( const char *filename )
     }
 
     g_object_unref (parser);
+
+    if ( m_message == NULL )
+        m_fd = -1;
+}
+
+
+/**
+ * Parse the message from the given text, such as the output of the
+ * mail_filter.
+ */
+void CMessage::open_message_text( const std::string &text )
+{
+    GMimeStream *stream = g_mime_stream_mem_new_with_buffer( text.data(), text.size() );
+    GMimeParser *parser = g_mime_parser_new_with_stream (stream);
+    g_object_unref (stream);
+
+    m_message = g_mime_parser_construct_message (parser);
+
+    if ( m_message == NULL )
+    {
+        DEBUG_LOG( "g_mime_parser_construct_message failed in open_message_text()" );
+    }
+
+    g_object_unref (parser);
+}
+
+
+/**
+ * The key the output of filters run over this message is cached by: its
+ * path, without the flags, which don't change its content, and its size
+ * and mtime, in case it has been replaced.
+ */
+std::string CMessage::filter_key()
+{
+    return( filter_key( path() ) );
+}
+
+
+/**
+ * The key the output of filters run over the given file is cached by.
+ *
+ * Reading a new message moves it from new/ to cur/, so that is left out,
+ * as the header cache does.
+ */
+std::string CMessage::filter_key( const std::string &path )
+{
+    std::string key = path;
+
+    size_t offset = key.find( ":2," );
+    if ( offset != std::string::npos )
+        key = key.substr( 0, offset );
+
+    size_t slash = key.rfind( '/' );
+    if ( ( slash != std::string::npos ) && ( slash >= 4 ) &&
+         ( ( key.compare( slash - 4, 4, "/new" ) == 0 ) ||
+           ( key.compare( slash - 4, 4, "/cur" ) == 0 ) ) )
+        key.erase( slash - 4, 4 );
+
+    struct stat s;
+    if ( stat( path.c_str(), &s ) == 0 )
+    {
+        char buf[64] = { '\0' };
+        snprintf( buf, sizeof(buf)-1, "|%lld|%lld", (long long)s.st_size, (long long)s.st_mtime );
+        key += buf;
+    }
+
+    return( key );
+}
+
+
+/**
+ * The mail_filter which applies to the headers of messages, or the empty
+ * string if they're read from the messages themselves.
+ */
+std::string CMessage::header_filter()
+{
+    std::string *filter = CGlobal::Instance()->get_variable( "mail_filter" );
+    if ( ( filter == NULL ) || filter->empty() )
+        return( "" );
+
+    /**
+     * The filter may be applied to the bodies of messages alone.
+     */
+    if ( ! CLua::Instance()->get_bool( "filter_headers", true ) )
+        return( "" );
+
+    return( *filter );
 }
 
 /**
@@ -1622,18 +2574,23 @@ void CMessage::open_message( const char *filename )
  */
 void CMessage::close_message()
 {
+    if ( m_in_parsed )
+    {
+        parsed_messages.erase( m_parsed );
+        m_in_parsed = false;
+    }
+
+    /**
+     * Dropping the message closes its file too, which mustn't be closed
+     * again: another thread may already have been given the descriptor.
+     */
     if ( m_message != NULL )
     {
         g_object_unref( m_message );
         m_message = NULL;
     }
 
-
-    if ( m_fd > 0 )
-    {
-        DEBUG_LOG( "file->close" );
-        close( m_fd );
-    }
+    m_fd = -1;
 }
 
 
@@ -1874,7 +2831,6 @@ std::vector<std::string> CMessage::body_mime_parts()
      * Cleanup.
      */
     g_mime_part_iter_free (iter);
-    close_message();
 
     return( results );
 }
@@ -1883,7 +2839,7 @@ std::vector<std::string> CMessage::body_mime_parts()
 /**
  * Return the content of the Nth MIME part.
  */
-bool CMessage::get_body_part( int offset, char **data, size_t *length )
+bool CMessage::get_body_part( int offset, std::string &data )
 {
     /**
      * The return value.
@@ -1897,11 +2853,6 @@ bool CMessage::get_body_part( int offset, char **data, size_t *length )
         return ret;
 
 
-    /**
-     * Content length
-     */
-    gint64 len;
-
     /**
      * Create an iterator
      */
@@ -1924,122 +2875,43 @@ bool CMessage::get_body_part( int offset, char **data, size_t *length )
         {
             if ( count == offset )
             {
-
                 /**
                  * Get the content-type
                  */
                 GMimeContentType *content_type = g_mime_object_get_content_type (part);
 
                 /**
-                 * If the content-type is NULL then text/plain is implied.
+                 * Get a stream of the decoded content.
                  */
-                if ( ( content_type == NULL ) ||
-                     ( g_mime_content_type_is_type (content_type, "text", "plain") ) )
-                {
+                GMimeDataWrapper *c = g_mime_part_get_content_object( GMIME_PART(part) );
+                GMimeStream *stream = decoded_stream( c );
 
-                    /**
-                     * We'll use iconv to convert the content to UTF-8 if that is
-                     * not already the correct set.
-                     */
-                    const char *charset;
-                    char *converted;
-
-                    /**
-                     * Get the content, and setup a memory-stream to read it.
-                     */
-                    GMimeDataWrapper *c    = g_mime_part_get_content_object( GMIME_PART(part) );
-                    GMimeStream *memstream = g_mime_stream_mem_new();
-
-                    /**
-                     * Get the size + data.
-                     */
-                    len       = g_mime_data_wrapper_write_to_stream( c, memstream );
-                    guint8 *b = g_mime_stream_mem_get_byte_array((GMimeStreamMem *)memstream)->data;
-
-                    /**
-                     * If we have a character set, and it isn't UTF-8 ...
-                     */
-                    if ( (charset = g_mime_content_type_get_parameter(content_type, "charset")) != NULL &&
-                         (strcasecmp(charset, "utf-8") != 0))
-                    {
-
-                        /**
-                         * Convert it.
-                         */
-                        iconv_t cv;
-
-                        cv = g_mime_iconv_open ("UTF-8", charset);
-                        converted = g_mime_iconv_strndup(cv, (const char *) b, len );
-                        if (converted != NULL)
-                        {
-                            /**
-                             * If that succeeded update our return value with it.
-                             */
-                            size_t conv_len = strlen(converted);
-                            *data = (char*)malloc( conv_len + 1 );
-                            memcpy( *data, converted, conv_len + 1 );
-                            *length = (size_t)conv_len;
-                            ret = true;
-                            g_free(converted);
-                        }
-                        else
-                        {
-                            /**
-                             * The conversion failed; but if we have data return
-                             * it regardless.
-                             */
-                            if ( b != NULL )
-                            {
-                                *data = (char*)malloc( len + 1 );
-                                memcpy( *data, b, len );
-                                *length = (size_t)len;
-                                ret = true;
-                            }
-                        }
-                        g_mime_iconv_close(cv);
-                    }
-                    else
-                    {
-                        /**
-                         * No character set found, or it is already UTF-8.
-                         *
-                         * Save the result.
-                         */
-                        if ( b != NULL )
-                        {
-                            *data = (char*)malloc( len + 1 );
-                            memcpy( *data, b, len );
-                            *length = (size_t)len;
-                            ret = true;
-                        }
-                    }
-                    g_mime_stream_close(memstream);
-                    g_object_unref(memstream);
-                }
-                else
+                /**
+                 * If the content-type is NULL then text/plain is implied,
+                 * and text is converted to UTF-8 if it isn't already.  If
+                 * that fails we return the data regardless.
+                 *
+                 * Anything else is returned as-is.
+                 */
+                const char *charset = NULL;
+                if ( content_type != NULL )
+                    charset = g_mime_content_type_get_parameter(content_type, "charset");
+
+                bool text = ( content_type == NULL ) ||
+                    g_mime_content_type_is_type (content_type, "text", "plain");
+
+                data.clear();
+                if ( stream != NULL )
                 {
-                    /**
-                     * Here the content is not text/plain, return it as is
-                     *
-                     * Get the content, and setup a memory-stream to read it.
-                     */
-                    GMimeDataWrapper *c    = g_mime_part_get_content_object( GMIME_PART(part) );
-                    GMimeStream *memstream = g_mime_stream_mem_new();
-
-                    /**
-                     * Get the size + data.
-                     */
-                    len       = g_mime_data_wrapper_write_to_stream( c, memstream );
-                    guint8 *b = g_mime_stream_mem_get_byte_array((GMimeStreamMem *)memstream)->data;
-
-                    *data = (char*)malloc( len + 1 );
-                    memcpy( *data, b, len );
-                    *length = (size_t)len;
-                    ret = true;
-
-                    g_mime_stream_close(memstream);
-                    g_object_unref(memstream);
+                    if ( text )
+                        CCharset::Instance()->to_utf8( charset, stream, data );
+                    else
+                        read_stream( stream, data );
+
+                    g_object_unref(stream);
                 }
+
+                ret = true;
             }
 
             count += 1;
@@ -2051,77 +2923,6 @@ bool CMessage::get_body_part( int offset, char **data, size_t *length )
      * Cleanup.
      */
     g_mime_part_iter_free (iter);
-    close_message();
 
     return( ret );
 }
-
-
-/**
- * Convert the given object to plain-text, decoding as appropriate.
- */
-UTFString CMessage::mime_part_to_text( GMimeObject *obj )
-{
-    /**
-     * This shouldn't happen.
-     */
-    if ( obj == NULL )
-    {
-        DEBUG_LOG( "NULL message passed to mime_part_to_text()" );
-        return "";
-    }
-
-    GMimeContentType *content_type = g_mime_object_get_content_type (obj);
-
-    UTFString result;
-    const char *charset;
-    gint64 len;
-
-    /**
-     * Get the content, and create a new stream.
-     */
-    GMimeDataWrapper *c = g_mime_part_get_content_object( GMIME_PART(obj) );
-    GMimeStream *memstream = g_mime_stream_mem_new();
-
-    /**
-     * Write the content to the memory-stream.
-     */
-    len = g_mime_data_wrapper_write_to_stream( c, memstream );
-    guint8 *b = g_mime_stream_mem_get_byte_array((GMimeStreamMem *)memstream)->data;
-
-    /**
-     * If there is a content-type, and it isn't UTF-8 ...
-     */
-    if ( (charset =  g_mime_content_type_get_parameter(content_type, "charset")) != NULL &&  (strcasecmp(charset, "utf-8") != 0))
-    {
-        /**
-         * We'll convert it.
-         */
-        iconv_t cv;
-
-        cv = g_mime_iconv_open ("UTF-8", charset);
-        char *converted = g_mime_iconv_strndup(cv, (const char *) b, len );
-        if (converted != NULL)
-        {
-            result = (const char*)converted;
-            g_free(converted);
-        }
-        else
-        {
-            if ( b != NULL )
-                result = std::string((const char *)b, len);
-        }
-        g_mime_iconv_close(cv);
-    }
-    else
-    {
-        /**
-         * No content type, or content-type is already correct.
-         */
-        if ( b != NULL )
-            result = std::string((const char *)b, len);
-    }
-    g_mime_stream_close(memstream);
-    g_object_unref(memstream);
-    return( result );
-}
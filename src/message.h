@@ -23,7 +23,9 @@
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <gmime/gmime.h>
+#include <list>
 #include <unordered_map>
+#include <unordered_set>
 #include <memory>
 
 #include "utfstring.h"
@@ -100,11 +102,53 @@ public:
      */
     std::string get_flags();
 
+    /**
+     * Retrieve the current flags for this message, as a mask of the
+     * bits returned by flag_mask().
+     */
+    uint64_t flags();
+
+    /**
+     * Convert the given flags to a mask.  Each letter has its own bit,
+     * anything else is ignored.
+     */
+    static uint64_t flag_mask( const std::string &flags );
+
+    /**
+     * Convert the given mask to a string of flags, in sorted order.
+     */
+    static std::string flag_string( uint64_t mask );
+
+    /**
+     * Count the messages which have all of the flags in the given mask.
+     */
+    static size_t count_flags( const std::vector<std::shared_ptr<CMessage> > &messages, uint64_t mask );
+
+    /**
+     * Count the messages which are new.
+     */
+    static size_t count_new( const std::vector<std::shared_ptr<CMessage> > &messages );
+
     /**
      * Set the flags for this message.
      */
     void set_flags( std::string new_flags );
 
+    /**
+     * Add, and remove, the given flags with a single rename.
+     *
+     * Removing "N" from a message beneath new/ moves it to cur/.
+     * Returns false if the message couldn't be renamed.
+     */
+    bool update_flags( const std::string &add, const std::string &remove );
+
+    /**
+     * Add, and remove, the given flags from each of the given messages,
+     * returning the number which were updated.
+     */
+    static size_t update_flags( const std::vector<std::shared_ptr<CMessage> > &messages,
+                                const std::string &add, const std::string &remove );
+
     /**
      * Add a flag to a message.
      */
@@ -170,8 +214,82 @@ public:
 
     /**
      * Retrieve all headers, and their values, from the message.
+     *
+     * Only the headers used for display, sorting, and limiting are
+     * usually held, so the first call reads the message again.  Use
+     * header() for those, which never needs every header.
+     */
+    const std::unordered_map<std::string, UTFString> &headers();
+
+    /**
+     * Have the headers of this message been read, including any which
+     * the `index_limit` refers to?
+     */
+    bool has_headers();
+
+    /**
+     * The names of the headers which are kept for each message: the
+     * summary headers, and any others which the `index_limit` refers to.
+     */
+    static const std::unordered_set<std::string> &kept_headers();
+
+    /**
+     * Populate the headers from the persistent cache, if they are present.
      */
-    std::unordered_map<std::string, UTFString> headers();
+    bool load_cached_headers();
+
+    /**
+     * Set the headers of this message, as parsed elsewhere.
+     *
+     * The size and mtime are those of the file which was parsed.
+     */
+    void set_headers( const std::unordered_map<std::string, UTFString> &headers,
+                      off_t size, time_t mtime );
+
+    /**
+     * Mark the headers as being parsed in the background.
+     */
+    void set_headers_pending( bool pending );
+
+    /**
+     * Can the headers be read without parsing the message?
+     *
+     * This is false only while the headers are being parsed in the
+     * background, and lets us avoid blocking when drawing.
+     */
+    bool headers_available();
+
+    /**
+     * Read and decode the header-block of the given file, without parsing
+     * the body.  If names is given only those headers are decoded.
+     * This is safe to call from any thread.
+     */
+    static bool parse_headers( std::string path,
+                               std::unordered_map<std::string, UTFString> &headers,
+                               off_t &size, time_t &mtime,
+                               const std::unordered_set<std::string> *names = NULL );
+
+    /**
+     * The mail_filter which applies to the headers of messages, if any.
+     */
+    static std::string header_filter();
+
+    /**
+     * The key the output of filters run over the given file is cached by.
+     */
+    static std::string filter_key( const std::string &path );
+
+    /**
+     * Parse the message read from the given stream, and append the text
+     * of its body to the output, as get_body() would.  This is safe to
+     * call from any thread.
+     */
+    static bool parse_body( GMimeStream *stream, std::string &text );
+
+    /**
+     * The approximate number of bytes of memory used by this message.
+     */
+    size_t memory_usage();
 
     /**
      * Get the date of the message.
@@ -183,6 +301,28 @@ public:
      */
     std::vector<UTFString> body();
 
+    /**
+     * Get the body of the message, as a vector of lines, without
+     * waiting for the display_filter if wait is false.
+     *
+     * Returns false if the display_filter is still running.
+     */
+    bool body( std::vector<UTFString> &result, bool wait );
+
+    /**
+     * Can the message be parsed without waiting for the mail_filter?
+     *
+     * If not the filter is started in the background, and CFilter::publish()
+     * will return true once it is complete.
+     */
+    bool parse_ready();
+
+    /**
+     * Get the text/plain part of the message, via GMime, without any
+     * display_filter applied.
+     */
+    UTFString get_body();
+
     /**
      * Get the names of attachments to this message.
      */
@@ -198,6 +338,12 @@ public:
      */
     std::shared_ptr<CAttachment> get_attachment( int offset );
 
+    /**
+     * Get the description of the attachment, its name, type, and size,
+     * without decoding its body.
+     */
+    std::shared_ptr<CAttachment> describe_attachment( int offset );
+
     /**
      * This is solely used for sorting by message-headers
      */
@@ -223,19 +369,19 @@ public:
     /**
      * Return the content of the Nth MIME-part.
      */
-    bool get_body_part( int offset, char **data, size_t *len );
+    bool get_body_part( int offset, std::string &data );
 
 private:
 
     /**
-     * The GMime message object.
+     * The headers whose values we hold for every message.
      */
-    GMimeMessage *m_message;
+    enum TSummary { SUMMARY_DATE, SUMMARY_FROM, SUMMARY_TO, SUMMARY_CC, SUMMARY_SUBJECT, SUMMARY_HEADERS };
 
     /**
-     * Helper for decoding a body.
+     * The GMime message object.
      */
-    UTFString mime_part_to_text( GMimeObject *obj );
+    GMimeMessage *m_message;
 
     /**
      * Is the message parsed correctly ?
@@ -243,7 +389,8 @@ private:
     bool is_valid();
 
     /**
-     * The file-descriptor for this message.
+     * The file-descriptor for this message, which is owned, and closed,
+     * by the GMime stream it was parsed from.
      */
     int m_fd;
 
@@ -252,11 +399,33 @@ private:
      */
     void open_message( const char *filename );
 
+    /**
+     * Parse the message from the given text, with gmime.
+     */
+    void open_message_text( const std::string &text );
+
+    /**
+     * The key the output of filters is cached by.
+     */
+    std::string filter_key();
+
     /**
      * Cleanup the message with gmime.
      */
     void close_message();
 
+    /**
+     * Record that we hold a parsed MIME-tree, which is kept until too
+     * many other messages have been parsed more recently.
+     */
+    void remember_parsed();
+
+    /**
+     * Our position in the list of parsed messages, if we're in it.
+     */
+    std::list<CMessage *>::iterator m_parsed;
+    bool m_in_parsed;
+
     /**
      * Have we invoked the on_read_message hook?
      */
@@ -268,11 +437,61 @@ private:
     time_t m_time_cache;
 
     /**
-     * Cached map of header names + values.
-     *
-     * e.g. Date: foo, Subject: bar, To: xxx, From: foo.
+     * The flags of the message, parsed from the path whenever it is set.
+     */
+    uint64_t m_flags;
+
+    /**
+     * Read the headers of the message, from the file, or the output of
+     * the mail_filter.  If summary is set only the kept headers are
+     * wanted, so they may come from the cache instead.
+     */
+    bool read_headers( std::unordered_map<std::string, UTFString> &values, bool summary );
+
+    /**
+     * Keep the summary headers, and those the `index_limit` refers to,
+     * from the given set, and update the persistent cache with them.
      */
-    std::unordered_map<std::string, UTFString> m_header_values;
+    void set_summary( const std::unordered_map<std::string, UTFString> &values );
+    void store_summary( off_t size, time_t mtime );
+
+    /**
+     * The values of the summary headers, e.g. Date, From, & Subject,
+     * shared with every other message having the same value.  NULL
+     * if the header is absent.
+     */
+    const std::string *m_summary[SUMMARY_HEADERS];
+
+    /**
+     * Have the summary headers been read?
+     */
+    bool m_have_headers;
+
+    /**
+     * The names, and values, of the other headers the `index_limit`
+     * referred to when they were read, pooled as the summary headers
+     * are.  The value is NULL if the header is absent.
+     */
+    std::vector<std::pair<const std::string *, const std::string *> > m_limit_headers;
+
+    /**
+     * Every header, read only when something other than the summary
+     * headers is wanted.
+     */
+    std::unique_ptr<std::unordered_map<std::string, UTFString> > m_all_headers;
+
+    /**
+     * Are the headers being parsed in the background?
+     */
+    bool m_headers_pending;
+
+    /**
+     * The result of the most recent call to format(), and the format
+     * and flags it was made with.
+     */
+    UTFString m_formatted;
+    unsigned int m_format_id;
+    uint64_t m_format_flags;
 
     /**
      * Parse the message, if that hasn't been done.
@@ -288,14 +507,36 @@ private:
     bool parse_attachments();
 
     /**
-     * Get the text/plain part of the message, via GMime.
+     * Find the Nth MIME-part which isn't a multipart container.
      */
-    UTFString get_body();
+    GMimeObject *find_part( int number );
+
+    /**
+     * Decode the content of the given attachment, if that hasn't been done.
+     */
+    bool load_attachment( std::shared_ptr<CAttachment> attachment );
+
+    /**
+     * Write the content of the given attachment to the given file.
+     */
+    bool write_attachment( std::shared_ptr<CAttachment> attachment, int fd );
+
+    /**
+     * The file we represent: the directory holding it, shared with every
+     * other message there, and its name.
+     */
+    const std::string *m_folder;
+    std::string m_file;
+
+    /**
+     * Set our path, and the flags it holds.
+     */
+    void set_path( const std::string &path );
 
     /**
-     * The file we represent.
+     * Rename the message to the given path, if that differs from ours.
      */
-    std::string m_path;
+    bool rename_to( const std::string &dst_path );
 
 
     /**
@@ -0,0 +1,268 @@
+/**
+ * prefetch.cc - Parse message-headers in parallel.
+ *
+ * This file is part of lumail: http://lumail.org/
+ *
+ * Copyright (c) 2013-2014 by Steve Kemp.  All rights reserved.
+ *
+ **
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 dated June, 1991, or (at your
+ * option) any later version.
+ *
+ * On Debian GNU/Linux systems, the complete text of version 2 of the GNU
+ * General Public License can be found in `/usr/share/common-licenses/GPL-2'
+ */
+
+#include <algorithm>
+#include <stdio.h>
+
+#include "debug.h"
+#include "message.h"
+#include "prefetch.h"
+
+
+/**
+ * Instance-handle.
+ */
+CHeaderPrefetch *CHeaderPrefetch::pinstance = NULL;
+
+
+/**
+ * Get access to our singleton-object.
+ */
+CHeaderPrefetch *CHeaderPrefetch::Instance()
+{
+    if (!pinstance)
+        pinstance = new CHeaderPrefetch;
+
+    return pinstance;
+}
+
+
+/**
+ * Constructor - This is private as this class is a singleton.
+ */
+CHeaderPrefetch::CHeaderPrefetch()
+{
+    m_active = 0;
+}
+
+
+/**
+ * Start parsing the headers of the given messages.
+ */
+void CHeaderPrefetch::submit( const CMessageList &messages )
+{
+    /**
+     * Abandon anything still running for the previous list.
+     */
+    cancel();
+
+    /**
+     * If the mail_filter applies to the headers then they must come from
+     * its output, so leave them to be parsed on demand.
+     */
+    if ( ! CMessage::header_filter().empty() )
+        return;
+
+    /**
+     * Find the messages which still need parsing.
+     */
+    std::shared_ptr<CPrefetchBatch> batch( new CPrefetchBatch() );
+    batch->next      = 0;
+    batch->done      = 0;
+    batch->cancelled = false;
+
+    CMessageList todo;
+    for (std::shared_ptr<CMessage> message : messages)
+    {
+        if ( message->has_headers() || message->load_cached_headers() )
+            continue;
+
+        todo.push_back( message );
+        batch->paths.push_back( message->path() );
+        message->set_headers_pending( true );
+    }
+
+    if ( todo.empty() )
+        return;
+
+    batch->names = CMessage::kept_headers();
+
+#ifdef LUMAIL_DEBUG
+    char dm[128] = { '\0' };
+    snprintf( dm, sizeof(dm)-1, "CHeaderPrefetch::submit - %zu messages", todo.size() );
+    DEBUG_LOG( dm );
+#endif
+
+    /**
+     * Start the workers on first use.
+     */
+    if ( m_threads.empty() )
+    {
+        size_t count = std::max( std::thread::hardware_concurrency(), 1U );
+        for( size_t i = 0; i < count; i++ )
+            m_threads.push_back( std::thread( &CHeaderPrefetch::run, this ) );
+    }
+
+    {
+        std::lock_guard<std::mutex> lock( m_lock );
+        m_batch    = batch;
+        m_messages = todo;
+    }
+    m_work.notify_all();
+}
+
+
+/**
+ * Copy any completed results into their messages.
+ */
+bool CHeaderPrefetch::publish()
+{
+    std::vector<CPrefetchResult> results;
+    bool complete = false;
+
+    {
+        std::lock_guard<std::mutex> lock( m_lock );
+        results.swap( m_results );
+
+        if ( m_batch && ( m_batch->done == m_batch->paths.size() ) )
+        {
+            complete = true;
+            m_batch.reset();
+        }
+    }
+
+    for( CPrefetchResult &result : results )
+    {
+        std::shared_ptr<CMessage> message = m_messages[result.index];
+
+        /**
+         * The message may have been parsed on demand in the meantime.
+         */
+        if ( !message->has_headers() )
+            message->set_headers( result.headers, result.size, result.mtime );
+
+        message->set_headers_pending( false );
+    }
+
+    if ( complete )
+    {
+        /**
+         * Anything which failed to parse will be retried on demand.
+         */
+        for (std::shared_ptr<CMessage> message : m_messages)
+            message->set_headers_pending( false );
+
+        m_messages.clear();
+    }
+
+    return( !results.empty() );
+}
+
+
+/**
+ * Wait for the current batch to complete, and publish the results.
+ */
+void CHeaderPrefetch::wait()
+{
+    {
+        std::unique_lock<std::mutex> lock( m_lock );
+        while( m_batch && ( m_batch->done < m_batch->paths.size() ) )
+            m_results_ready.wait( lock );
+    }
+    publish();
+}
+
+
+/**
+ * Abandon the current batch.
+ */
+void CHeaderPrefetch::cancel()
+{
+    {
+        std::unique_lock<std::mutex> lock( m_lock );
+
+        if ( m_batch )
+        {
+            m_batch->cancelled = true;
+            m_batch->next      = m_batch->paths.size();
+            m_batch.reset();
+        }
+        m_results.clear();
+
+        /**
+         * Wait for any in-progress parses to finish, so nothing is
+         * using GMime when we return.
+         */
+        while( m_active > 0 )
+            m_results_ready.wait( lock );
+    }
+
+    for (std::shared_ptr<CMessage> message : m_messages)
+        message->set_headers_pending( false );
+
+    m_messages.clear();
+}
+
+
+/**
+ * Is a batch in progress?
+ */
+bool CHeaderPrefetch::busy()
+{
+    std::lock_guard<std::mutex> lock( m_lock );
+    return( m_batch != NULL );
+}
+
+
+/**
+ * The body of each worker thread.
+ */
+void CHeaderPrefetch::run()
+{
+    while( true )
+    {
+        std::shared_ptr<CPrefetchBatch> batch;
+        size_t index = 0;
+
+        /**
+         * Wait for a path to parse.
+         */
+        {
+            std::unique_lock<std::mutex> lock( m_lock );
+            while( !m_batch || ( m_batch->next >= m_batch->paths.size() ) )
+                m_work.wait( lock );
+
+            batch = m_batch;
+            index = batch->next++;
+            m_active += 1;
+        }
+
+        CPrefetchResult result;
+        result.index = index;
+
+        bool parsed = CMessage::parse_headers( batch->paths[index],
+                                               result.headers,
+                                               result.size,
+                                               result.mtime,
+                                               &batch->names );
+
+        /**
+         * Hand the result back, unless the batch was replaced while we
+         * were working on it.
+         */
+        {
+            std::lock_guard<std::mutex> lock( m_lock );
+            m_active -= 1;
+            batch->done++;
+
+            if ( parsed && !batch->cancelled )
+                m_results.push_back( result );
+        }
+        m_results_ready.notify_all();
+    }
+}
@@ -0,0 +1,199 @@
+/**
+ * prefetch.h - Parse message-headers in parallel.
+ *
+ * This file is part of lumail: http://lumail.org/
+ *
+ * Copyright (c) 2013-2014 by Steve Kemp.  All rights reserved.
+ *
+ **
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 dated June, 1991, or (at your
+ * option) any later version.
+ *
+ * On Debian GNU/Linux systems, the complete text of version 2 of the GNU
+ * General Public License can be found in `/usr/share/common-licenses/GPL-2'
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "maildir.h"
+#include "utfstring.h"
+
+
+/**
+ * The headers parsed from a single message, by a worker.
+ */
+struct CPrefetchResult
+{
+    /**
+     * The offset of the message in the batch.
+     */
+    size_t index;
+
+    /**
+     * The size & mtime of the file which was parsed.
+     */
+    off_t size;
+    time_t mtime;
+
+    /**
+     * The decoded headers.
+     */
+    std::unordered_map<std::string, UTFString> headers;
+};
+
+
+/**
+ * A set of messages to be parsed.
+ *
+ * The workers only ever see the paths, never the CMessage objects,
+ * which are owned, and only touched, by the main thread.
+ */
+struct CPrefetchBatch
+{
+    /**
+     * The paths to parse.
+     */
+    std::vector<std::string> paths;
+
+    /**
+     * The headers to keep, copied from CMessage::kept_headers().
+     */
+    std::unordered_set<std::string> names;
+
+    /**
+     * The next path to be claimed by a worker.
+     */
+    std::atomic<size_t> next;
+
+    /**
+     * The number of paths which have been completed.
+     */
+    std::atomic<size_t> done;
+
+    /**
+     * Set if the batch was replaced before it completed.
+     */
+    std::atomic<bool> cancelled;
+};
+
+
+/**
+ * Singleton class which parses the headers of newly-loaded messages
+ * with a pool of worker threads.
+ *
+ * The main thread submits a list of messages, and later publishes the
+ * results into each CMessage, either as they arrive (from the event
+ * loop), or all at once when it needs them (e.g. before sorting).
+ *
+ * Any message whose headers are requested before the pool reaches it is
+ * simply parsed on the main thread, as it always was.
+ */
+class CHeaderPrefetch
+{
+
+public:
+
+    /**
+     * Get access to the singleton instance.
+     */
+    static CHeaderPrefetch *Instance();
+
+    /**
+     * Start parsing the headers of the given messages, replacing any
+     * previous batch.
+     */
+    void submit( const CMessageList &messages );
+
+    /**
+     * Copy any completed results into their messages.
+     *
+     * Returns true if anything was published.
+     */
+    bool publish();
+
+    /**
+     * Wait for the current batch to complete, and publish the results.
+     */
+    void wait();
+
+    /**
+     * Abandon the current batch, waiting for the workers to become idle.
+     */
+    void cancel();
+
+    /**
+     * Is a batch in progress?
+     */
+    bool busy();
+
+protected:
+
+    /**
+     * Protected functions to allow our singleton implementation.
+     */
+    CHeaderPrefetch();
+    CHeaderPrefetch(const CHeaderPrefetch &);
+    CHeaderPrefetch & operator=(const CHeaderPrefetch &);
+
+private:
+
+    /**
+     * The body of each worker thread.
+     */
+    void run();
+
+    /**
+     * The single instance of this class.
+     */
+    static CHeaderPrefetch *pinstance;
+
+    /**
+     * The worker threads, started on first use.
+     */
+    std::vector<std::thread> m_threads;
+
+    /**
+     * Protects the batch-pointer, the results, and the busy-count.
+     */
+    std::mutex m_lock;
+
+    /**
+     * Signalled when a batch is submitted, and when results arrive.
+     */
+    std::condition_variable m_work;
+    std::condition_variable m_results_ready;
+
+    /**
+     * The current batch.
+     */
+    std::shared_ptr<CPrefetchBatch> m_batch;
+
+    /**
+     * The messages in the current batch, in the same order as its paths.
+     */
+    CMessageList m_messages;
+
+    /**
+     * Completed results, waiting to be published.
+     */
+    std::vector<CPrefetchResult> m_results;
+
+    /**
+     * The number of workers currently parsing a message.
+     */
+    int m_active;
+
+};
@@ -0,0 +1,711 @@
+/**
+ * query.cc - Compiled queries, for limiting the message index.
+ *
+ * This file is part of lumail: http://lumail.org/
+ *
+ * Copyright (c) 2013-2014 by Steve Kemp.  All rights reserved.
+ *
+ **
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 dated June, 1991, or (at your
+ * option) any later version.
+ *
+ * On Debian GNU/Linux systems, the complete text of version 2 of the GNU
+ * General Public License can be found in `/usr/share/common-licenses/GPL-2'
+ */
+
+#include <algorithm>
+#include <ctype.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "debug.h"
+#include "message.h"
+#include "query.h"
+#include "search_index.h"
+
+
+/**
+ * The relative costs of each test: the flags are in the filename, the
+ * size needs a stat(), a search is a lookup in the full-text index, and
+ * anything else needs the headers.
+ */
+#define COST_FLAG    1
+#define COST_SIZE    2
+#define COST_SEARCH  2
+#define COST_HEADER  3
+
+
+/**
+ * Parse a size, with an optional k/m/g suffix, e.g. "10k".
+ */
+static bool parse_size( const std::string &value, long long &lo, long long &hi )
+{
+    char *end = NULL;
+    long long size = strtoll( value.c_str(), &end, 10 );
+
+    if ( ( end == value.c_str() ) || ( size < 0 ) )
+        return false;
+
+    char unit = tolower( *end );
+    if ( unit == 'k' )
+        size *= 1024LL;
+    else if ( unit == 'm' )
+        size *= 1024LL * 1024;
+    else if ( unit == 'g' )
+        size *= 1024LL * 1024 * 1024;
+
+    if ( unit == 'k' || unit == 'm' || unit == 'g' || unit == 'b' )
+        end++;
+
+    if ( *end != '\0' )
+        return false;
+
+    lo = hi = size;
+    return true;
+}
+
+
+/**
+ * Parse a date, e.g. "2014-01-31", into the first and last second of
+ * that day, in local time.
+ */
+static bool parse_date( const std::string &value, long long &lo, long long &hi )
+{
+    int year, month, day;
+    char tail;
+
+    if ( sscanf( value.c_str(), "%d-%d-%d%c", &year, &month, &day, &tail ) != 3 )
+        return false;
+
+    struct tm tm;
+    memset( &tm, 0, sizeof(tm) );
+    tm.tm_year  = year - 1900;
+    tm.tm_mon   = month - 1;
+    tm.tm_mday  = day;
+    tm.tm_isdst = -1;
+    lo = mktime( &tm );
+
+    memset( &tm, 0, sizeof(tm) );
+    tm.tm_year  = year - 1900;
+    tm.tm_mon   = month - 1;
+    tm.tm_mday  = day + 1;
+    tm.tm_isdst = -1;
+    hi = mktime( &tm ) - 1;
+
+    return( ( lo != -1 ) && ( hi >= lo ) );
+}
+
+
+/**
+ * Parse a range: "A..B", "A..", "..B", ">A", ">=A", "<A", "<=A", or "A".
+ */
+static bool parse_range( const std::string &value,
+                         bool (*parse)( const std::string &, long long &, long long & ),
+                         long long &min, long long &max )
+{
+    long long lo, hi;
+
+    min = LLONG_MIN;
+    max = LLONG_MAX;
+
+    size_t dots = value.find( ".." );
+    if ( dots != std::string::npos )
+    {
+        std::string from = value.substr( 0, dots );
+        std::string to   = value.substr( dots + 2 );
+
+        if ( from.empty() && to.empty() )
+            return false;
+        if ( !from.empty() )
+        {
+            if ( !parse( from, lo, hi ) )
+                return false;
+            min = lo;
+        }
+        if ( !to.empty() )
+        {
+            if ( !parse( to, lo, hi ) )
+                return false;
+            max = hi;
+        }
+        return true;
+    }
+
+    if ( value.compare( 0, 2, ">=" ) == 0 )
+    {
+        if ( !parse( value.substr( 2 ), lo, hi ) )
+            return false;
+        min = lo;
+    }
+    else if ( value.compare( 0, 2, "<=" ) == 0 )
+    {
+        if ( !parse( value.substr( 2 ), lo, hi ) )
+            return false;
+        max = hi;
+    }
+    else if ( value[0] == '>' )
+    {
+        if ( !parse( value.substr( 1 ), lo, hi ) )
+            return false;
+        min = hi + 1;
+    }
+    else if ( value[0] == '<' )
+    {
+        if ( !parse( value.substr( 1 ), lo, hi ) )
+            return false;
+        max = lo - 1;
+    }
+    else
+    {
+        if ( !parse( value, min, max ) )
+            return false;
+    }
+    return true;
+}
+
+
+/**
+ * Order nodes by the cost of evaluating them.
+ */
+static bool cheaper( std::shared_ptr<CQueryNode> a, std::shared_ptr<CQueryNode> b )
+{
+    return( a->cost < b->cost );
+}
+
+
+/**
+ * Create a node combining the given children.
+ */
+static std::shared_ptr<CQueryNode> combine( TQueryOp op, std::vector<std::shared_ptr<CQueryNode> > &children )
+{
+    if ( children.size() == 1 )
+        return( children[0] );
+
+    std::shared_ptr<CQueryNode> node( new CQueryNode() );
+    node->op       = op;
+    node->children = children;
+
+    /**
+     * Evaluate the cheap tests first, so that they short-circuit the
+     * expensive ones.
+     */
+    std::stable_sort( node->children.begin(), node->children.end(), cheaper );
+
+    node->cost = 0;
+    for (std::shared_ptr<CQueryNode> child : node->children)
+        node->cost = std::max( node->cost, child->cost );
+
+    return( node );
+}
+
+
+/**
+ * Evaluate a node against the given message.
+ */
+static bool evaluate( const CQueryNode *node, CMessage *message )
+{
+    switch( node->op )
+    {
+    case QUERY_AND:
+        for (const std::shared_ptr<CQueryNode> &child : node->children)
+        {
+            if ( !evaluate( child.get(), message ) )
+                return false;
+        }
+        return true;
+
+    case QUERY_OR:
+        for (const std::shared_ptr<CQueryNode> &child : node->children)
+        {
+            if ( evaluate( child.get(), message ) )
+                return true;
+        }
+        return false;
+
+    case QUERY_NOT:
+        return( !evaluate( node->children[0].get(), message ) );
+
+    case QUERY_FLAG:
+    {
+        uint64_t mask = (uint64_t) node->min;
+        return( ( message->flags() & mask ) == mask );
+    }
+
+    case QUERY_SIZE:
+    {
+        size_t size = message->size();
+        if ( size == (size_t) -1 )
+            return false;
+        return( ( (long long) size >= node->min ) && ( (long long) size <= node->max ) );
+    }
+
+    case QUERY_DATE:
+    {
+        time_t date = message->get_date_field();
+        if ( date == 0 )
+            return false;
+        return( ( date >= node->min ) && ( date <= node->max ) );
+    }
+
+    case QUERY_SEARCH:
+        return( CSearchIndex::Instance()->matches( message->path(), node->names[0] ) );
+
+    case QUERY_HEADER:
+        for (const std::string &name : node->names)
+        {
+            if ( node->regex->matches( message->header( name ) ) )
+                return true;
+        }
+        return false;
+    }
+    return false;
+}
+
+
+/**
+ * Does evaluating the node require the headers of the messages?
+ */
+static bool uses_headers( const CQueryNode *node )
+{
+    if ( ( node->op == QUERY_DATE ) || ( node->op == QUERY_HEADER ) )
+        return true;
+
+    for (std::shared_ptr<CQueryNode> child : node->children)
+    {
+        if ( uses_headers( child.get() ) )
+            return true;
+    }
+    return false;
+}
+
+
+/**
+ * Does evaluating the node require the search index?
+ */
+static bool uses_search( const CQueryNode *node )
+{
+    if ( node->op == QUERY_SEARCH )
+        return true;
+
+    for (std::shared_ptr<CQueryNode> child : node->children)
+    {
+        if ( uses_search( child.get() ) )
+            return true;
+    }
+    return false;
+}
+
+
+/**
+ * Append the names of the headers tested by the node to the list.
+ */
+static void find_header_names( const CQueryNode *node, std::vector<std::string> &names )
+{
+    if ( node->op == QUERY_HEADER )
+        names.insert( names.end(), node->names.begin(), node->names.end() );
+    else if ( node->op == QUERY_DATE )
+        names.push_back( "date" );
+
+    for (std::shared_ptr<CQueryNode> child : node->children)
+        find_header_names( child.get(), names );
+}
+
+
+/**
+ * Get the compiled form of the given query.
+ */
+std::shared_ptr<CQuery> CQuery::compile( const std::string &text )
+{
+    /**
+     * The same limit is applied to every message in turn, so caching the
+     * last query is sufficient.
+     */
+    static std::string last_text;
+    static std::shared_ptr<CQuery> last;
+
+    if ( last && ( text == last_text ) )
+        return( last );
+
+    last      = std::shared_ptr<CQuery>( new CQuery( text ) );
+    last_text = text;
+
+    return( last );
+}
+
+
+/**
+ * Parse the given text.
+ */
+CQuery::CQuery( const std::string &text )
+{
+    m_offset = 0;
+    m_error  = false;
+
+    tokenize( text );
+
+    if ( !m_tokens.empty() )
+        m_root = parse_or();
+
+    /**
+     * Anything left over is an error, e.g. an unbalanced ")".
+     */
+    if ( m_error || ( m_offset < m_tokens.size() ) )
+    {
+        DEBUG_LOG( "CQuery - failed to parse: " + text );
+        m_root.reset();
+    }
+}
+
+
+/**
+ * Did the query compile?
+ */
+bool CQuery::valid() const
+{
+    return( m_root != NULL );
+}
+
+
+/**
+ * Does the given message match?
+ */
+bool CQuery::matches( CMessage *message ) const
+{
+    if ( !m_root )
+        return false;
+
+    return( evaluate( m_root.get(), message ) );
+}
+
+
+/**
+ * Does evaluating this query require the headers of the messages?
+ */
+bool CQuery::needs_headers() const
+{
+    if ( !m_root )
+        return false;
+
+    return( uses_headers( m_root.get() ) );
+}
+
+
+/**
+ * Does evaluating this query require the search index?
+ */
+bool CQuery::needs_search() const
+{
+    if ( !m_root )
+        return false;
+
+    return( uses_search( m_root.get() ) );
+}
+
+
+/**
+ * Append the names of the headers this query tests to the list.
+ */
+void CQuery::header_names( std::vector<std::string> &names ) const
+{
+    if ( m_root )
+        find_header_names( m_root.get(), names );
+}
+
+
+/**
+ * Split the text into tokens.
+ */
+void CQuery::tokenize( const std::string &text )
+{
+    size_t i = 0;
+
+    while( i < text.size() )
+    {
+        if ( isspace( text[i] ) )
+        {
+            i++;
+            continue;
+        }
+
+        /**
+         * Operators stand alone, at the start of a token.
+         */
+        if ( strchr( "()!&|", text[i] ) != NULL )
+        {
+            m_tokens.push_back( std::string( 1, text[i] ) );
+            m_quoted.push_back( false );
+            i++;
+            continue;
+        }
+
+        /**
+         * Otherwise read a term, up to whitespace or an unbalanced ")".
+         * Parentheses and "|" are allowed within the term, so that it
+         * may contain a regular expression such as subject:(foo|bar).
+         */
+        std::string token;
+        bool quoted = false;
+        int depth = 0;
+
+        while( i < text.size() )
+        {
+            char c = text[i];
+
+            if ( c == '"' )
+            {
+                size_t close = text.find( '"', i + 1 );
+                if ( close == std::string::npos )
+                    close = text.size();
+
+                token += text.substr( i + 1, close - i - 1 );
+                quoted = true;
+                i = close + 1;
+                continue;
+            }
+
+            if ( isspace( c ) )
+                break;
+            if ( c == '(' )
+                depth++;
+            if ( c == ')' )
+            {
+                if ( depth == 0 )
+                    break;
+                depth--;
+            }
+
+            token += c;
+            i++;
+        }
+
+        m_tokens.push_back( token );
+        m_quoted.push_back( quoted );
+    }
+}
+
+
+/**
+ * Consume the next token if it is the given keyword, or operator.
+ */
+bool CQuery::accept( const char *keyword, const char *op )
+{
+    if ( m_offset >= m_tokens.size() || m_quoted[m_offset] )
+        return false;
+
+    const std::string &token = m_tokens[m_offset];
+
+    if ( ( strcasecmp( token.c_str(), keyword ) == 0 ) ||
+         ( ( op != NULL ) && ( token == op ) ) )
+    {
+        m_offset++;
+        return true;
+    }
+    return false;
+}
+
+
+/**
+ * or := and ( ( "or" | "|" ) and )*
+ */
+std::shared_ptr<CQueryNode> CQuery::parse_or()
+{
+    std::vector<std::shared_ptr<CQueryNode> > children;
+
+    do
+    {
+        std::shared_ptr<CQueryNode> node = parse_and();
+        if ( !node )
+            return( node );
+
+        children.push_back( node );
+    }
+    while( accept( "or", "|" ) );
+
+    return( combine( QUERY_OR, children ) );
+}
+
+
+/**
+ * and := unary ( [ "and" | "&" ] unary )*
+ */
+std::shared_ptr<CQueryNode> CQuery::parse_and()
+{
+    std::vector<std::shared_ptr<CQueryNode> > children;
+
+    while( true )
+    {
+        std::shared_ptr<CQueryNode> node = parse_unary();
+        if ( !node )
+            return( node );
+
+        children.push_back( node );
+
+        /**
+         * Stop at the end of the text, group, or at an "or".
+         */
+        if ( m_offset >= m_tokens.size() )
+            break;
+        if ( !m_quoted[m_offset] &&
+             ( ( m_tokens[m_offset] == ")" ) ||
+               ( m_tokens[m_offset] == "|" ) ||
+               ( strcasecmp( m_tokens[m_offset].c_str(), "or" ) == 0 ) ) )
+            break;
+
+        accept( "and", "&" );
+    }
+
+    return( combine( QUERY_AND, children ) );
+}
+
+
+/**
+ * unary := ( "not" | "!" ) unary | "(" or ")" | term
+ */
+std::shared_ptr<CQueryNode> CQuery::parse_unary()
+{
+    std::shared_ptr<CQueryNode> node;
+
+    if ( m_offset >= m_tokens.size() )
+    {
+        m_error = true;
+        return( node );
+    }
+
+    if ( accept( "not", "!" ) )
+    {
+        std::shared_ptr<CQueryNode> child = parse_unary();
+        if ( !child )
+            return( child );
+
+        node = std::shared_ptr<CQueryNode>( new CQueryNode() );
+        node->op   = QUERY_NOT;
+        node->cost = child->cost;
+        node->children.push_back( child );
+        return( node );
+    }
+
+    if ( accept( "(", NULL ) )
+    {
+        node = parse_or();
+        if ( node && !accept( ")", NULL ) )
+        {
+            m_error = true;
+            node.reset();
+        }
+        return( node );
+    }
+
+    if ( !m_quoted[m_offset] &&
+         ( ( m_tokens[m_offset] == ")" ) || ( m_tokens[m_offset] == "&" ) || ( m_tokens[m_offset] == "|" ) ) )
+    {
+        m_error = true;
+        return( node );
+    }
+
+    node = parse_term( m_tokens[m_offset++] );
+    if ( !node )
+        m_error = true;
+
+    return( node );
+}
+
+
+/**
+ * term := field ":" value | regexp
+ */
+std::shared_ptr<CQueryNode> CQuery::parse_term( const std::string &token )
+{
+    std::shared_ptr<CQueryNode> node( new CQueryNode() );
+    node->min = 0;
+    node->max = 0;
+
+    std::string field;
+    std::string value;
+
+    size_t colon = token.find( ':' );
+    if ( colon == std::string::npos )
+    {
+        field = "subject|from";
+        value = token;
+    }
+    else
+    {
+        field = token.substr( 0, colon );
+        value = token.substr( colon + 1 );
+        std::transform( field.begin(), field.end(), field.begin(), tolower );
+    }
+
+    if ( value.empty() || field.empty() )
+    {
+        node.reset();
+        return( node );
+    }
+
+    if ( field == "flag" || field == "flags" )
+    {
+        /**
+         * The case is significant: lower-case flags are keywords.
+         */
+        node->op   = QUERY_FLAG;
+        node->cost = COST_FLAG;
+        node->names.push_back( value );
+        node->min = (long long) CMessage::flag_mask( value );
+    }
+    else if ( field == "size" )
+    {
+        node->op   = QUERY_SIZE;
+        node->cost = COST_SIZE;
+
+        if ( !parse_range( value, parse_size, node->min, node->max ) )
+            node.reset();
+    }
+    else if ( field == "body" )
+    {
+        node->op   = QUERY_SEARCH;
+        node->cost = COST_SEARCH;
+        node->names.push_back( value );
+
+        if ( CSearchIndex::tokenize( value ).empty() )
+            node.reset();
+    }
+    else if ( field == "date" )
+    {
+        node->op   = QUERY_DATE;
+        node->cost = COST_HEADER;
+
+        if ( !parse_range( value, parse_date, node->min, node->max ) )
+            node.reset();
+    }
+    else
+    {
+        /**
+         * Any other field is a header, or several separated by "|",
+         * as with the HEADER: limit.
+         */
+        node->op    = QUERY_HEADER;
+        node->cost  = COST_HEADER;
+        node->regex = CRegexCache::Instance()->get( value );
+
+        size_t start = 0;
+        while( start <= field.size() )
+        {
+            size_t bar = field.find( '|', start );
+            if ( bar == std::string::npos )
+                bar = field.size();
+
+            if ( bar > start )
+                node->names.push_back( field.substr( start, bar - start ) );
+            start = bar + 1;
+        }
+
+        if ( !node->regex->valid() || node->names.empty() )
+            node.reset();
+    }
+
+    return( node );
+}
@@ -0,0 +1,192 @@
+/**
+ * query.h - Compiled queries, for limiting the message index.
+ *
+ * This file is part of lumail: http://lumail.org/
+ *
+ * Copyright (c) 2013-2014 by Steve Kemp.  All rights reserved.
+ *
+ **
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 dated June, 1991, or (at your
+ * option) any later version.
+ *
+ * On Debian GNU/Linux systems, the complete text of version 2 of the GNU
+ * General Public License can be found in `/usr/share/common-licenses/GPL-2'
+ */
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "regex_cache.h"
+
+
+class CMessage;
+
+
+/**
+ * The operations a query node may perform.
+ */
+enum TQueryOp
+{
+    QUERY_AND,
+    QUERY_OR,
+    QUERY_NOT,
+    QUERY_FLAG,
+    QUERY_SIZE,
+    QUERY_DATE,
+    QUERY_HEADER,
+    QUERY_SEARCH
+};
+
+
+/**
+ * A single node of a compiled query.
+ */
+struct CQueryNode
+{
+    /**
+     * The operation.
+     */
+    TQueryOp op;
+
+    /**
+     * The relative cost of evaluating this node, and its children.
+     */
+    int cost;
+
+    /**
+     * The operands of AND, OR, and NOT, cheapest first.
+     */
+    std::vector<std::shared_ptr<CQueryNode> > children;
+
+    /**
+     * The flags which must be present, the header(s) to test, or the
+     * words to search for.
+     */
+    std::vector<std::string> names;
+
+    /**
+     * The pattern a header must match.
+     */
+    std::shared_ptr<CRegex> regex;
+
+    /**
+     * The inclusive range of a size, or date, test.  For a flag test
+     * min holds the mask of the flags.
+     */
+    long long min;
+    long long max;
+};
+
+
+/**
+ * A query, compiled from the text following "QUERY:" in `index_limit`.
+ *
+ * The language is a set of terms, combined with "and", "or", "not", and
+ * parentheses.  Adjacent terms are implicitly joined with "and":
+ *
+ *   flag:S                    The message has all the given flags.
+ *   size:>10k  size:1k..1M    The size of the message, on disk.
+ *   date:2014-01-01..2014-06-30, date:>2014-01-01
+ *                             The Date: header.
+ *   body:words                The message contains all the words, found
+ *                             with the full-text search index.
+ *   name:regexp               The named header matches, e.g. from:steve.
+ *   regexp                    The subject, or sender, matches.
+ *
+ * Values containing spaces may be quoted: subject:"hello world".
+ *
+ * Terms are evaluated cheapest first, so tests of the flags, which are
+ * held in the filename, are made before those which need the headers.
+ */
+class CQuery
+{
+
+public:
+
+    /**
+     * Get the compiled form of the given query.  The most recently
+     * compiled query is cached.
+     */
+    static std::shared_ptr<CQuery> compile( const std::string &text );
+
+    /**
+     * Did the query compile?
+     */
+    bool valid() const;
+
+    /**
+     * Does the given message match?  An invalid query matches nothing.
+     */
+    bool matches( CMessage *message ) const;
+
+    /**
+     * Does evaluating this query require the headers of the messages?
+     */
+    bool needs_headers() const;
+
+    /**
+     * Does evaluating this query require the search index?
+     */
+    bool needs_search() const;
+
+    /**
+     * Append the names of the headers this query tests to the list.
+     */
+    void header_names( std::vector<std::string> &names ) const;
+
+private:
+
+    /**
+     * Parse the given text.
+     */
+    CQuery( const std::string &text );
+
+    /**
+     * Not copyable.
+     */
+    CQuery( const CQuery & );
+    CQuery & operator=( const CQuery & );
+
+    /**
+     * The recursive-descent parser.
+     */
+    std::shared_ptr<CQueryNode> parse_or();
+    std::shared_ptr<CQueryNode> parse_and();
+    std::shared_ptr<CQueryNode> parse_unary();
+    std::shared_ptr<CQueryNode> parse_term( const std::string &token );
+
+    /**
+     * Split the text into tokens.
+     */
+    void tokenize( const std::string &text );
+
+    /**
+     * Consume the next token if it is the given keyword, or one of the
+     * given operators.
+     */
+    bool accept( const char *keyword, const char *op );
+
+    /**
+     * The tokens, whether each was quoted, and the offset of the next.
+     */
+    std::vector<std::string> m_tokens;
+    std::vector<bool> m_quoted;
+    size_t m_offset;
+
+    /**
+     * Set if the text failed to parse.
+     */
+    bool m_error;
+
+    /**
+     * The root of the compiled query, or NULL if it failed to compile.
+     */
+    std::shared_ptr<CQueryNode> m_root;
+
+};
@@ -0,0 +1,171 @@
+/**
+ * regex_cache.cc - A bounded cache of compiled regular expressions.
+ *
+ * This file is part of lumail: http://lumail.org/
+ *
+ * Copyright (c) 2013-2014 by Steve Kemp.  All rights reserved.
+ *
+ **
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 dated June, 1991, or (at your
+ * option) any later version.
+ *
+ * On Debian GNU/Linux systems, the complete text of version 2 of the GNU
+ * General Public License can be found in `/usr/share/common-licenses/GPL-2'
+ */
+
+#include "debug.h"
+#include "regex_cache.h"
+
+
+/**
+ * The number of compiled patterns we'll hold on to.
+ */
+#define REGEX_CACHE_SIZE 64
+
+
+/**
+ * Compile the given pattern.
+ */
+CRegex::CRegex( const std::string &pattern, bool caseless )
+{
+    const char *error = NULL;
+    int offset = 0;
+
+    m_extra = NULL;
+    m_re    = pcre_compile( pattern.c_str(), caseless ? PCRE_CASELESS : 0,
+                            &error, &offset, NULL );
+
+    if ( m_re == NULL )
+    {
+        DEBUG_LOG( "CRegex - failed to compile " + pattern + " - " + std::string( error ? error : "" ) );
+        return;
+    }
+
+    /**
+     * Study the pattern, using the JIT if the library supports it.
+     */
+#ifdef PCRE_STUDY_JIT_COMPILE
+    m_extra = pcre_study( m_re, PCRE_STUDY_JIT_COMPILE, &error );
+#else
+    m_extra = pcre_study( m_re, 0, &error );
+#endif
+}
+
+
+/**
+ * Destructor.
+ */
+CRegex::~CRegex()
+{
+    if ( m_extra != NULL )
+    {
+#ifdef PCRE_STUDY_JIT_COMPILE
+        pcre_free_study( m_extra );
+#else
+        pcre_free( m_extra );
+#endif
+    }
+
+    if ( m_re != NULL )
+        pcre_free( m_re );
+}
+
+
+/**
+ * Did the pattern compile?
+ */
+bool CRegex::valid() const
+{
+    return( m_re != NULL );
+}
+
+
+/**
+ * Does the pattern match anywhere in the given text?
+ */
+bool CRegex::matches( const std::string &text ) const
+{
+    if ( m_re == NULL )
+        return false;
+
+    int ovector[3];
+    int ret = pcre_exec( m_re, m_extra, text.c_str(), text.size(), 0, 0, ovector, 3 );
+
+    return( ret >= 0 );
+}
+
+
+/**
+ * Instance-handle.
+ */
+CRegexCache *CRegexCache::pinstance = NULL;
+
+
+/**
+ * Get access to our singleton-object.
+ */
+CRegexCache *CRegexCache::Instance()
+{
+    if (!pinstance)
+        pinstance = new CRegexCache;
+
+    return pinstance;
+}
+
+
+/**
+ * Constructor - This is private as this class is a singleton.
+ */
+CRegexCache::CRegexCache()
+{
+}
+
+
+/**
+ * Get the compiled version of the given pattern.
+ */
+std::shared_ptr<CRegex> CRegexCache::get( const std::string &pattern, bool caseless )
+{
+    std::string key = ( caseless ? "i:" : "c:" ) + pattern;
+
+    std::lock_guard<std::mutex> lock( m_lock );
+
+    /**
+     * If we have it then move it to the front of the LRU list.
+     */
+    auto it = m_cache.find( key );
+    if ( it != m_cache.end() )
+    {
+        m_lru.splice( m_lru.begin(), m_lru, it->second.second );
+        return( it->second.first );
+    }
+
+    /**
+     * Otherwise compile it, discarding the least recently used pattern
+     * if we're full.  Anybody still using that keeps their reference.
+     */
+    std::shared_ptr<CRegex> re( new CRegex( pattern, caseless ) );
+
+    if ( m_cache.size() >= REGEX_CACHE_SIZE )
+    {
+        m_cache.erase( m_lru.back() );
+        m_lru.pop_back();
+    }
+
+    m_lru.push_front( key );
+    m_cache[key] = std::make_pair( re, m_lru.begin() );
+
+    return( re );
+}
+
+
+/**
+ * Does the given pattern match, case-insensitively, anywhere in the text?
+ */
+bool CRegexCache::matches( const std::string &pattern, const std::string &text )
+{
+    return( get( pattern )->matches( text ) );
+}
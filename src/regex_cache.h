@@ -0,0 +1,135 @@
+/**
+ * regex_cache.h - A bounded cache of compiled regular expressions.
+ *
+ * This file is part of lumail: http://lumail.org/
+ *
+ * Copyright (c) 2013-2014 by Steve Kemp.  All rights reserved.
+ *
+ **
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 dated June, 1991, or (at your
+ * option) any later version.
+ *
+ * On Debian GNU/Linux systems, the complete text of version 2 of the GNU
+ * General Public License can be found in `/usr/share/common-licenses/GPL-2'
+ */
+
+#pragma once
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <pcre.h>
+
+
+/**
+ * A compiled, and studied, regular expression.
+ *
+ * Matching is safe from any thread.
+ */
+class CRegex
+{
+
+public:
+
+    /**
+     * Compile the given pattern.
+     */
+    CRegex( const std::string &pattern, bool caseless );
+
+    /**
+     * Destructor.
+     */
+    ~CRegex();
+
+    /**
+     * Did the pattern compile?
+     */
+    bool valid() const;
+
+    /**
+     * Does the pattern match anywhere in the given text?
+     *
+     * An invalid pattern matches nothing.
+     */
+    bool matches( const std::string &text ) const;
+
+private:
+
+    /**
+     * Not copyable.
+     */
+    CRegex( const CRegex & );
+    CRegex & operator=( const CRegex & );
+
+    /**
+     * The compiled pattern, and the result of studying it.
+     */
+    pcre *m_re;
+    pcre_extra *m_extra;
+
+};
+
+
+/**
+ * Singleton class which holds the most recently used compiled patterns,
+ * so that a limit or filter may be tested against many messages, or
+ * folders, but only compiled once.
+ */
+class CRegexCache
+{
+
+public:
+
+    /**
+     * Get access to the singleton instance.
+     */
+    static CRegexCache *Instance();
+
+    /**
+     * Get the compiled version of the given pattern.
+     */
+    std::shared_ptr<CRegex> get( const std::string &pattern, bool caseless = true );
+
+    /**
+     * Does the given pattern match, case-insensitively, anywhere in the
+     * given text?
+     */
+    bool matches( const std::string &pattern, const std::string &text );
+
+protected:
+
+    /**
+     * Protected functions to allow our singleton implementation.
+     */
+    CRegexCache();
+    CRegexCache(const CRegexCache &);
+    CRegexCache & operator=(const CRegexCache &);
+
+private:
+
+    /**
+     * The single instance of this class.
+     */
+    static CRegexCache *pinstance;
+
+    /**
+     * Protects the cache, which may be used by worker threads.
+     */
+    std::mutex m_lock;
+
+    /**
+     * The keys of the cached patterns, most recently used first.
+     */
+    std::list<std::string> m_lru;
+
+    /**
+     * The cached patterns, and their position in the LRU list.
+     */
+    std::unordered_map<std::string, std::pair<std::shared_ptr<CRegex>, std::list<std::string>::iterator> > m_cache;
+
+};
@@ -67,6 +67,7 @@ CScreen *CScreen::Instance()
  */
 CScreen::CScreen()
 {
+    m_view.width = -1;
     setup();
 }
 
@@ -82,11 +83,6 @@ CScreen::~CScreen()
  */
 void CScreen::refresh_display()
 {
-    /**
-     * Clear the main-part of the screen.
-     */
-    CScreen::clear_main();
-
     /**
      * Get the current mode.
      */
@@ -94,6 +90,34 @@ void CScreen::refresh_display()
     std::string *s = global->get_variable("global_mode");
     assert( s != NULL );
 
+    /**
+     * If nothing the current view depends upon has changed then the
+     * screen already shows it, so there is nothing to do.
+     */
+    int view = VIEW_ALL;
+    if ( *s == "maildir" )
+        view = VIEW_MAILDIR;
+    else if ( *s == "index" )
+        view = VIEW_INDEX;
+    else if ( *s == "message" )
+        view = VIEW_MESSAGE;
+    else if ( *s == "text" )
+        view = VIEW_TEXT;
+
+    if ( ! global->is_dirty( view ) )
+        return;
+
+    /**
+     * Mark the view clean before drawing it, so that anything which
+     * changes while it is drawn will cause it to be drawn again.
+     */
+    global->clear_dirty( view );
+
+    /**
+     * Clear the main-part of the screen.
+     */
+    CScreen::clear_main();
+
 
     if ( *s == "maildir" )
         drawMaildir();
@@ -479,7 +503,15 @@ void CScreen::drawIndex()
                 attron( COLOR_PAIR(m_colours[unread_colour]) );
         }
 
-        if (cur != NULL)
+        if ( ( cur != NULL ) && ( !cur->headers_available() ) )
+        {
+            /**
+             * The headers are still being read in the background, so
+             * show what we can without blocking on them.
+             */
+            buf = cur->format( "[$FLAGS] ..." );
+        }
+        else if (cur != NULL)
         {
             CLua *lua = CLua::Instance();
             if (lua->is_function("format_message")) {
@@ -540,11 +572,7 @@ void CScreen::drawMessage()
     int selected = global->get_selected_message();
 
 
-    /**
-     * Are we wrapping long-headers, or long bodies?
-     */
     CLua *lua = CLua::Instance();
-    bool wrap = lua->get_bool("wrap_lines");
 
     /**
      * Bound the selection.
@@ -593,6 +621,11 @@ void CScreen::drawMessage()
         headers.push_back( "$SUBJECT" );
     }
 
+    /**
+     * Render the message, if we've not already done so.
+     */
+    renderMessage( cur, headers );
+
     /**
      * Get the colour to draw the headers in.
      */
@@ -614,12 +647,183 @@ void CScreen::drawMessage()
     int row = 0;
 
     /**
-     * For each header.
+     * Draw the headers.
      */
-    for (std::string header : headers)
+    attrset( COLOR_PAIR(m_colours[header_colour]) );
+    for (UTFString line : m_view.header_rows)
     {
         move( row, 0 );
+        printw( "%s", line.c_str() );
+        row += 1;
+    }
+    attrset( COLOR_PAIR(m_colours["white"]) );
+
+    /**
+     * Draw the attachments, if any are to be shown.
+     */
+    if ( ! m_view.attachment_rows.empty() )
+    {
+        /**
+         * Get the colour to draw the attachments in.
+         */
+        std::string *a_colour = global->get_variable( "attachment_colour" );
+        std::string attachment_colour;
+        if ( a_colour != NULL )
+            attachment_colour = *a_colour;
+        else
+            attachment_colour = "white";
+
+        attrset( COLOR_PAIR(m_colours[attachment_colour]) );
+        for (UTFString line : m_view.attachment_rows)
+        {
+            move( row, 0 );
+            printw( "%s", line.c_str() );
+            row += 1;
+        }
+        attrset( COLOR_PAIR(m_colours["white"]));
+    }
+
+
+    /**
+     * OK at this point we've drawn:
+     *
+     * 1. The headers
+     * 2. any headers.
+     *
+     * The cursor will be positioned at the last line of text,
+     * and the Y-coordinate for the next line should be
+     *
+     *    row+1
+     *
+     */
+
+
+    int textspace = (int)(CScreen::height() - m_view.header_count - m_view.attachment_count - 1 );
+    if (textspace < 2)
+        textspace = 2;
+
+    /**
+     * get the body-colour
+     */
+    std::string *b_colour = global->get_variable( "body_colour" );
+    std::string body_colour;
+    if ( b_colour != NULL )
+        body_colour = *b_colour;
+    else
+        body_colour = "white";
+
+    /**
+     * Draw the rows of the body, starting with the first row of the
+     * line we've scrolled to.
+     */
+    if ( offset >= 0 && offset < (int)m_view.line_start.size() )
+    {
+        attrset( COLOR_PAIR(m_colours[body_colour]) );
+
+        size_t first = m_view.line_start[offset];
+        for( int row_idx = 0; row_idx <= (textspace-2); row_idx++ )
+        {
+            if ( first + row_idx >= m_view.body_rows.size() )
+                break;
+
+            /**
+             * Here "row" counts the rows taken up by the
+             * headers+attachment lists.
+             */
+            move( row_idx + row + 1, 0 );
+            printw( "%s", m_view.body_rows[first + row_idx].c_str() );
+        }
+
+        attrset( COLOR_PAIR(m_colours["white"]) );
+    }
+
+
+    /**
+     * We're reading a message so call the on_read_message() hook.
+     */
+    cur->on_read_message();
+}
+
+
+/**
+ * Render the given message, unless the cached view is still current.
+ */
+void CScreen::renderMessage( std::shared_ptr<CMessage> cur,
+                             std::vector<std::string> headers )
+{
+    CGlobal *global = CGlobal::Instance();
+    CLua    *lua    = CLua::Instance();
+
+    /**
+     * The flags of a message are part of its filename, but don't
+     * change how it is displayed, so ignore them.  Likewise whether
+     * it is beneath new/ or cur/, as marking a new message read moves it.
+     */
+    std::string path = cur->path();
+    size_t flags = path.find( ":2," );
+    if ( flags != std::string::npos )
+        path = path.substr( 0, flags );
+
+    size_t slash = path.rfind( '/' );
+    if ( ( slash != std::string::npos ) && ( slash >= 4 ) &&
+         ( ( path.compare( slash - 4, 4, "/new" ) == 0 ) ||
+           ( path.compare( slash - 4, 4, "/cur" ) == 0 ) ) )
+        path.erase( slash - 4, 4 );
+
+    std::string *display_filter = global->get_variable( "display_filter" );
+    std::string *mail_filter    = global->get_variable( "mail_filter" );
+
+    std::string header_names;
+    for (std::string header : headers)
+        header_names += header + "\n";
+
+    int  width            = CScreen::width();
+    bool wrap             = lua->get_bool( "wrap_lines" );
+    bool show_attachments = lua->get_bool( "show_attachments", true );
+
+    /**
+     * If nothing has changed we've nothing to do.
+     */
+    if ( ( m_view.path == path ) &&
+         ( m_view.display_filter == ( display_filter ? *display_filter : "" ) ) &&
+         ( m_view.mail_filter == ( mail_filter ? *mail_filter : "" ) ) &&
+         ( m_view.headers == header_names ) &&
+         ( m_view.width == width ) &&
+         ( m_view.wrap == wrap ) &&
+         ( m_view.show_attachments == show_attachments ) &&
+         ( m_view.complete ) )
+        return;
+
+#ifdef LUMAIL_DEBUG
+    DEBUG_LOG( "CScreen::renderMessage " + path );
+#endif
+
+    m_view.path             = path;
+    m_view.display_filter   = display_filter ? *display_filter : "";
+    m_view.mail_filter      = mail_filter ? *mail_filter : "";
+    m_view.headers          = header_names;
+    m_view.width            = width;
+    m_view.wrap             = wrap;
+    m_view.show_attachments = show_attachments;
 
+    m_view.header_rows.clear();
+    m_view.attachment_rows.clear();
+    m_view.body_rows.clear();
+    m_view.line_start.clear();
+
+    /**
+     * Don't wait for the mail_filter; we'll be redrawn when it completes.
+     * Until then only headers which don't come from its output are shown.
+     */
+    bool ready = cur->parse_ready();
+    if ( !ready && !CMessage::header_filter().empty() )
+        headers.clear();
+
+    /**
+     * For each header.
+     */
+    for (std::string header : headers)
+    {
         /**
          * The header-name, in useful format - i.e. without the '$' prefix
          * and in lower-case.
@@ -644,22 +848,15 @@ void CScreen::drawMessage()
             value = "[unset]";
 
         /**
-         * If we're not wrapping, or if the line will fit, then we just draw it.
+         * If we're not wrapping, or if the line will fit, then we just use it.
          */
-        if ( !wrap || ( value.length() < (CScreen::width() - name.size() - 4 ) ) )
+        if ( !wrap || ( value.length() < (width - name.size() - 4 ) ) )
         {
             /**
              * Truncate to avoid long-wraps.
              */
-            value = value.substr(0, (CScreen::width() - name.size() - 4 ) );
-
-            /**
-             * Draw the single line.
-             */
-            attrset( COLOR_PAIR(m_colours[header_colour]) );
-            printw( "%s: %s", name.c_str(), value.c_str() );
-            attrset( COLOR_PAIR(m_colours["white"]) );
-            row += 1;
+            value = value.substr(0, (width - name.size() - 4 ) );
+            m_view.header_rows.push_back( name + ": " + value );
         }
         else
         {
@@ -674,17 +871,13 @@ void CScreen::drawMessage()
             /**
              * Work out how much of it we can display.
              */
-            size_t slength = CScreen::width() ;
+            size_t slength = width;
 
             bool cont = true;
             while( cont )
             {
-                move( row, 0 );
-                attrset( COLOR_PAIR(m_colours[header_colour]) );
-                printw( "%s", line.c_str() );
-                attrset( COLOR_PAIR(m_colours["white"]) );
+                m_view.header_rows.push_back( line );
 
-                row += 1;
                 if ( line.length() > slength )
                 {
                     line = line.substr( slength );
@@ -696,167 +889,83 @@ void CScreen::drawMessage()
             }
         }
     }
+    m_view.header_count = headers.size();
 
     /**
-     * Get the number of attachments to show, and decide if we should show
-     * them.
+     * Get the attachments, and decide if we should show them.
      */
-    std::vector<std::string> attachments = cur->attachments();
-    bool show_attachments = lua->get_bool( "show_attachments", true );
+    std::vector<std::string> attachments;
+    if ( ready )
+        attachments = cur->attachments();
+
     bool format_attach_lua = lua->is_function( "format_attachment" );
 
     if ( attachments.size() > 0 && show_attachments  )
     {
         /**
-         * Get the colour to draw the attachments in.
-         */
-        std::string *a_colour = global->get_variable( "attachment_colour" );
-        std::string attachment_colour;
-        if ( a_colour != NULL )
-            attachment_colour = *a_colour;
-        else
-            attachment_colour = "white";
-
-        /**
-         * Draw the attachments: Attachment-counting starts at one.
+         * Attachment-counting starts at one.
          */
         int acount = 1;
         for (std::string path : attachments)
         {
-            move( row, 0 );
-
-            /**
-             * Change to the right colour, draw the message,
-             * and revert.
-             */
-            attrset( COLOR_PAIR(m_colours[attachment_colour]) );
             if (format_attach_lua)
             {
-                printw( "%s", lua->call_attach_str("format_attachment",
-                              cur->get_attachment(acount)).c_str());
+                m_view.attachment_rows.push_back(
+                    lua->call_attach_str("format_attachment",
+                                         cur->describe_attachment(acount)) );
             }
             else
             {
-                printw( "Attachment %d - %s", acount, path.c_str() );
+                char buf[32] = { '\0' };
+                snprintf( buf, sizeof(buf)-1, "Attachment %d - ", acount );
+                m_view.attachment_rows.push_back( buf + path );
             }
-            attrset( COLOR_PAIR(m_colours["white"]));
 
             acount += 1;
-            row += 1;
         }
     }
+    m_view.attachment_count = attachments.size();
 
 
     /**
-     * Now draw the body.
-     */
-    std::vector<UTFString> body;
-
-    /**
-     * The body might come from on_get_body.
-     */
-    body = lua->on_get_body();
-    if ( body.empty() )
-        body = cur->body();
-
-
-    /**
-     * OK at this point we've drawn:
-     *
-     * 1. The headers
-     * 2. any headers.
-     *
-     * The cursor will be positioned at the last line of text,
-     * and the Y-coordinate for the next line should be
-     *
-     *    row+1
+     * Now the body.
      *
+     * The body might come from on_get_body.
      */
+    std::vector<UTFString> body;
+    m_view.complete = true;
 
-
-    int textspace = (int)(CScreen::height() - headers.size() - attachments.size() - 1 );
-    if (textspace < 2)
-        textspace = 2;
-
-    /**
-     * get the body-colour
-     */
-    std::string *b_colour = global->get_variable( "body_colour" );
-    std::string body_colour;
-    if ( b_colour != NULL )
-        body_colour = *b_colour;
-    else
-        body_colour = "white";
+    if ( ready )
+        body = lua->on_get_body();
 
     /**
-     * The screen width.
+     * Don't wait for the display_filter either.
      */
-    size_t width = CScreen::width();
+    if ( !ready || ( body.empty() && ! cur->body( body, false ) ) )
+    {
+        body.push_back( FILTERING_MESSAGE );
+        m_view.complete = false;
+    }
 
     /**
-     * Draw each line of the body.
+     * Split each line into the rows it will occupy on the screen,
+     * or truncate it if we're not wrapping.
      */
-    for( int row_idx = 0, line_idx = 0;;)
+    for (UTFString line : body)
     {
-        UTFString line = "";
-
-        /** Get current line */
-        if ( (line_idx + offset) < (int)body.size() )
-        {
-            line = body[line_idx+offset];
-            line_idx++;
-        }
-        else
-            break;
+        m_view.line_start.push_back( m_view.body_rows.size() );
 
-        int len = line.length();
-        int slen = 0;
-        UTFString subline = line.substr(0, width);
+        size_t len  = line.length();
+        size_t slen = 0;
 
-        for(;;)
+        do
         {
-            /**
-             * Here "row" counts the rows taken up by the
-             * headers+attachment lists.
-             */
-            move( row_idx + row + 1, 0 );
-
-            attrset( COLOR_PAIR(m_colours[body_colour]) );
-            printw( "%s", subline.c_str() );
-            attrset( COLOR_PAIR(m_colours["white"]) );
-
-            row_idx++;
-
+            UTFString subline = line.substr( slen, width );
+            m_view.body_rows.push_back( subline );
             slen += subline.length();
-
-            /**
-             * Should we stop displaying this line ?
-             */
-            if (row_idx > (textspace-2) || !wrap || len == slen)
-                break;
-
-            /**
-             * Make sure we don't overstep our bounds by trying to draw past
-             * the line-buffer.
-             */
-            if ( slen > (int)line.size() )
-                break;
-
-            subline = line.substr(slen, width );
         }
-
-        /**
-         * No screen space left
-         */
-        if (row_idx > (textspace-2))
-             break;
+        while ( wrap && slen < len && width > 0 );
     }
-
-
-    /**
-     * We're reading a message so call the on_read_message() hook.
-     */
-    cur->on_read_message();
 }
 
 void CScreen::display_styled_line(int screenLine, std::string line,
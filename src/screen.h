@@ -18,10 +18,61 @@
 
 #pragma once
 
+#include <memory>
+#include <string>
 #include <vector>
 #include <unordered_map>
 #include "utfstring.h"
 
+
+class CMessage;
+
+
+/**
+ * The rendered form of the message being viewed.
+ *
+ * Building this requires parsing the message, and perhaps running the
+ * body through the display_filter, so it is kept until the message, the
+ * filters, or the screen width change, rather than being rebuilt as the
+ * message is scrolled.
+ */
+struct CMessageView
+{
+    /**
+     * The settings the view was rendered with.
+     */
+    std::string path;
+    std::string display_filter;
+    std::string mail_filter;
+    std::string headers;
+    int width;
+    bool wrap;
+    bool show_attachments;
+
+    /**
+     * False if the body was still being filtered.
+     */
+    bool complete;
+
+    /**
+     * The rows of the header-block, and of the attachment-list.
+     */
+    std::vector<UTFString> header_rows;
+    std::vector<UTFString> attachment_rows;
+
+    /**
+     * The number of headers, and attachments, the message has.
+     */
+    size_t header_count;
+    size_t attachment_count;
+
+    /**
+     * The rows of the body, and the index of the first row of each line.
+     */
+    std::vector<UTFString> body_rows;
+    std::vector<size_t> line_start;
+};
+
 /**
  * This class contains simple functions relating to the screen-handling.
  */
@@ -127,6 +178,12 @@ private:
     void drawMessage();
     void drawText();
 
+    /**
+     * Render the given message, unless the cached view is still current.
+     */
+    void renderMessage( std::shared_ptr<CMessage> message,
+                        std::vector<std::string> headers );
+
     /**
      * Lookup the curses attribute for the given string.
      */
@@ -137,4 +194,9 @@ private:
      */
     std::unordered_map<std::string, int> m_colours;
 
+    /**
+     * The rendered form of the message being viewed.
+     */
+    CMessageView m_view;
+
 };
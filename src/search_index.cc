@@ -0,0 +1,901 @@
+/**
+ * search_index.cc - An inverted index of message text, per maildir.
+ *
+ * This file is part of lumail: http://lumail.org/
+ *
+ * Copyright (c) 2013-2014 by Steve Kemp.  All rights reserved.
+ *
+ **
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 dated June, 1991, or (at your
+ * option) any later version.
+ *
+ * On Debian GNU/Linux systems, the complete text of version 2 of the GNU
+ * General Public License can be found in `/usr/share/common-licenses/GPL-2'
+ */
+
+#include <algorithm>
+#include <fcntl.h>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "charset.h"
+#include "debug.h"
+#include "filter.h"
+#include "global.h"
+#include "header_parser.h"
+#include "maildir.h"
+#include "message.h"
+#include "search_index.h"
+
+
+/**
+ * The first line of every index-file.
+ */
+#define SEARCH_INDEX_MAGIC "lumail-search-index 1"
+
+
+/**
+ * Words longer than this are ignored, as they're likely to be encoded
+ * data rather than text.
+ */
+#define SEARCH_MAX_WORD 48
+
+
+/**
+ * Read the next NUL-terminated field from the given data, updating
+ * the offset.  If no complete field remains then valid is cleared.
+ */
+static std::string next_field( const std::string &data, size_t &offset, bool &valid )
+{
+    size_t end = data.find( '\0', offset );
+    if ( end == std::string::npos )
+    {
+        valid = false;
+        return "";
+    }
+
+    std::string result = data.substr( offset, end - offset );
+    offset = end + 1;
+    return result;
+}
+
+
+/**
+ * Order lists of ids by their length.
+ */
+static bool shorter( const std::vector<uint32_t> *a, const std::vector<uint32_t> *b )
+{
+    return( a->size() < b->size() );
+}
+
+
+/**
+ * Instance-handle.
+ */
+CSearchIndex *CSearchIndex::pinstance = NULL;
+
+
+/**
+ * Get access to our singleton-object.
+ */
+CSearchIndex *CSearchIndex::Instance()
+{
+    if (!pinstance)
+        pinstance = new CSearchIndex;
+
+    return pinstance;
+}
+
+
+/**
+ * Constructor - This is private as this class is a singleton.
+ */
+CSearchIndex::CSearchIndex()
+{
+    m_active = 0;
+    m_merged = false;
+}
+
+
+/**
+ * Set the directory to store index-files within.
+ */
+void CSearchIndex::set_directory( std::string path )
+{
+    /**
+     * Flush anything pending to the old location.
+     */
+    wait();
+    save();
+    m_folders.clear();
+
+    m_directory = path;
+
+    if ( !m_directory.empty() )
+        mkdir( m_directory.c_str(), 0700 );
+}
+
+
+/**
+ * Bring the index of the given maildir up to date.
+ */
+void CSearchIndex::update( std::string maildir )
+{
+    CSearchFolder *index = folder( maildir );
+
+    /**
+     * Adding, removing, or renaming a message changes the mtime of its
+     * directory, so there's nothing to do unless they have.
+     */
+    if ( !changed( maildir, *index ) )
+        return;
+
+    CMaildir md( maildir );
+    std::vector<std::string> paths = md.getMessagePaths();
+
+    std::unordered_set<std::string> present;
+
+    /**
+     * Index anything we've not seen before, and note the current path
+     * of everything else, as its flags may have changed.
+     */
+    for (std::string path : paths)
+    {
+        std::string dir;
+        std::string key;
+        if ( !split_path( path, dir, key ) )
+            continue;
+
+        present.insert( key );
+
+        std::unordered_map<std::string, uint32_t>::iterator it = index->ids.find( key );
+        if ( it != index->ids.end() )
+            index->paths[it->second] = path;
+        else
+            queue( maildir, *index, key, path );
+    }
+
+    /**
+     * Messages removed while they were queued are ignored when their
+     * words arrive.
+     */
+    std::unordered_map<std::string, std::string>::iterator q = index->queued.begin();
+    while( q != index->queued.end() )
+    {
+        if ( present.find( q->first ) == present.end() )
+            q = index->queued.erase( q );
+        else
+            ++q;
+    }
+
+    /**
+     * Forget anything which has been deleted, or moved elsewhere.
+     */
+    std::unordered_map<std::string, uint32_t>::iterator it = index->ids.begin();
+    while( it != index->ids.end() )
+    {
+        if ( present.find( it->first ) != present.end() )
+        {
+            ++it;
+            continue;
+        }
+
+        index->keys[it->second]  = "";
+        index->paths[it->second] = "";
+        index->dirty = true;
+        index->generation++;
+
+        it = index->ids.erase( it );
+    }
+}
+
+
+/**
+ * Return the paths of the matching messages in the given maildir.
+ */
+std::vector<std::string> CSearchIndex::search( std::string maildir, std::string terms )
+{
+    std::vector<std::string> result;
+
+    /**
+     * The caller wants an answer, so wait for any messages still being
+     * indexed.
+     */
+    update( maildir );
+    wait();
+
+    CSearchFolder *index = folder( maildir );
+    std::vector<uint32_t> ids = lookup( *index, terms );
+
+    for (uint32_t id : ids)
+    {
+        if ( !index->keys[id].empty() && !index->paths[id].empty() )
+            result.push_back( index->paths[id] );
+    }
+
+    save();
+    return( result );
+}
+
+
+/**
+ * Does the message with the given path contain all the given words?
+ */
+bool CSearchIndex::matches( std::string path, std::string terms )
+{
+    std::string maildir;
+    std::string key;
+    if ( !split_path( path, maildir, key ) )
+        return false;
+
+    CSearchFolder *index = folder( maildir );
+
+    /**
+     * A message we've not indexed may be a new arrival, so bring the
+     * index up to date.  We don't wait for it to be read, rather the
+     * caller is expected to try again once publish() returns true.
+     */
+    if ( ( index->ids.find( key ) == index->ids.end() ) &&
+         ( index->queued.find( key ) == index->queued.end() ) )
+    {
+        update( maildir );
+    }
+
+    if ( ( index->last_terms != terms ) ||
+         ( index->last_generation != index->generation ) ||
+         ( index->last_terms.empty() ) )
+    {
+        index->last_keys.clear();
+
+        std::vector<uint32_t> ids = lookup( *index, terms );
+        for (uint32_t id : ids)
+        {
+            if ( !index->keys[id].empty() )
+                index->last_keys.insert( index->keys[id] );
+        }
+
+        index->last_terms      = terms;
+        index->last_generation = index->generation;
+    }
+
+    return( index->last_keys.find( key ) != index->last_keys.end() );
+}
+
+
+/**
+ * Merge any messages indexed in the background into the index.
+ */
+bool CSearchIndex::publish()
+{
+    if ( !merge() || !m_merged )
+        return false;
+
+    m_merged = false;
+    return true;
+}
+
+
+/**
+ * Merge the completed documents into the index.
+ */
+bool CSearchIndex::merge()
+{
+    std::vector<CSearchDocument> done;
+    bool idle;
+
+    {
+        std::lock_guard<std::mutex> lock( m_lock );
+        done.swap( m_done );
+        idle = m_jobs.empty() && ( m_active == 0 );
+    }
+
+    if ( !done.empty() )
+        m_merged = true;
+
+    for( CSearchDocument &document : done )
+    {
+        CSearchFolder *index = folder( document.maildir );
+
+        /**
+         * The message may have been removed, or renamed, in the meantime.
+         */
+        std::unordered_map<std::string, std::string>::iterator it = index->queued.find( document.key );
+        if ( it == index->queued.end() )
+            continue;
+
+        std::string path = it->second;
+        index->queued.erase( it );
+
+        /**
+         * If it couldn't be read, perhaps as it was renamed, then it
+         * will be found, and queued again, when the folder is next listed.
+         */
+        if ( document.failed )
+        {
+            index->listed = 0;
+            continue;
+        }
+
+        add( *index, document, path );
+    }
+
+    if ( !done.empty() && idle )
+        save();
+
+    return( idle );
+}
+
+
+/**
+ * Wait for the background indexing to complete, and merge it.
+ */
+void CSearchIndex::wait()
+{
+    {
+        std::unique_lock<std::mutex> lock( m_lock );
+        while( !m_jobs.empty() || ( m_active > 0 ) )
+            m_results_ready.wait( lock );
+    }
+
+    /**
+     * publish() will still report this, so limits are re-applied.
+     */
+    merge();
+}
+
+
+/**
+ * Are messages being indexed in the background?
+ */
+bool CSearchIndex::busy()
+{
+    std::lock_guard<std::mutex> lock( m_lock );
+    return( !m_jobs.empty() || ( m_active > 0 ) || !m_done.empty() );
+}
+
+
+/**
+ * Write any changed indexes to disk.
+ */
+void CSearchIndex::save()
+{
+    for( auto &it : m_folders )
+    {
+        if ( !it.second.dirty )
+            continue;
+
+        compact( it.second );
+
+        if ( m_directory.empty() )
+            it.second.dirty = false;
+        else
+            save( it.first, it.second );
+    }
+}
+
+
+/**
+ * Split the given text into lower-case words.
+ *
+ * Words are runs of letters and digits; any non-ASCII byte is treated as
+ * a letter, so UTF-8 text is split on ASCII punctuation and whitespace.
+ */
+std::vector<std::string> CSearchIndex::tokenize( const std::string &text )
+{
+    std::vector<std::string> result;
+    std::string word;
+
+    for( size_t i = 0; i <= text.size(); i++ )
+    {
+        unsigned char c = ( i < text.size() ) ? text[i] : ' ';
+
+        if ( ( c >= 0x80 ) || isalnum( c ) )
+        {
+            word += (char) tolower( c );
+            continue;
+        }
+
+        if ( ( word.size() > 1 ) && ( word.size() <= SEARCH_MAX_WORD ) )
+            result.push_back( word );
+
+        word.clear();
+    }
+
+    return( result );
+}
+
+
+/**
+ * Split a message path into its maildir, and document key.
+ */
+bool CSearchIndex::split_path( std::string path, std::string &maildir, std::string &key )
+{
+    size_t offset = path.rfind( "/cur/" );
+    if ( offset == std::string::npos )
+        offset = path.rfind( "/new/" );
+
+    if ( offset == std::string::npos )
+        return false;
+
+    maildir = path.substr( 0, offset );
+    key     = path.substr( offset + 5 );
+
+    /**
+     * Strip any ":2,FLAGS" suffix.
+     */
+    size_t colon = key.find( ':' );
+    if ( colon != std::string::npos )
+        key = key.substr( 0, colon );
+
+    return( !key.empty() );
+}
+
+
+/**
+ * Find the index of the given maildir, loading it if required.
+ */
+CSearchFolder *CSearchIndex::folder( std::string maildir )
+{
+    std::unordered_map<std::string, CSearchFolder>::iterator it = m_folders.find( maildir );
+    if ( it != m_folders.end() )
+        return( &it->second );
+
+    CSearchFolder &index = m_folders[maildir];
+    index.dirty           = false;
+    index.generation      = 0;
+    index.last_generation = 0;
+    index.cur_mtime       = 0;
+    index.new_mtime       = 0;
+    index.listed          = 0;
+
+    if ( !m_directory.empty() )
+        load( maildir, index );
+
+    return( &index );
+}
+
+
+/**
+ * Have the cur/ or new/ directories of the given maildir changed since
+ * they were last listed?
+ */
+bool CSearchIndex::changed( std::string maildir, CSearchFolder &index )
+{
+    struct stat cur;
+    struct stat nw;
+
+    time_t cur_mtime = ( stat( ( maildir + "/cur" ).c_str(), &cur ) == 0 ) ? cur.st_mtime : 0;
+    time_t new_mtime = ( stat( ( maildir + "/new" ).c_str(), &nw ) == 0 ) ? nw.st_mtime : 0;
+
+    /**
+     * mtimes have a resolution of a second, so a change made in the
+     * same second as the last listing might not be visible; in that
+     * case list the directories again.
+     */
+    if ( ( index.listed != 0 ) &&
+         ( cur_mtime == index.cur_mtime ) && ( cur_mtime < index.listed ) &&
+         ( new_mtime == index.new_mtime ) && ( new_mtime < index.listed ) )
+        return false;
+
+    index.cur_mtime = cur_mtime;
+    index.new_mtime = new_mtime;
+    index.listed    = time( NULL );
+
+    return true;
+}
+
+
+/**
+ * Queue the given message to be indexed in the background.
+ */
+void CSearchIndex::queue( std::string maildir, CSearchFolder &index, std::string key, std::string path )
+{
+    /**
+     * If it's already queued just note where it is now.
+     */
+    std::unordered_map<std::string, std::string>::iterator it = index.queued.find( key );
+    if ( it != index.queued.end() )
+    {
+        it->second = path;
+        return;
+    }
+    index.queued[key] = path;
+
+    CSearchDocument document;
+    document.maildir = maildir;
+    document.key     = key;
+    document.path    = path;
+    document.failed  = false;
+
+    /**
+     * The workers can't consult the settings, so take a copy of them.
+     */
+    std::string *filter = CGlobal::Instance()->get_variable( "mail_filter" );
+    if ( ( filter != NULL ) && !filter->empty() )
+    {
+        document.mail_filter    = *filter;
+        document.filter_headers = !CMessage::header_filter().empty();
+        document.timeout        = CFilter::Instance()->timeout_setting();
+    }
+    else
+    {
+        document.filter_headers = false;
+        document.timeout        = 0;
+    }
+
+    /**
+     * Start the workers on first use, having created the singletons they
+     * use, as that isn't thread-safe.
+     */
+    if ( m_threads.empty() )
+    {
+        CCharset::Instance();
+        CFilter::Instance();
+
+        size_t count = std::max( std::thread::hardware_concurrency(), 1U );
+        for( size_t i = 0; i < count; i++ )
+            m_threads.push_back( std::thread( &CSearchIndex::run, this ) );
+    }
+
+    {
+        std::lock_guard<std::mutex> lock( m_lock );
+        m_jobs.push_back( document );
+    }
+    m_work.notify_one();
+}
+
+
+/**
+ * Add the given document to the index.
+ */
+void CSearchIndex::add( CSearchFolder &index, const CSearchDocument &document, std::string path )
+{
+    /**
+     * Ids only ever increase, so the postings stay sorted.
+     */
+    uint32_t id = index.keys.size();
+    index.keys.push_back( document.key );
+    index.paths.push_back( path );
+    index.ids[document.key] = id;
+
+    for (const std::string &word : document.words)
+        index.postings[word].push_back( id );
+
+    index.dirty = true;
+    index.generation++;
+}
+
+
+/**
+ * Read the given message, and find the words within it.
+ *
+ * The interesting headers are indexed, as well as the body.
+ */
+void CSearchIndex::read_document( CSearchDocument &document )
+{
+    std::string raw;
+    bool filtered = false;
+
+    /**
+     * Use the output of the mail_filter, if there is one, and it succeeds.
+     */
+    if ( !document.mail_filter.empty() )
+    {
+        filtered = CFilter::Instance()->filter_file( CMessage::filter_key( document.path ),
+                                                     document.mail_filter,
+                                                     document.path, raw,
+                                                     document.timeout );
+    }
+
+    std::unordered_map<std::string, UTFString> headers;
+    GMimeStream *stream = NULL;
+
+    if ( filtered )
+    {
+        if ( document.filter_headers )
+        {
+            size_t len = CHeaderParser::header_length( raw.data(), raw.size() );
+            CHeaderParser::parse( raw.data(), len, headers );
+        }
+
+        stream = g_mime_stream_mem_new_with_buffer( raw.data(), raw.size() );
+    }
+    else
+    {
+        int fd = open( document.path.c_str(), O_RDONLY | O_CLOEXEC );
+        if ( fd < 0 )
+        {
+            document.failed = true;
+            return;
+        }
+
+        stream = g_mime_stream_fs_new( fd );
+    }
+
+    if ( !filtered || !document.filter_headers )
+    {
+        off_t size;
+        time_t mtime;
+        CMessage::parse_headers( document.path, headers, size, mtime );
+    }
+
+    std::string text;
+    const char *names[] = { "subject", "from", "to", "cc" };
+    for( const char *name : names )
+    {
+        std::unordered_map<std::string, UTFString>::iterator it = headers.find( name );
+        if ( it != headers.end() )
+            text += it->second;
+        text += "\n";
+    }
+
+    CMessage::parse_body( stream, text );
+    g_object_unref( stream );
+
+    document.words = tokenize( text );
+    std::sort( document.words.begin(), document.words.end() );
+    document.words.erase( std::unique( document.words.begin(), document.words.end() ),
+                          document.words.end() );
+}
+
+
+/**
+ * The body of each worker thread.
+ */
+void CSearchIndex::run()
+{
+    while( true )
+    {
+        CSearchDocument document;
+
+        /**
+         * Wait for a message to read.
+         */
+        {
+            std::unique_lock<std::mutex> lock( m_lock );
+            while( m_jobs.empty() )
+                m_work.wait( lock );
+
+            document = m_jobs.front();
+            m_jobs.pop_front();
+            m_active += 1;
+        }
+
+        read_document( document );
+
+        {
+            std::lock_guard<std::mutex> lock( m_lock );
+            m_active -= 1;
+            m_done.push_back( document );
+        }
+        m_results_ready.notify_all();
+    }
+}
+
+
+/**
+ * Find the ids of the documents containing all the given terms.
+ */
+std::vector<uint32_t> CSearchIndex::lookup( CSearchFolder &index, std::string terms )
+{
+    std::vector<uint32_t> result;
+
+    std::vector<std::string> words = tokenize( terms );
+    if ( words.empty() )
+        return( result );
+
+    /**
+     * Find the documents for each word, and intersect them starting with
+     * the rarest, so the candidate set is as small as possible.
+     */
+    std::vector<const std::vector<uint32_t> *> lists;
+    for (std::string word : words)
+    {
+        std::unordered_map<std::string, std::vector<uint32_t> >::iterator it = index.postings.find( word );
+        if ( it == index.postings.end() )
+            return( result );
+
+        lists.push_back( &it->second );
+    }
+    std::sort( lists.begin(), lists.end(), shorter );
+
+    result = *lists[0];
+    for( size_t i = 1; i < lists.size() && !result.empty(); i++ )
+    {
+        std::vector<uint32_t> tmp;
+        std::set_intersection( result.begin(), result.end(),
+                               lists[i]->begin(), lists[i]->end(),
+                               std::back_inserter( tmp ) );
+        result.swap( tmp );
+    }
+
+    return( result );
+}
+
+
+/**
+ * Drop removed documents, renumbering those which remain.
+ */
+void CSearchIndex::compact( CSearchFolder &index )
+{
+    if ( index.ids.size() == index.keys.size() )
+        return;
+
+    std::vector<uint32_t> remap( index.keys.size(), UINT32_MAX );
+    std::vector<std::string> keys;
+    std::vector<std::string> paths;
+
+    for( size_t i = 0; i < index.keys.size(); i++ )
+    {
+        if ( index.keys[i].empty() )
+            continue;
+
+        remap[i] = keys.size();
+        index.ids[index.keys[i]] = keys.size();
+        keys.push_back( index.keys[i] );
+        paths.push_back( index.paths[i] );
+    }
+
+    std::unordered_map<std::string, std::vector<uint32_t> >::iterator it = index.postings.begin();
+    while( it != index.postings.end() )
+    {
+        std::vector<uint32_t> ids;
+        for (uint32_t id : it->second)
+        {
+            if ( remap[id] != UINT32_MAX )
+                ids.push_back( remap[id] );
+        }
+
+        if ( ids.empty() )
+        {
+            it = index.postings.erase( it );
+            continue;
+        }
+
+        it->second.swap( ids );
+        ++it;
+    }
+
+    index.keys.swap( keys );
+    index.paths.swap( paths );
+    index.generation++;
+}
+
+
+/**
+ * The file which stores the index of the given maildir.
+ */
+std::string CSearchIndex::index_file( std::string maildir )
+{
+    char buf[32] = { '\0' };
+    snprintf( buf, sizeof(buf)-1, "%016zx.search", std::hash<std::string>()( maildir ) );
+
+    return( m_directory + "/" + buf );
+}
+
+
+/**
+ * Load the on-disk index of the given maildir.
+ */
+void CSearchIndex::load( std::string maildir, CSearchFolder &index )
+{
+    std::ifstream input( index_file( maildir ).c_str(), std::ios::in | std::ios::binary );
+    if ( !input.is_open() )
+        return;
+
+    std::string magic;
+    std::string name;
+
+    getline( input, magic );
+    getline( input, name );
+
+    /**
+     * Ignore indexes of different versions, and hash-collisions.
+     */
+    if ( ( magic != SEARCH_INDEX_MAGIC ) || ( name != maildir ) )
+        return;
+
+    std::stringstream ss;
+    ss << input.rdbuf();
+    std::string data = ss.str();
+
+    size_t offset = 0;
+    bool   valid  = true;
+
+    /**
+     * The keys, in id order, then the postings of each word.
+     */
+    size_t count = strtoul( next_field( data, offset, valid ).c_str(), NULL, 10 );
+    for( size_t i = 0; valid && i < count; i++ )
+    {
+        std::string key = next_field( data, offset, valid );
+        index.ids[key] = index.keys.size();
+        index.keys.push_back( key );
+    }
+
+    while( valid && offset < data.size() )
+    {
+        std::string word = next_field( data, offset, valid );
+        size_t n = strtoul( next_field( data, offset, valid ).c_str(), NULL, 10 );
+
+        std::vector<uint32_t> &ids = index.postings[word];
+        ids.reserve( n );
+
+        for( size_t i = 0; valid && i < n; i++ )
+        {
+            uint32_t id = strtoul( next_field( data, offset, valid ).c_str(), NULL, 10 );
+            if ( id < index.keys.size() )
+                ids.push_back( id );
+        }
+    }
+
+    /**
+     * If the file was truncated start again.
+     */
+    if ( !valid )
+    {
+        DEBUG_LOG( "CSearchIndex::load(" + maildir + ") - corrupt index, discarding" );
+        index.keys.clear();
+        index.ids.clear();
+        index.postings.clear();
+    }
+
+    index.paths.resize( index.keys.size() );
+
+#ifdef LUMAIL_DEBUG
+    char dm[256] = { '\0' };
+    snprintf( dm, sizeof(dm)-1, "CSearchIndex::load(%s) - %zu messages, %zu words",
+              maildir.c_str(), index.keys.size(), index.postings.size() );
+    DEBUG_LOG( dm );
+#endif
+}
+
+
+/**
+ * Write the index of the given maildir to disk.
+ */
+void CSearchIndex::save( std::string maildir, CSearchFolder &index )
+{
+    std::string file = index_file( maildir );
+    std::string tmp  = file + ".tmp";
+
+    std::ofstream output( tmp.c_str(), std::ios::out | std::ios::binary | std::ios::trunc );
+    if ( !output.is_open() )
+    {
+        DEBUG_LOG( "CSearchIndex::save - failed to open " + tmp );
+        return;
+    }
+
+    output << SEARCH_INDEX_MAGIC << "\n" << maildir << "\n";
+
+    output << index.keys.size() << '\0';
+    for (std::string key : index.keys)
+        output << key << '\0';
+
+    for( auto &posting : index.postings )
+    {
+        output << posting.first << '\0' << posting.second.size() << '\0';
+        for (uint32_t id : posting.second)
+            output << id << '\0';
+    }
+
+    output.close();
+
+    if ( output.fail() || rename( tmp.c_str(), file.c_str() ) != 0 )
+    {
+        DEBUG_LOG( "CSearchIndex::save - failed to write " + file );
+        unlink( tmp.c_str() );
+        return;
+    }
+
+    index.dirty = false;
+}
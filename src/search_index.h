@@ -0,0 +1,325 @@
+/**
+ * search_index.h - An inverted index of message text, per maildir.
+ *
+ * This file is part of lumail: http://lumail.org/
+ *
+ * Copyright (c) 2013-2014 by Steve Kemp.  All rights reserved.
+ *
+ **
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 dated June, 1991, or (at your
+ * option) any later version.
+ *
+ * On Debian GNU/Linux systems, the complete text of version 2 of the GNU
+ * General Public License can be found in `/usr/share/common-licenses/GPL-2'
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <sys/types.h>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+
+/**
+ * The index of the messages beneath a single maildir.
+ *
+ * Each message is a document, identified by the unique part of its
+ * filename, so that changing its flags doesn't require re-indexing.
+ */
+struct CSearchFolder
+{
+    /**
+     * Have we changed since the index-file was read?
+     */
+    bool dirty;
+
+    /**
+     * Incremented whenever a document is added, or removed.
+     */
+    unsigned int generation;
+
+    /**
+     * The key of each document, by id.  Removed documents have an
+     * empty key until the index is next compacted.
+     */
+    std::vector<std::string> keys;
+
+    /**
+     * The current path of each document, by id.
+     */
+    std::vector<std::string> paths;
+
+    /**
+     * The id of each document, by key.
+     */
+    std::unordered_map<std::string, uint32_t> ids;
+
+    /**
+     * The ids of the documents containing each term, in ascending order.
+     */
+    std::unordered_map<std::string, std::vector<uint32_t> > postings;
+
+    /**
+     * The keys matching the most recent query, and the query and
+     * generation they were found with.
+     */
+    std::string last_terms;
+    unsigned int last_generation;
+    std::unordered_set<std::string> last_keys;
+
+    /**
+     * The mtimes of cur/ and new/, and when they were last listed, so
+     * the directories are only read again when they change.
+     */
+    time_t cur_mtime;
+    time_t new_mtime;
+    time_t listed;
+
+    /**
+     * The current paths of the documents being indexed in the background,
+     * by key.
+     */
+    std::unordered_map<std::string, std::string> queued;
+};
+
+
+/**
+ * A message to be indexed by a worker, and the words it contains.
+ *
+ * The settings are copied by the main thread, as the workers can't
+ * consult the Lua state, or the global variables.
+ */
+struct CSearchDocument
+{
+    std::string maildir;
+    std::string key;
+    std::string path;
+
+    /**
+     * The `mail_filter`, if any, and whether it applies to the headers.
+     */
+    std::string mail_filter;
+    bool filter_headers;
+    int timeout;
+
+    /**
+     * The words found, sorted and unique.  If the message couldn't be
+     * read then failed is set instead.
+     */
+    std::vector<std::string> words;
+    bool failed;
+};
+
+
+/**
+ * Singleton class which maintains a full-text index of the headers and
+ * bodies of messages.
+ *
+ * Each maildir is indexed on first use, and then incrementally, as
+ * messages arrive and are removed.  If a cache directory is set the
+ * index is saved there, alongside the header cache.
+ *
+ * Messages are read, and split into words, by a pool of worker threads,
+ * and the main thread merges their results into the index.  Only an
+ * explicit search() waits for them; limits use what's indexed so far,
+ * and are re-applied once the index is complete.
+ */
+class CSearchIndex
+{
+
+public:
+
+    /**
+     * Get access to the singleton instance.
+     */
+    static CSearchIndex *Instance();
+
+    /**
+     * Set the directory to store index-files within.
+     */
+    void set_directory( std::string path );
+
+    /**
+     * Bring the index of the given maildir up to date, if its directories
+     * have changed.  New messages are indexed in the background.
+     */
+    void update( std::string maildir );
+
+    /**
+     * Merge any messages indexed in the background into the index.
+     *
+     * Returns true once everything queued has been read, whether or not
+     * it could be, so that limits using the index can be re-applied.
+     */
+    bool publish();
+
+    /**
+     * Wait for the background indexing to complete, and merge it.
+     */
+    void wait();
+
+    /**
+     * Are messages being indexed in the background?
+     */
+    bool busy();
+
+    /**
+     * Return the paths of the messages in the given maildir which contain
+     * all of the words in the given terms.
+     */
+    std::vector<std::string> search( std::string maildir, std::string terms );
+
+    /**
+     * Does the message with the given path contain all of the words in
+     * the given terms?
+     *
+     * The results are cached, so this is cheap to call for every message
+     * in a folder.
+     */
+    bool matches( std::string path, std::string terms );
+
+    /**
+     * Write any changed indexes to disk.
+     */
+    void save();
+
+    /**
+     * Split the given text into lower-case words.
+     */
+    static std::vector<std::string> tokenize( const std::string &text );
+
+protected:
+
+    /**
+     * Protected functions to allow our singleton implementation.
+     */
+    CSearchIndex();
+    CSearchIndex(const CSearchIndex &);
+    CSearchIndex & operator=(const CSearchIndex &);
+
+private:
+
+    /**
+     * Split a message path into its maildir, and document key.
+     */
+    bool split_path( std::string path, std::string &maildir, std::string &key );
+
+    /**
+     * Find the index of the given maildir, loading it if required.
+     */
+    CSearchFolder *folder( std::string maildir );
+
+    /**
+     * Have the cur/ or new/ directories of the given maildir changed
+     * since they were last listed?
+     */
+    bool changed( std::string maildir, CSearchFolder &index );
+
+    /**
+     * Queue the given message to be indexed in the background.
+     */
+    void queue( std::string maildir, CSearchFolder &index, std::string key, std::string path );
+
+    /**
+     * Add the given document to the index, with the given path.
+     */
+    void add( CSearchFolder &index, const CSearchDocument &document, std::string path );
+
+    /**
+     * Read the given message, and find the words within it.
+     *
+     * NOTE: This is called from the workers, so must not touch any
+     * shared state.
+     */
+    static void read_document( CSearchDocument &document );
+
+    /**
+     * Merge the completed documents into the index, saving it if nothing
+     * else is queued.  Returns true if nothing else is.
+     */
+    bool merge();
+
+    /**
+     * The body of each worker thread.
+     */
+    void run();
+
+    /**
+     * Find the ids of the documents containing all the given terms.
+     */
+    std::vector<uint32_t> lookup( CSearchFolder &index, std::string terms );
+
+    /**
+     * Drop removed documents, renumbering those which remain.
+     */
+    void compact( CSearchFolder &index );
+
+    /**
+     * The file which stores the index of the given maildir.
+     */
+    std::string index_file( std::string maildir );
+
+    /**
+     * Load, and save, the index of a single maildir.
+     */
+    void load( std::string maildir, CSearchFolder &index );
+    void save( std::string maildir, CSearchFolder &index );
+
+    /**
+     * The single instance of this class.
+     */
+    static CSearchIndex *pinstance;
+
+    /**
+     * The directory holding the index-files, empty if not persistent.
+     */
+    std::string m_directory;
+
+    /**
+     * The indexes we've loaded, keyed by maildir path.
+     */
+    std::unordered_map<std::string, CSearchFolder> m_folders;
+
+    /**
+     * The worker threads, started on first use.
+     */
+    std::vector<std::thread> m_threads;
+
+    /**
+     * Protects the queued, and completed, documents, and the busy-count.
+     */
+    std::mutex m_lock;
+
+    /**
+     * Signalled when documents are queued, and when they're completed.
+     */
+    std::condition_variable m_work;
+    std::condition_variable m_results_ready;
+
+    /**
+     * Documents waiting to be read, and those which have been.
+     */
+    std::deque<CSearchDocument> m_jobs;
+    std::vector<CSearchDocument> m_done;
+
+    /**
+     * The number of workers currently reading a document.
+     */
+    int m_active;
+
+    /**
+     * Have documents been merged since publish() last returned true?
+     */
+    bool m_merged;
+
+};
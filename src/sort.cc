@@ -0,0 +1,180 @@
+/**
+ * sort.cc - Compiled sort-orders for the message index.
+ *
+ * This file is part of lumail: http://lumail.org/
+ *
+ * Copyright (c) 2013-2014 by Steve Kemp.  All rights reserved.
+ *
+ **
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 dated June, 1991, or (at your
+ * option) any later version.
+ *
+ * On Debian GNU/Linux systems, the complete text of version 2 of the GNU
+ * General Public License can be found in `/usr/share/common-licenses/GPL-2'
+ */
+
+#include <algorithm>
+#include <ctype.h>
+
+#include "sort.h"
+
+
+/**
+ * Compare a single field of two records.
+ */
+static int compare_field( TSortField field, const CSortRecord &a, const CSortRecord &b )
+{
+    switch( field )
+    {
+    case SORT_MTIME:
+        return( ( a.mtime < b.mtime ) ? -1 : ( a.mtime > b.mtime ) ? 1 : 0 );
+    case SORT_DATE_HEADER:
+        return( ( a.date < b.date ) ? -1 : ( a.date > b.date ) ? 1 : 0 );
+    case SORT_SUBJECT:
+        return( a.subject.compare( b.subject ) );
+    case SORT_FROM:
+        return( a.from.compare( b.from ) );
+    }
+    return 0;
+}
+
+
+/**
+ * Compile the given specification.
+ */
+CSortOrder::CSortOrder( const std::string &spec )
+{
+    m_count = 0;
+
+    std::string value = spec.empty() ? "date-asc" : spec;
+    size_t pos = 0;
+
+    while( pos <= value.size() )
+    {
+        size_t comma = value.find( ',', pos );
+        if ( comma == std::string::npos )
+            comma = value.size();
+
+        std::string token = value.substr( pos, comma - pos );
+        pos = comma + 1;
+
+        /**
+         * Trim any whitespace.
+         */
+        size_t first = token.find_first_not_of( " \t" );
+        size_t last  = token.find_last_not_of( " \t" );
+        if ( first == std::string::npos )
+            continue;
+        token = token.substr( first, last - first + 1 );
+
+        /**
+         * Strip the direction.
+         */
+        bool descending = false;
+        size_t dash = token.rfind( '-' );
+        if ( dash != std::string::npos )
+        {
+            std::string dir = token.substr( dash + 1 );
+            if ( dir == "desc" )
+                descending = true;
+            else if ( dir != "asc" )
+                continue;
+            token = token.substr( 0, dash );
+        }
+
+        CSortKey key;
+        key.descending = descending;
+
+        if ( token == "date" )
+            key.field = SORT_MTIME;
+        else if ( token == "header" )
+            key.field = SORT_DATE_HEADER;
+        else if ( token == "subject" )
+            key.field = SORT_SUBJECT;
+        else if ( token == "from" )
+            key.field = SORT_FROM;
+        else
+            continue;
+
+        /**
+         * A repeated field can never break a tie, so ignore it.
+         */
+        if ( uses( key.field ) )
+            continue;
+
+        m_keys[m_count++] = key;
+    }
+}
+
+
+/**
+ * Is the given field used by this order?
+ */
+bool CSortOrder::uses( TSortField field ) const
+{
+    for( size_t i = 0; i < m_count; i++ )
+    {
+        if ( m_keys[i].field == field )
+            return true;
+    }
+    return false;
+}
+
+
+/**
+ * Does this order need the headers of the messages?
+ */
+bool CSortOrder::needs_headers() const
+{
+    return( uses( SORT_DATE_HEADER ) || uses( SORT_SUBJECT ) || uses( SORT_FROM ) );
+}
+
+
+/**
+ * Stable-sort the records.
+ */
+void CSortOrder::sort( std::vector<CSortRecord> &records, size_t sorted ) const
+{
+    /**
+     * Without any valid keys everything is equal, so leave the order
+     * alone.
+     */
+    if ( m_count == 0 )
+        return;
+
+    sorted = std::min( sorted, records.size() );
+
+    std::stable_sort( records.begin() + sorted, records.end(), *this );
+
+    if ( sorted > 0 )
+        std::inplace_merge( records.begin(), records.begin() + sorted, records.end(), *this );
+}
+
+
+/**
+ * Compare two records, returning true if a sorts before b.
+ */
+bool CSortOrder::operator()( const CSortRecord &a, const CSortRecord &b ) const
+{
+    for( size_t i = 0; i < m_count; i++ )
+    {
+        int ret = compare_field( m_keys[i].field, a, b );
+        if ( ret != 0 )
+            return( m_keys[i].descending ? ( ret > 0 ) : ( ret < 0 ) );
+    }
+    return false;
+}
+
+
+/**
+ * Case-fold a header value for sorting.
+ */
+std::string CSortOrder::fold( const std::string &value )
+{
+    std::string result = value;
+    std::transform( result.begin(), result.end(), result.begin(), tolower );
+    return( result );
+}
@@ -0,0 +1,132 @@
+/**
+ * sort.h - Compiled sort-orders for the message index.
+ *
+ * This file is part of lumail: http://lumail.org/
+ *
+ * Copyright (c) 2013-2014 by Steve Kemp.  All rights reserved.
+ *
+ **
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 dated June, 1991, or (at your
+ * option) any later version.
+ *
+ * On Debian GNU/Linux systems, the complete text of version 2 of the GNU
+ * General Public License can be found in `/usr/share/common-licenses/GPL-2'
+ */
+
+#pragma once
+
+#include <string>
+#include <time.h>
+#include <vector>
+
+
+/**
+ * The fields a message may be sorted by.
+ */
+enum TSortField
+{
+    SORT_MTIME,
+    SORT_DATE_HEADER,
+    SORT_SUBJECT,
+    SORT_FROM
+};
+
+
+/**
+ * The sort-keys of a single message, computed once before sorting.
+ *
+ * Only the fields used by the sort-order are populated.
+ */
+struct CSortRecord
+{
+    /**
+     * The offset of the message in the list being sorted.
+     */
+    size_t index;
+
+    /**
+     * The modification time of the file, and the parsed Date: header.
+     */
+    time_t mtime;
+    time_t date;
+
+    /**
+     * The case-folded Subject: and From: headers.
+     */
+    std::string subject;
+    std::string from;
+};
+
+
+/**
+ * A single key of a sort-order.
+ */
+struct CSortKey
+{
+    TSortField field;
+    bool descending;
+};
+
+
+/**
+ * A sort-order, compiled from the value of the `sort` variable.
+ *
+ * The value is a comma-separated list of keys, each of which is one of
+ * "date", "header", "subject", or "from", optionally suffixed with "-asc"
+ * or "-desc".  For example "from,date-desc".
+ *
+ * This deliberately knows nothing of CMessage, so that it may be tested
+ * and benchmarked standalone.
+ */
+class CSortOrder
+{
+
+public:
+
+    /**
+     * Compile the given specification.  An empty specification is the
+     * same as "date-asc".
+     */
+    CSortOrder( const std::string &spec );
+
+    /**
+     * Is the given field used by this order?
+     */
+    bool uses( TSortField field ) const;
+
+    /**
+     * Does this order need the headers of the messages?
+     */
+    bool needs_headers() const;
+
+    /**
+     * Stable-sort the records.
+     *
+     * The first `sorted` records are assumed to be in order already, so
+     * only the remainder are sorted, and then merged with them.
+     */
+    void sort( std::vector<CSortRecord> &records, size_t sorted = 0 ) const;
+
+    /**
+     * Compare two records, returning true if a sorts before b.
+     */
+    bool operator()( const CSortRecord &a, const CSortRecord &b ) const;
+
+    /**
+     * Case-fold a header value for sorting.
+     */
+    static std::string fold( const std::string &value );
+
+private:
+
+    /**
+     * The keys, most significant first.  There are only four fields, so
+     * this is a fixed array, which keeps the comparator cheap to copy.
+     */
+    CSortKey m_keys[4];
+    size_t m_count;
+
+};
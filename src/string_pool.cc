@@ -0,0 +1,102 @@
+/**
+ * string_pool.cc - A pool of shared, immutable, strings.
+ *
+ * This file is part of lumail: http://lumail.org/
+ *
+ * Copyright (c) 2013-2014 by Steve Kemp.  All rights reserved.
+ *
+ **
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 dated June, 1991, or (at your
+ * option) any later version.
+ *
+ * On Debian GNU/Linux systems, the complete text of version 2 of the GNU
+ * General Public License can be found in `/usr/share/common-licenses/GPL-2'
+ */
+
+#include <string>
+#include <unordered_set>
+
+#include "string_pool.h"
+
+
+/**
+ * Instance-handle.
+ */
+CStringPool *CStringPool::pinstance = NULL;
+
+
+/**
+ * Get access to our singleton-object.
+ */
+CStringPool *CStringPool::Instance()
+{
+    if (!pinstance)
+        pinstance = new CStringPool;
+
+    return pinstance;
+}
+
+
+/**
+ * Constructor - This is private as this class is a singleton.
+ */
+CStringPool::CStringPool()
+{
+    m_bytes = 0;
+}
+
+
+/**
+ * Return the pooled copy of the given string.
+ */
+const std::string *CStringPool::intern( const std::string &value )
+{
+    std::unordered_set<std::string>::iterator it = m_strings.find( value );
+    if ( it == m_strings.end() )
+    {
+        it = m_strings.insert( value ).first;
+
+        /**
+         * Account for the node, and any heap-storage of the string.
+         */
+        m_bytes += sizeof( std::string ) + sizeof( void * ) * 2 + heap_size( *it );
+    }
+
+    return( &(*it) );
+}
+
+
+/**
+ * The number of distinct strings held.
+ */
+size_t CStringPool::count()
+{
+    return( m_strings.size() );
+}
+
+
+/**
+ * The approximate number of bytes used by the pool.
+ */
+size_t CStringPool::bytes()
+{
+    return( m_bytes + m_strings.bucket_count() * sizeof( void * ) );
+}
+
+
+/**
+ * The number of bytes the given string has allocated on the heap.
+ */
+size_t CStringPool::heap_size( const std::string &value )
+{
+    const char *data  = value.data();
+    const char *start = (const char *) &value;
+
+    if ( ( data >= start ) && ( data < start + sizeof( std::string ) ) )
+        return 0;
+
+    return( value.capacity() + 1 );
+}
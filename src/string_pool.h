@@ -0,0 +1,98 @@
+/**
+ * string_pool.h - A pool of shared, immutable, strings.
+ *
+ * This file is part of lumail: http://lumail.org/
+ *
+ * Copyright (c) 2013-2014 by Steve Kemp.  All rights reserved.
+ *
+ **
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 dated June, 1991, or (at your
+ * option) any later version.
+ *
+ * On Debian GNU/Linux systems, the complete text of version 2 of the GNU
+ * General Public License can be found in `/usr/share/common-licenses/GPL-2'
+ */
+
+#pragma once
+
+#include <string>
+#include <unordered_set>
+
+
+/**
+ * Singleton class which holds a single copy of each distinct string it
+ * is given.
+ *
+ * Very large folders repeat the same values over and over: every message
+ * in a maildir shares the path of that maildir, and most share a handful
+ * of senders, recipients, and thread-subjects.  Storing a pointer to a
+ * pooled copy, rather than a string, saves both the memory and the
+ * allocations.
+ *
+ * Strings are never released, so the pool only grows as new values are
+ * seen.  It must only be used from the main thread.
+ */
+class CStringPool
+{
+
+public:
+
+    /**
+     * Get access to the singleton instance.
+     */
+    static CStringPool *Instance();
+
+    /**
+     * Return the pooled copy of the given string, adding it if required.
+     *
+     * The result remains valid for the lifetime of the program.
+     */
+    const std::string *intern( const std::string &value );
+
+    /**
+     * The number of distinct strings held.
+     */
+    size_t count();
+
+    /**
+     * The approximate number of bytes used by the pool.
+     */
+    size_t bytes();
+
+    /**
+     * The number of bytes the given string has allocated on the heap,
+     * which is zero for short strings held within the object itself.
+     */
+    static size_t heap_size( const std::string &value );
+
+protected:
+
+    /**
+     * Protected functions to allow our singleton implementation.
+     */
+    CStringPool();
+    CStringPool(const CStringPool &);
+    CStringPool & operator=(const CStringPool &);
+
+private:
+
+    /**
+     * The single instance of this class.
+     */
+    static CStringPool *pinstance;
+
+    /**
+     * The strings.  Elements of an unordered_set never move, so their
+     * addresses are stable.
+     */
+    std::unordered_set<std::string> m_strings;
+
+    /**
+     * The total capacity of the strings held.
+     */
+    size_t m_bytes;
+
+};
@@ -33,9 +33,12 @@
 
 #include "debug.h"
 #include "file.h"
+#include "filter.h"
 #include "global.h"
+#include "header_cache.h"
 #include "history.h"
 #include "maildir.h"
+#include "search_index.h"
 #include "util.h"
 #include "variables.h"
 
@@ -262,6 +265,33 @@ int global_mode(lua_State * L)
     return( ret );
 }
 
+/**
+ * Get, or set, the directory to cache message-headers within.
+ */
+int cache_directory(lua_State *L )
+{
+    /**
+     * This is valid only if we're setting the value.
+     */
+    const char *str = lua_tostring(L, 1);
+
+    int ret = get_set_string_variable( L, "cache_directory" );
+
+    /**
+     * Update the cache location.
+     */
+    if ( str != NULL )
+    {
+        CHeaderCache *cache = CHeaderCache::Instance();
+        cache->set_directory( str );
+
+        CSearchIndex::Instance()->set_directory( str );
+        CFilter::Instance()->set_directory( str );
+    }
+
+    return( ret );
+}
+
 /**
  * Get, or set, the history persistance file.
  */
@@ -0,0 +1,362 @@
+/**
+ * walker.cc - Find maildirs beneath a directory, in parallel.
+ *
+ * This file is part of lumail: http://lumail.org/
+ *
+ * Copyright (c) 2013-2014 by Steve Kemp.  All rights reserved.
+ *
+ **
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 dated June, 1991, or (at your
+ * option) any later version.
+ *
+ * On Debian GNU/Linux systems, the complete text of version 2 of the GNU
+ * General Public License can be found in `/usr/share/common-licenses/GPL-2'
+ */
+
+#include <algorithm>
+#include <dirent.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+#include "debug.h"
+#include "walker.h"
+
+
+/**
+ * Is the named child of the open directory a directory itself?
+ */
+static bool is_subdirectory( int dfd, const char *name )
+{
+    struct stat sb;
+
+    if ( fstatat( dfd, name, &sb, 0 ) != 0 )
+        return false;
+
+    return( S_ISDIR( sb.st_mode ) );
+}
+
+
+/**
+ * Is the named child of the open directory a maildir?
+ *
+ * The name may be "." to test the directory itself.
+ */
+static bool is_maildir_at( int dfd, const char *name )
+{
+    const char *subdirs[] = { "/cur", "/new", "/tmp" };
+
+    for( const char *sub : subdirs )
+    {
+        std::string path = std::string(name) + sub;
+        if ( !is_subdirectory( dfd, path.c_str() ) )
+            return false;
+    }
+    return true;
+}
+
+
+/**
+ * Constructor.
+ */
+CMaildirWalker::CMaildirWalker( int max_depth,
+                                std::vector<std::string> ignored,
+                                std::vector<std::string> pruned )
+{
+    m_max_depth = max_depth;
+
+    /**
+     * Fetch the compiled expressions once, rather than per-directory.
+     */
+    for (std::string reg : ignored)
+    {
+        if ( !reg.empty() )
+            m_ignored.push_back( CRegexCache::Instance()->get( reg ) );
+    }
+    for (std::string reg : pruned)
+    {
+        if ( !reg.empty() )
+            m_pruned.push_back( CRegexCache::Instance()->get( reg ) );
+    }
+}
+
+
+/**
+ * Return a sorted list of maildirs beneath the given prefix.
+ */
+std::vector<std::string> CMaildirWalker::walk( std::string prefix )
+{
+    std::vector<std::string> result;
+
+    prefix = prefix.empty()? "." : prefix;
+
+    /**
+     * Network filesystems reward having many requests in flight, so
+     * use more threads than we have cores.
+     */
+    size_t count = std::thread::hardware_concurrency() * 2;
+    count = std::max( count, (size_t) 2 );
+    count = std::min( count, (size_t) 32 );
+
+    m_workers.clear();
+    for( size_t i = 0; i < count; i++ )
+        m_workers.push_back( std::shared_ptr<CWalkWorker>( new CWalkWorker() ) );
+
+    m_pending = 0;
+    m_queued  = 0;
+    push( 0, prefix, 0 );
+
+    /**
+     * Start the workers, and wait for them to drain the queues.
+     */
+    std::vector<std::thread> threads;
+    for( size_t i = 0; i < count; i++ )
+        threads.push_back( std::thread( &CMaildirWalker::run, this, i ) );
+
+    for( std::thread &t : threads )
+        t.join();
+
+    /**
+     * Merge the results.
+     */
+    for( std::shared_ptr<CWalkWorker> worker : m_workers )
+        result.insert( result.end(), worker->found.begin(), worker->found.end() );
+
+    m_workers.clear();
+
+    std::sort(result.begin(), result.end());
+
+#ifdef LUMAIL_DEBUG
+    char dm[256] = { '\0' };
+    snprintf( dm, sizeof(dm)-1, "CMaildirWalker::walk(%s) - found %zu maildirs with %zu threads",
+              prefix.c_str(), result.size(), count );
+    DEBUG_LOG( dm );
+#endif
+
+    return( result );
+}
+
+
+/**
+ * The body of each worker thread.
+ */
+void CMaildirWalker::run( size_t id )
+{
+    while( true )
+    {
+        CWalkItem item;
+
+        if ( next( id, item ) )
+        {
+            scan( id, item );
+
+            /**
+             * Any children have already been queued, so when this reaches
+             * zero there is nothing left to do anywhere.
+             */
+            if ( --m_pending == 0 )
+                wake( true );
+            continue;
+        }
+
+        /**
+         * Nothing to steal right now, but other workers are still
+         * busy and may queue more.  Sleep until they do, or until
+         * everything is finished.
+         */
+        std::unique_lock<std::mutex> lock( m_idle_lock );
+        while( ( m_queued == 0 ) && ( m_pending != 0 ) )
+            m_idle.wait( lock );
+
+        if ( m_pending == 0 )
+            return;
+    }
+}
+
+
+/**
+ * Fetch the next directory to scan.
+ */
+bool CMaildirWalker::next( size_t id, CWalkItem &item )
+{
+    /**
+     * Take the most recently queued item from our own queue, which
+     * keeps our walk depth-first, and cache-friendly.
+     */
+    {
+        CWalkWorker &self = *m_workers[id];
+        std::lock_guard<std::mutex> lock( self.lock );
+        if ( !self.queue.empty() )
+        {
+            item = self.queue.back();
+            self.queue.pop_back();
+            --m_queued;
+            return true;
+        }
+    }
+
+    /**
+     * Otherwise steal the oldest item from somebody else, which is
+     * likely to be nearest the root, and so the largest piece of work.
+     */
+    for( size_t i = 1; i < m_workers.size(); i++ )
+    {
+        CWalkWorker &victim = *m_workers[( id + i ) % m_workers.size()];
+        std::lock_guard<std::mutex> lock( victim.lock );
+        if ( !victim.queue.empty() )
+        {
+            item = victim.queue.front();
+            victim.queue.pop_front();
+            --m_queued;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+/**
+ * Scan a single directory.
+ */
+void CMaildirWalker::scan( size_t id, CWalkItem &item )
+{
+    int dfd = open( item.path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+    if ( dfd < 0 )
+        return;
+
+    /**
+     * The prefix itself may be a maildir, in which case we still look
+     * beneath it, but skip its own cur/, new/, and tmp/.
+     */
+    bool root_maildir = false;
+    if ( item.depth == 0 && is_maildir_at( dfd, "." ) )
+    {
+        root_maildir = true;
+        if ( !matches( m_ignored, item.path ) )
+            m_workers[id]->found.push_back( item.path );
+    }
+
+    /**
+     * If we're at the maximum depth then our children are too deep.
+     */
+    if ( ( m_max_depth > 0 ) && ( item.depth >= m_max_depth ) )
+    {
+        close( dfd );
+        return;
+    }
+
+    DIR *dp = fdopendir( dfd );
+    if ( dp == NULL )
+    {
+        close( dfd );
+        return;
+    }
+
+    struct dirent *de;
+    while( ( de = readdir( dp ) ) != NULL )
+    {
+        const char *name = de->d_name;
+
+        if ( ( strcmp( name, "." ) == 0 ) || ( strcmp( name, ".." ) == 0 ) )
+            continue;
+
+        /**
+         * Use the type from the directory entry if we have it, which
+         * avoids a stat() for every plain file.
+         */
+        if ( de->d_type == DT_UNKNOWN )
+        {
+            if ( !is_subdirectory( dfd, name ) )
+                continue;
+        }
+        else if ( de->d_type != DT_DIR )
+            continue;
+
+        if ( root_maildir &&
+             ( ( strcmp( name, "cur" ) == 0 ) ||
+               ( strcmp( name, "new" ) == 0 ) ||
+               ( strcmp( name, "tmp" ) == 0 ) ) )
+            continue;
+
+        std::string path = item.path + "/" + name;
+
+        if ( matches( m_pruned, path ) )
+            continue;
+
+        if ( is_maildir_at( dfd, name ) )
+        {
+            if ( !matches( m_ignored, path ) )
+                m_workers[id]->found.push_back( path );
+        }
+        else
+        {
+            push( id, path, item.depth + 1 );
+        }
+    }
+
+    closedir( dp );
+}
+
+
+/**
+ * Queue a directory for scanning.
+ */
+void CMaildirWalker::push( size_t id, std::string path, int depth )
+{
+    CWalkItem item;
+    item.path  = path;
+    item.depth = depth;
+
+    /**
+     * Count the item as pending before it is visible to other workers,
+     * otherwise one of them could take it, and finish it, while the
+     * count is still zero.
+     */
+    ++m_pending;
+
+    {
+        CWalkWorker &self = *m_workers[id];
+        std::lock_guard<std::mutex> lock( self.lock );
+        self.queue.push_back( item );
+    }
+
+    ++m_queued;
+    wake( false );
+}
+
+
+/**
+ * Wake one, or all, idle workers.
+ *
+ * The lock is taken so that a worker which has just found nothing to do
+ * cannot miss the change, between testing the counts and sleeping.
+ */
+void CMaildirWalker::wake( bool all )
+{
+    std::lock_guard<std::mutex> lock( m_idle_lock );
+
+    if ( all )
+        m_idle.notify_all();
+    else
+        m_idle.notify_one();
+}
+
+
+/**
+ * Does the given path match any of the expressions?
+ */
+bool CMaildirWalker::matches( const std::vector<std::shared_ptr<CRegex> > &list, const std::string &path )
+{
+    for( std::shared_ptr<CRegex> re : list )
+    {
+        if ( re->matches( path ) )
+            return true;
+    }
+    return false;
+}
@@ -0,0 +1,159 @@
+/**
+ * walker.h - Find maildirs beneath a directory, in parallel.
+ *
+ * This file is part of lumail: http://lumail.org/
+ *
+ * Copyright (c) 2013-2014 by Steve Kemp.  All rights reserved.
+ *
+ **
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 dated June, 1991, or (at your
+ * option) any later version.
+ *
+ * On Debian GNU/Linux systems, the complete text of version 2 of the GNU
+ * General Public License can be found in `/usr/share/common-licenses/GPL-2'
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "regex_cache.h"
+
+
+/**
+ * A directory which is waiting to be scanned.
+ */
+struct CWalkItem
+{
+    /**
+     * The path to the directory.
+     */
+    std::string path;
+
+    /**
+     * How far beneath the prefix the directory is.
+     */
+    int depth;
+};
+
+
+/**
+ * The state of a single worker: its queue of pending directories,
+ * and the maildirs it has found.
+ */
+struct CWalkWorker
+{
+    std::mutex lock;
+    std::deque<CWalkItem> queue;
+    std::vector<std::string> found;
+};
+
+
+/**
+ * Find all the maildirs beneath a prefix.
+ *
+ * The directory tree is scanned by a pool of threads, each of which
+ * owns a queue of directories to scan.  Subdirectories are pushed onto
+ * the queue of the thread which found them, and idle threads steal work
+ * from the other end of their neighbours' queues.  This keeps many
+ * directory-reads in flight at once, which matters on network filesystems.
+ *
+ * Children are examined relative to an open directory-handle, via fstatat(),
+ * rather than by building and resolving full paths.
+ */
+class CMaildirWalker
+{
+
+public:
+
+    /**
+     * Constructor.
+     *
+     * max_depth limits how far beneath the prefix we look, (zero or
+     * negative for no limit).
+     *
+     * Maildirs matching any of the ignored regular expressions are not
+     * returned, and directories matching any of the pruned expressions
+     * are not returned or descended into.
+     */
+    CMaildirWalker( int max_depth = 0,
+                    std::vector<std::string> ignored = std::vector<std::string>(),
+                    std::vector<std::string> pruned = std::vector<std::string>() );
+
+    /**
+     * Return a sorted list of maildirs beneath the given prefix.
+     */
+    std::vector<std::string> walk( std::string prefix );
+
+private:
+
+    /**
+     * The body of each worker thread.
+     */
+    void run( size_t id );
+
+    /**
+     * Fetch the next directory to scan, from our own queue or by
+     * stealing from another worker.
+     */
+    bool next( size_t id, CWalkItem &item );
+
+    /**
+     * Scan a single directory.
+     */
+    void scan( size_t id, CWalkItem &item );
+
+    /**
+     * Queue a directory for scanning.
+     */
+    void push( size_t id, std::string path, int depth );
+
+    /**
+     * Wake idle workers.
+     */
+    void wake( bool all );
+
+    /**
+     * Does the given path match any of the expressions?
+     */
+    bool matches( const std::vector<std::shared_ptr<CRegex> > &list, const std::string &path );
+
+    /**
+     * Our settings.
+     */
+    int m_max_depth;
+    std::vector<std::shared_ptr<CRegex> > m_ignored;
+    std::vector<std::shared_ptr<CRegex> > m_pruned;
+
+    /**
+     * The workers.
+     */
+    std::vector<std::shared_ptr<CWalkWorker> > m_workers;
+
+    /**
+     * The number of directories queued, or being scanned.
+     */
+    std::atomic<int> m_pending;
+
+    /**
+     * The number of directories queued, but not yet taken by a worker.
+     */
+    std::atomic<int> m_queued;
+
+    /**
+     * Used to wake idle workers when new work is queued, or the
+     * walk is complete.
+     */
+    std::mutex m_idle_lock;
+    std::condition_variable m_idle;
+
+};
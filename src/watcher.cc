@@ -0,0 +1,269 @@
+/**
+ * watcher.cc - Watch maildirs for changes, via inotify.
+ *
+ * This file is part of lumail: http://lumail.org/
+ *
+ * Copyright (c) 2013-2014 by Steve Kemp.  All rights reserved.
+ *
+ **
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 dated June, 1991, or (at your
+ * option) any later version.
+ *
+ * On Debian GNU/Linux systems, the complete text of version 2 of the GNU
+ * General Public License can be found in `/usr/share/common-licenses/GPL-2'
+ */
+
+#include <errno.h>
+#include <string>
+#include <unistd.h>
+
+#ifdef INOTIFY
+#include <sys/inotify.h>
+#endif
+
+#include "debug.h"
+#include "maildir.h"
+#include "watcher.h"
+
+
+/**
+ * Instance-handle.
+ */
+CWatcher *CWatcher::pinstance = NULL;
+
+
+/**
+ * Get access to our singleton-object.
+ */
+CWatcher *CWatcher::Instance()
+{
+    if (!pinstance)
+        pinstance = new CWatcher;
+
+    return pinstance;
+}
+
+
+/**
+ * Constructor - This is private as this class is a singleton.
+ */
+CWatcher::CWatcher()
+{
+    m_fd        = -1;
+    m_unwatched = 0;
+}
+
+
+/**
+ * Start watching the given maildir.
+ */
+void CWatcher::watch( std::shared_ptr<CMaildir> maildir )
+{
+#ifdef INOTIFY
+
+    if ( m_fd < 0 )
+    {
+        m_fd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+        if ( m_fd < 0 )
+        {
+            DEBUG_LOG( "CWatcher::watch - inotify_init1 failed" );
+            m_unwatched += 1;
+            return;
+        }
+    }
+
+    /**
+     * The maildir only trusts its counts if both directories
+     * are being watched.  If only one could be, drop it, or its events
+     * would adjust counts which are being recalculated anyway.
+     */
+    int cur = add_watch( maildir, false );
+    int nw  = ( cur >= 0 ) ? add_watch( maildir, true ) : -1;
+
+    if ( nw >= 0 )
+    {
+        maildir->set_watched( true );
+    }
+    else
+    {
+        if ( cur >= 0 )
+        {
+            inotify_rm_watch( m_fd, cur );
+            m_watches.erase( cur );
+        }
+        m_unwatched += 1;
+    }
+
+#else
+    (void)maildir;
+    m_unwatched += 1;
+#endif
+}
+
+
+/**
+ * Stop watching all maildirs.
+ */
+void CWatcher::clear()
+{
+    /**
+     * Closing the descriptor drops all the watches at once, which is
+     * much cheaper than removing thousands individually.
+     */
+    if ( m_fd >= 0 )
+    {
+        close( m_fd );
+        m_fd = -1;
+    }
+
+    for( auto &watch : m_watches )
+        watch.second.maildir->set_watched( false );
+
+    m_watches.clear();
+    m_unwatched = 0;
+}
+
+
+/**
+ * Are all the maildirs we've been given being watched?
+ */
+bool CWatcher::watching_all()
+{
+    return( m_unwatched == 0 );
+}
+
+
+/**
+ * The descriptor which becomes readable when events are pending.
+ */
+int CWatcher::fd()
+{
+    return( m_fd );
+}
+
+
+/**
+ * Process any pending events, without blocking.
+ */
+bool CWatcher::process_events()
+{
+    bool changed = false;
+
+#ifdef INOTIFY
+
+    if ( m_fd < 0 )
+        return false;
+
+    /**
+     * Aligned buffer, as recommended by inotify(7).
+     */
+    char buf[16384] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    while( true )
+    {
+        ssize_t len = read( m_fd, buf, sizeof(buf) );
+        if ( len <= 0 )
+            break;
+
+        for( char *ptr = buf; ptr < buf + len; )
+        {
+            struct inotify_event *event = (struct inotify_event *) ptr;
+            ptr += sizeof(struct inotify_event) + event->len;
+
+            /**
+             * If we lost events then all counts must be recalculated.
+             */
+            if ( event->mask & IN_Q_OVERFLOW )
+            {
+                DEBUG_LOG( "CWatcher::process_events - queue overflow" );
+                for( auto &watch : m_watches )
+                    watch.second.maildir->invalidate();
+                changed = true;
+                continue;
+            }
+
+            std::unordered_map<int, CWatchedDirectory>::iterator it = m_watches.find( event->wd );
+            if ( it == m_watches.end() )
+                continue;
+
+            std::shared_ptr<CMaildir> maildir = it->second.maildir;
+            bool is_new = it->second.is_new;
+
+            /**
+             * The directory itself went away.  Stop watching its sibling
+             * too, as the maildir's counts are no longer maintained.
+             */
+            if ( event->mask & IN_IGNORED )
+            {
+                maildir->set_watched( false );
+                maildir->invalidate();
+                m_watches.erase( it );
+                m_unwatched += 1;
+                changed = true;
+
+                for( auto &watch : m_watches )
+                {
+                    if ( watch.second.maildir == maildir )
+                    {
+                        inotify_rm_watch( m_fd, watch.first );
+                        m_watches.erase( watch.first );
+                        break;
+                    }
+                }
+                continue;
+            }
+
+            if ( ( event->len == 0 ) || ( event->mask & IN_ISDIR ) )
+                continue;
+
+            if ( event->mask & ( IN_CREATE | IN_MOVED_TO ) )
+            {
+                maildir->message_added( event->name, is_new );
+                changed = true;
+            }
+            if ( event->mask & ( IN_DELETE | IN_MOVED_FROM ) )
+            {
+                maildir->message_removed( event->name, is_new );
+                changed = true;
+            }
+        }
+    }
+
+#endif
+
+    return( changed );
+}
+
+
+/**
+ * Add a watch for a single directory.
+ */
+int CWatcher::add_watch( std::shared_ptr<CMaildir> maildir, bool is_new )
+{
+#ifdef INOTIFY
+
+    std::string path = maildir->path() + ( is_new ? "/new" : "/cur" );
+
+    int wd = inotify_add_watch( m_fd, path.c_str(),
+                                IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR );
+    if ( wd < 0 )
+    {
+        DEBUG_LOG( "CWatcher::add_watch - failed to watch " + path );
+        return -1;
+    }
+
+    CWatchedDirectory &watched = m_watches[wd];
+    watched.maildir = maildir;
+    watched.is_new  = is_new;
+
+    return wd;
+
+#else
+    (void)maildir;
+    (void)is_new;
+    return -1;
+#endif
+}
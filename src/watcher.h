@@ -0,0 +1,136 @@
+/**
+ * watcher.h - Watch maildirs for changes, via inotify.
+ *
+ * This file is part of lumail: http://lumail.org/
+ *
+ * Copyright (c) 2013-2014 by Steve Kemp.  All rights reserved.
+ *
+ **
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 dated June, 1991, or (at your
+ * option) any later version.
+ *
+ * On Debian GNU/Linux systems, the complete text of version 2 of the GNU
+ * General Public License can be found in `/usr/share/common-licenses/GPL-2'
+ */
+
+#pragma once
+
+#include <memory>
+#include <unordered_map>
+
+/**
+ * Forward declaration of class.
+ */
+class CMaildir;
+
+
+/**
+ * A watched directory: either the cur/ or new/ directory of a maildir.
+ */
+struct CWatchedDirectory
+{
+    /**
+     * The maildir the directory belongs to.
+     */
+    std::shared_ptr<CMaildir> maildir;
+
+    /**
+     * Is this the new/ directory, rather than cur/?
+     */
+    bool is_new;
+};
+
+
+/**
+ * Singleton class which watches the cur/ and new/ directories of
+ * each maildir, and keeps the maildir message-counts up to date as
+ * messages are created, renamed, and deleted.
+ *
+ * This means the maildir-view doesn't need to stat() every folder
+ * on every redraw.
+ *
+ * If inotify isn't available, (or INOTIFY isn't defined at compile time),
+ * then nothing is watched, and maildirs fall back to checking their
+ * modification times each time the idle maildir-view is redrawn.
+ */
+class CWatcher
+{
+
+public:
+
+    /**
+     * Get access to the singleton instance.
+     */
+    static CWatcher *Instance();
+
+    /**
+     * Start watching the given maildir.
+     */
+    void watch( std::shared_ptr<CMaildir> maildir );
+
+    /**
+     * Stop watching all maildirs.
+     */
+    void clear();
+
+    /**
+     * Process any pending events, without blocking.
+     *
+     * Returns true if any maildir changed.
+     */
+    bool process_events();
+
+    /**
+     * The descriptor which becomes readable when events are pending,
+     * or -1 if nothing is being watched.
+     */
+    int fd();
+
+    /**
+     * Are all the maildirs we've been given being watched?
+     *
+     * If not the caller must poll for changes to the others.
+     */
+    bool watching_all();
+
+protected:
+
+    /**
+     * Protected functions to allow our singleton implementation.
+     */
+    CWatcher();
+    CWatcher(const CWatcher &);
+    CWatcher & operator=(const CWatcher &);
+
+private:
+
+    /**
+     * Add a watch for a single directory, returning its descriptor, or
+     * -1 on failure.
+     */
+    int add_watch( std::shared_ptr<CMaildir> maildir, bool is_new );
+
+    /**
+     * The single instance of this class.
+     */
+    static CWatcher *pinstance;
+
+    /**
+     * The inotify file-descriptor, -1 if unavailable.
+     */
+    int m_fd;
+
+    /**
+     * The directories we're watching, keyed by watch-descriptor.
+     */
+    std::unordered_map<int, CWatchedDirectory> m_watches;
+
+    /**
+     * The number of maildirs we failed to watch, or stopped watching.
+     */
+    int m_unwatched;
+
+};
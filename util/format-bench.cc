@@ -0,0 +1,287 @@
+/**
+ * Benchmark the compiled format-strings against the previous expansion,
+ * which searched the format for every field on every call.
+ *
+ * Usage: format-bench [count] [index-format] [maildir-format]
+ *
+ */
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "format.h"
+
+
+/**
+ * A synthetic message, and folder.
+ */
+struct TMessage
+{
+    std::string flags;
+    std::string from;
+    std::string to;
+    std::string subject;
+    std::string date;
+};
+
+struct TFolder
+{
+    std::string path;
+    std::string name;
+    int total;
+    int unread;
+};
+
+
+/**
+ * Build lists of plausible messages and folders.
+ */
+std::vector<TMessage> make_messages( size_t count )
+{
+    const char *names[]    = { "Alice", "bob", "Carol", "dave", "Eve", "mallory", "Trent", "walter" };
+    const char *subjects[] = { "Re: lunch", "Build failure", "RE: the release", "meeting notes", "[list] Weekly digest", "Your invoice" };
+    const char *flags[]    = { "", "S", "RS", "FS", "N" };
+
+    std::vector<TMessage> result;
+    result.reserve( count );
+
+    srand( 42 );
+    for( size_t i = 0; i < count; i++ )
+    {
+        char buf[128];
+        TMessage m;
+
+        m.flags = flags[rand() % 5];
+
+        snprintf( buf, sizeof(buf)-1, "%s <user%d@example.com>", names[rand() % 8], rand() % 500 );
+        m.from = buf;
+        m.to   = "steve@example.com";
+
+        snprintf( buf, sizeof(buf)-1, "%s %d", subjects[rand() % 6], rand() % 1000 );
+        m.subject = buf;
+
+        snprintf( buf, sizeof(buf)-1, "Sun, %d Aug 2015 12:00:00 +0000", 1 + rand() % 28 );
+        m.date = buf;
+
+        result.push_back( m );
+    }
+    return( result );
+}
+
+std::vector<TFolder> make_folders( size_t count )
+{
+    std::vector<TFolder> result;
+    result.reserve( count );
+
+    for( size_t i = 0; i < count; i++ )
+    {
+        char buf[128];
+        TFolder f;
+
+        snprintf( buf, sizeof(buf)-1, "folder-%zu", i );
+        f.name = buf;
+        f.path = std::string( "/home/steve/Maildir/" ) + buf;
+        f.total  = rand() % 5000;
+        f.unread = rand() % 10;
+
+        result.push_back( f );
+    }
+    return( result );
+}
+
+
+/**
+ * The previous message expansion.
+ */
+std::string naive_message( const TMessage &m, const std::string &fmt )
+{
+    std::string result = fmt;
+
+    const char *fields[] = { "$FLAGS", "$FROM", "$TO", "$SUBJECT", "$DATE", 0 };
+
+    for( int i = 0 ; fields[i] ; ++i)
+    {
+        size_t offset = result.find( fields[i], 0 );
+
+        if ( ( offset != std::string::npos ) && ( offset < result.size() ) )
+        {
+            std::string before = result.substr(0, offset);
+            std::string body = "";
+            std::string after  = result.substr(offset+strlen(fields[i]));
+
+            if ( strcmp(fields[i] , "$TO" ) == 0 )
+                body = m.to;
+            if ( strcmp(fields[i] , "$DATE" ) == 0 )
+                body = m.date;
+            if ( strcmp(fields[i] , "$FROM" ) == 0 )
+                body += m.from;
+            if ( strcmp(fields[i] , "$FLAGS" ) == 0 )
+            {
+                body = m.flags;
+                while( body.size() < 4 )
+                    body += " ";
+            }
+            if ( strcmp(fields[i] , "$SUBJECT" ) == 0 )
+                body = m.subject;
+
+            result = before + body + after;
+        }
+    }
+    return( result );
+}
+
+
+/**
+ * The previous maildir expansion.
+ */
+std::string naive_maildir( const TFolder &f, const std::string &fmt )
+{
+    std::string result = fmt;
+
+    const char *fields[] = { "$CHECK", "$TOTAL", "$UNREAD", "$PATH", "$NAME", 0 };
+
+    for( int i = 0 ; fields[i] ; ++i)
+    {
+        size_t offset = result.find( fields[i], 0 );
+
+        if ( ( offset != std::string::npos ) && ( offset < result.size() ) )
+        {
+            result.erase( offset, strlen( fields[i] ) );
+
+            std::ostringstream convert;
+
+            if ( strcmp(fields[i] , "$CHECK" ) == 0 )
+                result.insert(offset, "[ ]" );
+            if ( strcmp(fields[i] , "$TOTAL" ) == 0 )
+            {
+                convert << std::setfill('0') << std::setw(4) << f.total;
+                result.insert(offset, convert.str());
+            }
+            if ( strcmp(fields[i] , "$UNREAD" ) == 0 )
+            {
+                convert << std::setfill('0') << std::setw(4) << f.unread;
+                result.insert(offset, convert.str());
+            }
+            if ( strcmp(fields[i] , "$PATH" ) == 0 )
+                result.insert(offset, f.path);
+            if ( strcmp(fields[i] , "$NAME" ) == 0 )
+                result.insert(offset, f.name);
+        }
+    }
+    return( result );
+}
+
+
+/**
+ * Milliseconds since the given time.
+ */
+double elapsed( std::chrono::steady_clock::time_point start )
+{
+    std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+    return( d.count() * 1000 );
+}
+
+
+int main( int argc, char *argv[] )
+{
+    size_t count = 100000;
+    if ( argc > 1 )
+        count = strtoul( argv[1], NULL, 10 );
+
+    std::string index_format   = "[$FLAGS] $FROM - $SUBJECT";
+    std::string maildir_format = "$CHECK - $UNREAD/$TOTAL - $PATH";
+    if ( argc > 2 )
+        index_format = argv[2];
+    if ( argc > 3 )
+        maildir_format = argv[3];
+
+    std::vector<TMessage> messages = make_messages( count );
+    std::vector<TFolder>  folders  = make_folders( count );
+
+    /**
+     * Keep the compiler from discarding the work.
+     */
+    size_t total = 0;
+
+    std::cout << "Formatting " << count << " rows" << std::endl;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (const TMessage &m : messages)
+        total += naive_message( m, index_format ).size();
+    printf( "  %-28s %10.2fms\n", "index (uncompiled)", elapsed( start ) );
+
+    static const char *message_fields[] = { "FLAGS", "FROM", "TO", "SUBJECT", "DATE", 0 };
+    std::vector<std::string> values( 5 );
+    std::string buffer;
+
+    start = std::chrono::steady_clock::now();
+    for (const TMessage &m : messages)
+    {
+        std::shared_ptr<CFormat> compiled = CFormat::compile( index_format, message_fields );
+
+        if ( compiled->uses( 0 ) )
+        {
+            values[0] = m.flags;
+            while( values[0].size() < 4 )
+                values[0] += " ";
+        }
+        if ( compiled->uses( 1 ) )
+            values[1] = m.from;
+        if ( compiled->uses( 2 ) )
+            values[2] = m.to;
+        if ( compiled->uses( 3 ) )
+            values[3] = m.subject;
+        if ( compiled->uses( 4 ) )
+            values[4] = m.date;
+
+        compiled->render( values, buffer );
+        total += buffer.size();
+    }
+    printf( "  %-28s %10.2fms\n", "index (compiled)", elapsed( start ) );
+
+
+    start = std::chrono::steady_clock::now();
+    for (const TFolder &f : folders)
+        total += naive_maildir( f, maildir_format ).size();
+    printf( "  %-28s %10.2fms\n", "maildir (uncompiled)", elapsed( start ) );
+
+    static const char *maildir_fields[] = { "CHECK", "TOTAL", "UNREAD", "PATH", "NAME", 0 };
+
+    start = std::chrono::steady_clock::now();
+    for (const TFolder &f : folders)
+    {
+        std::shared_ptr<CFormat> compiled = CFormat::compile( maildir_format, maildir_fields );
+        char num[16];
+
+        if ( compiled->uses( 0 ) )
+            values[0] = "[ ]";
+        if ( compiled->uses( 1 ) )
+        {
+            snprintf( num, sizeof(num), "%04d", f.total );
+            values[1] = num;
+        }
+        if ( compiled->uses( 2 ) )
+        {
+            snprintf( num, sizeof(num), "%04d", f.unread );
+            values[2] = num;
+        }
+        if ( compiled->uses( 3 ) )
+            values[3] = f.path;
+        if ( compiled->uses( 4 ) )
+            values[4] = f.name;
+
+        compiled->render( values, buffer );
+        total += buffer.size();
+    }
+    printf( "  %-28s %10.2fms\n", "maildir (compiled)", elapsed( start ) );
+
+    std::cout << "(" << total << " bytes)" << std::endl;
+    return 0;
+}
@@ -0,0 +1,146 @@
+/**
+ * Benchmark the compiled sort-orders against a synthetic message list.
+ *
+ * Usage: sort-bench [count] [spec ...]
+ *
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "sort.h"
+
+
+/**
+ * A synthetic message: the raw headers, as CMessage would return them.
+ */
+struct TMessage
+{
+    time_t mtime;
+    time_t date;
+    std::string subject;
+    std::string from;
+};
+
+
+/**
+ * Build a list of messages with plausible, and partially duplicated,
+ * keys - so that multi-key sorts have ties to break.
+ */
+std::vector<TMessage> make_messages( size_t count )
+{
+    const char *names[]   = { "Alice", "bob", "Carol", "dave", "Eve", "mallory", "Trent", "walter" };
+    const char *subjects[] = { "Re: lunch", "Build failure", "RE: the release", "meeting notes", "[list] Weekly digest", "Your invoice" };
+
+    std::vector<TMessage> result;
+    result.reserve( count );
+
+    srand( 42 );
+    for( size_t i = 0; i < count; i++ )
+    {
+        char buf[128];
+        TMessage m;
+
+        m.mtime = 1400000000 + ( rand() % 100000000 );
+        m.date  = m.mtime - ( rand() % 3600 );
+
+        snprintf( buf, sizeof(buf)-1, "%s <user%d@example.com>", names[rand() % 8], rand() % 500 );
+        m.from = buf;
+
+        snprintf( buf, sizeof(buf)-1, "%s %d", subjects[rand() % 6], rand() % 1000 );
+        m.subject = buf;
+
+        result.push_back( m );
+    }
+    return( result );
+}
+
+
+/**
+ * The previous comparator: copy and fold both subjects on every call.
+ */
+bool naive_subject( const TMessage &a, const TMessage &b )
+{
+    std::string as = a.subject;
+    std::string bs = b.subject;
+
+    std::transform(as.begin(), as.end(), as.begin(), tolower);
+    std::transform(bs.begin(), bs.end(), bs.begin(), tolower);
+
+    return( as < bs );
+}
+
+
+/**
+ * Time the sorting of the messages by the given specification, including
+ * the cost of building the sort-keys.
+ */
+double time_sort( const std::vector<TMessage> &messages, const std::string &spec )
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    CSortOrder order( spec );
+    std::vector<CSortRecord> records( messages.size() );
+
+    for( size_t i = 0; i < messages.size(); i++ )
+    {
+        records[i].index = i;
+        records[i].mtime = messages[i].mtime;
+        records[i].date  = messages[i].date;
+
+        if ( order.uses( SORT_SUBJECT ) )
+            records[i].subject = CSortOrder::fold( messages[i].subject );
+        if ( order.uses( SORT_FROM ) )
+            records[i].from = CSortOrder::fold( messages[i].from );
+    }
+
+    order.sort( records );
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return( elapsed.count() * 1000 );
+}
+
+
+int main( int argc, char *argv[] )
+{
+    size_t count = 100000;
+    if ( argc > 1 )
+        count = strtoul( argv[1], NULL, 10 );
+
+    std::vector<std::string> specs;
+    for( int i = 2; i < argc; i++ )
+        specs.push_back( argv[i] );
+
+    if ( specs.empty() )
+    {
+        specs.push_back( "date-asc" );
+        specs.push_back( "header-desc" );
+        specs.push_back( "subject" );
+        specs.push_back( "from" );
+        specs.push_back( "from,date-desc" );
+        specs.push_back( "subject-desc,from,header" );
+    }
+
+    std::vector<TMessage> messages = make_messages( count );
+    std::cout << "Sorting " << count << " messages" << std::endl;
+
+    for( std::string spec : specs )
+        printf( "  %-28s %10.2fms\n", spec.c_str(), time_sort( messages, spec ) );
+
+    /**
+     * For comparison, the old per-comparison folding.
+     */
+    std::vector<TMessage> copy = messages;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::sort( copy.begin(), copy.end(), naive_subject );
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    printf( "  %-28s %10.2fms\n", "subject (uncompiled)", elapsed.count() * 1000 );
+
+    return 0;
+}